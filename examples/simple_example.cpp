@@ -37,6 +37,7 @@
 #include "SCSITestUnitReady.h"
 #include "SCSIInquiry.h"
 #include "SCSIReadCapacity.h"
+#include "SCSIRetryPolicy.h"
 
 #include "EString.h"
 #include "CException.h"
@@ -81,50 +82,16 @@ static bool ReportOnLuns(myiSCSILibWrapper &iscsi,
     for (unsigned int i = 0; i < reportLuns.GetLunCount(); i++)
     {
         SCSITestUnitReady tur;
+        SCSIRetryPolicy retryPolicy;
 
         unsigned int lun = reportLuns.GetLun(i);
 
         printf("\nAbout to issue TEST UNIT READY for lun %u\n", lun);
 
-        // If this is the first command, we expect a BUS RESET, so
-        // could test for that ...
-        iscsi.iSCSIExecSCSISync(tur, lun);
+        // If this is the first command, we expect a BUS RESET. The default
+        // retry policy retries UNIT ATTENTIONs for us.
+        iscsi.iSCSIExecSCSISyncRetry(tur, lun, retryPolicy);
         if (tur.GetStatus() != SCSI_STATUS_GOOD)
-        {
-            // Check what the problem is
-            if (tur.GetStatus() != SCSI_STATUS_GOOD)
-            {
-                unsigned int ascq = tur.GetSCSIASCQ();
-
-                if (ascq == SCSI_SENSE_ASCQ_BUS_RESET)
-                    printf("Received expected BUS RESET\n");
-                else 
-                {
-                    printf("Test Unit Ready failed: "
-                           "Status: %s, SenseKey: %s, ASCQ: %s\n",
-                           tur.StatusString().c_str(),
-                           tur.SenseKeyString().c_str(),
-                           tur.ASCQString().c_str());
-                    return false;
-                }
-            }
-            else
-            {
-                printf("Test Unit Ready failed: "
-                       "Status: %s, SenseKey: %s, ASCQ: %s\n",
-                       tur.StatusString().c_str(),
-                       tur.SenseKeyString().c_str(),
-                       tur.ASCQString().c_str());
-                return false;
-            }
-        }
-
-        // Now, send another TUR to see if all OK.
-        SCSITestUnitReady tur2;
-
-        iscsi.iSCSIExecSCSISync(tur2, lun);
-
-        if (tur2.GetStatus() != SCSI_STATUS_GOOD)
         {
             printf("Test Unit Ready failed: "
                    "Status: %s, SenseKey: %s, ASCQ: %s\n",
@@ -134,6 +101,9 @@ static bool ReportOnLuns(myiSCSILibWrapper &iscsi,
             return false;
         }
 
+        if (retryPolicy.GetCounters().unitAttentions)
+            printf("Received expected BUS RESET\n");
+
         /*
          * Send an Inquiry
          * 
@@ -296,36 +266,21 @@ int main(int argc, char *argv[])
         // Now, log in ...
         iscsi.iSCSINormalLogin();
 
-        // Now, find out how many LUNs there are.
-        SCSIReportLuns *reportLuns = new SCSIReportLuns();
+        // Now, find out how many LUNs there are. If there are more than
+        // fit, the request is resized and sent again for us.
+        SCSIReportLuns reportLuns;
+        SCSIRetryPolicy retryPolicy;
 
         printf("\nSending REPORT LUNS request\n");
-        iscsi.iSCSIExecSCSISync(*reportLuns, 0);  // Always against LUN 0
-
-        printf("Number of LUNs reported: %u\n", reportLuns->GetLunCount());
-
-        // Check if we had a SCSI_RESIDUAL_OVERFLOW
-        if (reportLuns->GetResidualType() == SCSI_RESIDUAL_OVERFLOW)
-        {
-            // Try again
-            printf("Underflow on REPORT LUNS!\n");
-            unsigned int size = reportLuns->GetInBufferTransferSize() +
-                                reportLuns->GetResidual();
-            printf("Trying REPORT LUNS with larger buffer size of %u\n", size);
-            delete reportLuns;
-
-            // Allocate a new object with the correct buffer size
-            reportLuns = new SCSIReportLuns(size);
+        // Always against LUN 0
+        iscsi.iSCSIExecSCSISyncSized(reportLuns, 0, retryPolicy);
+        if (reportLuns.GetStatus() != SCSI_STATUS_GOOD)
+            throw CException("REPORT LUNS failed");
 
-            iscsi.iSCSIExecSCSISync(*reportLuns, 0);
-        }
+        printf("Number of LUNs reported: %u\n", reportLuns.GetLunCount());
 
-        if (!ReportOnLuns(iscsi, *reportLuns)) {
-            delete reportLuns;  // Gotta free it!
+        if (!ReportOnLuns(iscsi, reportLuns))
             throw CException("Error reporting on LUNS");
-        }
-
-        delete reportLuns;  // Free that object
 
         printf("\nLogging out and disconnecting\n");
         iscsi.iSCSINormalLogout();
@@ -114,6 +114,33 @@ bool SCSIInquirySupportedVPDPages::HasPage(uint8_t page)
     return false;
 }
 
+SCSIInquiryBlockLimitsVPDPage::SCSIInquiryBlockLimitsVPDPage() :
+    SCSIInquiry(4 + 0x3C)
+{
+    SetEVPD(true);
+    setCdbByte(2, 0xB0);
+}
+
+bool SCSIInquiryBlockLimitsVPDPage::present(unsigned int offset,
+                                            unsigned int length)
+{
+    return offset + length <= GetInBufferTransferSize() &&
+           offset + length <= (unsigned int)GetPageLength() + 4;
+}
+
+uint16_t SCSIInquiryBlockLimitsVPDPage::GetOptimalTransferLengthGranularity(void)
+{
+    return present(6, 2) ? GetInBufferShort(6) : 0;
+}
+
+uint64_t SCSIInquiryBlockLimitsVPDPage::GetMaxWriteSameLength(void)
+{
+    if (!present(36, 8))
+        return 0;
+
+    return ((uint64_t)GetInBufferLong(36) << 32) | GetInBufferLong(40);
+}
+
 SCSIInquiryUnitSerialNumVPDPage::SCSIInquiryUnitSerialNumVPDPage(unsigned int size) :
     SCSIInquiry(4 + size)
 {
@@ -274,6 +301,45 @@ SCSIInquiryDeviceIdVPDPage::SCSIInquiryDeviceIdVPDPage(unsigned int size) :
     setCdbByte(2, 0x83);
 }
 
+/*
+ * Both designators are about the target port the command came in on
+ */
+bool SCSIInquiryDeviceIdVPDPage::GetTargetPortGroup(uint16_t &group)
+{
+    for (unsigned int i = 0; i < GetDescriptorCount(); i++)
+    {
+        const SCSIDeviceID &id = GetDescriptor(i);
+
+        if (id.GetIDType() == SCSIDeviceID::TARGET_PORT_GROUP &&
+            id.GetAssociation() == SCSIDeviceID::ASSOCIATION_TARGET_PORT &&
+            id.GetIDLength() >= 4)
+        {
+            group = id.GetPortIdentifier();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool SCSIInquiryDeviceIdVPDPage::GetRelativeTargetPort(uint16_t &port)
+{
+    for (unsigned int i = 0; i < GetDescriptorCount(); i++)
+    {
+        const SCSIDeviceID &id = GetDescriptor(i);
+
+        if (id.GetIDType() == SCSIDeviceID::RELATIVE_TARGET_PORT_ID &&
+            id.GetAssociation() == SCSIDeviceID::ASSOCIATION_TARGET_PORT &&
+            id.GetIDLength() >= 4)
+        {
+            port = id.GetPortIdentifier();
+            return true;
+        }
+    }
+
+    return false;
+}
+
 unsigned int SCSIInquiryDeviceIdVPDPage::GetDescriptorCount()
 {
     if (!mParsed)
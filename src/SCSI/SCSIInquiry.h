@@ -84,6 +84,41 @@ private:
 
 class SCSIDeviceID;
 
+/*
+ * The Block Limits VPD page (0xB0). Lengths are in logical blocks, and 0
+ * means the target did not say, including for fields past the end of a
+ * short (older SBC) page.
+ */
+class SCSIInquiryBlockLimitsVPDPage : public SCSIInquiry
+{
+public:
+    SCSIInquiryBlockLimitsVPDPage();
+
+    uint16_t GetPageLength(void) { return GetInBufferShort(2); }
+    bool GetWSNZ(void) { return getByte(4) & 0x01; }
+    uint8_t GetMaxCompareAndWriteLength(void) { return getByte(5); }
+    uint16_t GetOptimalTransferLengthGranularity(void);
+    uint32_t GetMaxTransferLength(void) { return getLong(8); }
+    uint32_t GetOptimalTransferLength(void) { return getLong(12); }
+    uint32_t GetMaxPrefetchLength(void) { return getLong(16); }
+    // 0 if UNMAP is not supported, 0xFFFFFFFF if there is no limit
+    uint32_t GetMaxUnmapLBACount(void) { return getLong(20); }
+    uint32_t GetMaxUnmapDescriptorCount(void) { return getLong(24); }
+    uint32_t GetOptimalUnmapGranularity(void) { return getLong(28); }
+    bool GetUnmapGranularityAlignmentValid(void) { return getByte(32) & 0x80; }
+    uint32_t GetUnmapGranularityAlignment(void)
+        { return getLong(32) & 0x7FFFFFFF; }
+    uint64_t GetMaxWriteSameLength(void);
+
+private:
+    // Is the field in what the target sent?
+    bool present(unsigned int offset, unsigned int length);
+    uint8_t getByte(unsigned int offset)
+        { return present(offset, 1) ? GetInBufferByte(offset) : 0; }
+    uint32_t getLong(unsigned int offset)
+        { return present(offset, 4) ? GetInBufferLong(offset) : 0; }
+};
+
 class SCSIInquiryUnitSerialNumVPDPage : public SCSIInquiry
 {
 public:
@@ -104,6 +139,10 @@ public:
     const SCSIDeviceID& GetDescriptor(unsigned int descNo) const {
         return mDescriptors.at(descNo); }
 
+    // For ALUA. False if the target does not say.
+    bool GetTargetPortGroup(uint16_t &group);
+    bool GetRelativeTargetPort(uint16_t &port);
+
 private:
     bool mParsed;
     std::vector<SCSIDeviceID> mDescriptors;
@@ -162,6 +201,10 @@ public:
     uint8_t GetIDShort(unsigned int offset) const {
         return mPage->GetInBufferShort(mOffset + 4 + offset);
     }
+    // The 16 bit value in TARGET_PORT_GROUP and RELATIVE_TARGET_PORT_ID
+    uint16_t GetPortIdentifier() const {
+        return mPage->GetInBufferShort(mOffset + 4 + 2);
+    }
 
 private:
     // These point into our parent
@@ -36,6 +36,31 @@ uint32_t SCSIPersistentReserveIn::GetPRGeneration() {
     return GetInBufferLong(0);
 }
 
+/*
+ * REPORT CAPABILITIES has its own length up front, the rest have the
+ * generation and then the length of what follows the 8 byte header
+ */
+unsigned int SCSIPersistentReserveIn::GetAvailableLength(void)
+{
+    if (mServiceAction == REPORT_CAPABILITIES)
+        return GetInBufferTransferSize() < 2 ? 0 : GetInBufferShort(0);
+
+    if (GetInBufferTransferSize() < 8)
+        return 0;
+
+    return GetInBufferLong(4) + 8;
+}
+
+void SCSIPersistentReserveIn::SetAllocationLength(unsigned int length)
+{
+    if (length > 0xFFFF)
+        length = 0xFFFF;
+
+    setCdbShort(0x07, length);
+    growInBuffer(length);
+    Reset();
+}
+
 SCSIPersistentReserveInReadKeys::SCSIPersistentReserveInReadKeys(
         unsigned int allocationLength) :
         SCSIPersistentReserveIn(READ_KEYS, allocationLength) {}
@@ -38,6 +38,13 @@ public:
                             unsigned int allocationLength = 255);
     virtual ~SCSIPersistentReserveIn() {}
     uint32_t GetPRGeneration();
+
+    /*
+     * The allocation length is only 16 bits, so anything past 65535 bytes
+     * can never be had.
+     */
+    virtual unsigned int GetAvailableLength(void);
+    virtual void SetAllocationLength(unsigned int length);
 private:
     ServiceAction mServiceAction;
 };
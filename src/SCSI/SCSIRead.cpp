@@ -26,6 +26,7 @@
 
 #include "SCSIRequest.h"
 #include "SCSIRead.h"
+#include "Trace.h"
 #include <boost/shared_array.hpp>
 
 SCSIRead10::SCSIRead10(unsigned int transferLength, 
@@ -45,12 +46,32 @@ SCSIRead10::SCSIRead10(unsigned int transferLength,
     SetXferDir(SCSI_XFER_READ);
 }
 
+SCSIRead10::SCSIRead10(unsigned int blocks,
+                       unsigned int blockSize,
+                       boost::shared_array<uint8_t> buffer) :
+    SCSIRequest(10),
+    mLBA(0)
+{
+    setCdbByte(0, SCSI_OPCODE_READ10); // That's a READ 10 request
+    setCdbLong(2, 0);    // Default to LBA 0
+    setCdbShort(7, blocks);
+
+    if (!buffer)
+        createInBuffer(blocks * blockSize);
+    else
+        setInBuffer(buffer, blocks * blockSize);
+
+    SetXferDir(SCSI_XFER_READ);
+}
+
 SCSIRead10::~SCSIRead10()
 {
 }
 
 void SCSIRead10::SetLBA(uint32_t lba)
 {
+    TRACE_SCOPE("build", this);
+
     mLBA = lba;
     setCdbLong(2, mLBA);
 }
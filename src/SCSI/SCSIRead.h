@@ -29,6 +29,10 @@ class SCSIRead10 : public SCSIRequest
 public:
     SCSIRead10(unsigned int transferLength,
                boost::shared_array<uint8_t> buffer = boost::shared_array<uint8_t>());
+    // The transfer length in blocks, with the buffer sized to match
+    SCSIRead10(unsigned int blocks,
+               unsigned int blockSize,
+               boost::shared_array<uint8_t> buffer = boost::shared_array<uint8_t>());
     ~SCSIRead10();
 
     void SetLBA(uint32_t lba);
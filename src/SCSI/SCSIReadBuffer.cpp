@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * READ BUFFER, for buffer and echo buffer reads and their descriptors.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include "SCSIRequest.h"
+#include "SCSIReadBuffer.h"
+#include "EString.h"
+#include "CException.h"
+#include <boost/shared_array.hpp>
+
+#define SCSI_OPCODE_READBUFFER 0x3C
+
+SCSIReadBuffer::SCSIReadBuffer(Mode mode,
+                               unsigned int length,
+                               boost::shared_array<uint8_t> buffer) :
+    SCSIRequest(10),
+    mMode(mode)
+{
+    if (mode == MODE_DESCRIPTOR || mode == MODE_ECHO_DESCRIPTOR)
+        length = 4;
+
+    // The allocation length is only three bytes
+    if (length > 0xFFFFFF)
+    {
+        EString estr;
+        estr.Format("%s: Length %u too large for READ BUFFER", __func__,
+                    length);
+        throw CException(estr);
+    }
+
+    setCdbByte(0, SCSI_OPCODE_READBUFFER);
+    setCdbBitArray(1, 0, 5, mode);
+    setCdbByte(6, length >> 16);
+    setCdbShort(7, length & 0xFFFF);
+
+    if (!buffer)
+        createInBuffer(length);
+    else
+        setInBuffer(buffer, length);
+
+    SetXferDir(SCSI_XFER_READ);
+}
+
+SCSIReadBuffer::~SCSIReadBuffer()
+{
+}
+
+void SCSIReadBuffer::SetBufferOffset(uint32_t offset)
+{
+    if (offset > 0xFFFFFF)
+    {
+        EString estr;
+        estr.Format("%s: Offset %u too large for READ BUFFER", __func__,
+                    offset);
+        throw CException(estr);
+    }
+
+    setCdbByte(3, offset >> 16);
+    setCdbShort(4, offset & 0xFFFF);
+}
+
+uint8_t SCSIReadBuffer::GetOffsetBoundary(void) const
+{
+    return mMode == MODE_DESCRIPTOR ? GetInBufferByte(0) : 0;
+}
+
+uint32_t SCSIReadBuffer::GetBufferCapacity(void) const
+{
+    if (mMode == MODE_ECHO_DESCRIPTOR)
+        return GetInBufferShort(2) & 0x1FFF;
+
+    return GetInBufferLong(0) & 0xFFFFFF;
+}
+
+bool SCSIReadBuffer::GetEBOS(void) const
+{
+    return mMode == MODE_ECHO_DESCRIPTOR && GetInBufferBool(0, 0);
+}
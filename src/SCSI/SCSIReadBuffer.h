@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __SCSIReadBuffer_h__
+#define __SCSIReadBuffer_h__
+
+#include "iSCSILibWrapper.h"
+#include "SCSIRequest.h"
+
+/*
+ * READ BUFFER (10). In data mode it reads the target's buffer, in echo mode
+ * what was last written to the echo buffer with WRITE BUFFER. Neither goes
+ * near the media, so they measure what the transport can move. The
+ * descriptor modes say how big the buffers are; they always return four
+ * bytes, so the length is ignored for them.
+ */
+class SCSIReadBuffer : public SCSIRequest
+{
+public:
+    enum Mode {
+        MODE_DATA = 0x02,
+        MODE_DESCRIPTOR = 0x03,
+        MODE_ECHO = 0x0A,
+        MODE_ECHO_DESCRIPTOR = 0x0B,
+    };
+
+    SCSIReadBuffer(Mode mode,
+                   unsigned int length = 4,
+                   boost::shared_array<uint8_t> buffer = boost::shared_array<uint8_t>());
+    ~SCSIReadBuffer();
+
+    Mode GetMode(void) const { return mMode; }
+    void SetBufferID(uint8_t id) { setCdbByte(2, id); }
+    void SetBufferOffset(uint32_t offset);
+
+    /*
+     * The descriptor, after a descriptor mode read. Offsets must be a
+     * multiple of 2^GetOffsetBoundary; 0xFF means only offset 0 works.
+     * GetBufferCapacity is in bytes for either mode. GetEBOS says whether
+     * the echo buffer is shared by all initiators.
+     */
+    uint8_t GetOffsetBoundary(void) const;
+    uint32_t GetBufferCapacity(void) const;
+    bool GetEBOS(void) const;
+
+private:
+    SCSIReadBuffer();
+    Mode mMode;
+};
+
+#endif
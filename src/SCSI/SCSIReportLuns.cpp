@@ -36,3 +36,21 @@ SCSIReportLuns::SCSIReportLuns(unsigned int allocationLength) :
     createInBuffer(allocationLength);
     SetXferDir(SCSI_XFER_READ);
 }
+
+/*
+ * The LUN list length does not include the 8 byte header
+ */
+unsigned int SCSIReportLuns::GetAvailableLength(void)
+{
+    if (GetInBufferTransferSize() < 4)
+        return 0;
+
+    return GetInBufferLong(0) + 8;
+}
+
+void SCSIReportLuns::SetAllocationLength(unsigned int length)
+{
+    setCdbLong(6, length);
+    growInBuffer(length);
+    Reset();
+}
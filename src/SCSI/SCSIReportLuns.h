@@ -32,13 +32,27 @@ public:
 
     ~SCSIReportLuns() {}
 
+    /*
+     * All the LUNs, even if there was not room for them. Use
+     * iSCSIExecSCSISyncSized to make sure there is.
+     */
     unsigned int GetLunCount() { return GetInBufferLong(0) / 8; }
 
+    virtual unsigned int GetAvailableLength(void);
+    virtual void SetAllocationLength(unsigned int length);
+
     // First 2 bytes of every 8th byte contains lun number.
     unsigned int GetLun(unsigned int lunNo)
     { 
         return GetInBufferShort((8 * (lunNo + 1)));
     }
+
+    // The whole 8 byte LUN, addressing method and all
+    uint64_t GetLunId(unsigned int lunNo)
+    {
+        return ((uint64_t)GetInBufferLong(8 * (lunNo + 1)) << 32) |
+               GetInBufferLong(8 * (lunNo + 1) + 4);
+    }
 };
 
 #endif
@@ -33,6 +33,9 @@
 #include "SCSIReportLuns.h"
 #include "SCSIRead.h"
 #include "EString.h"
+#include "CRC32C.h"
+#include "IOBufferPool.h"
+#include "Trace.h"
 #include <exception>
 #include "CException.h"
 
@@ -81,13 +84,29 @@ static uint64_t htobe64(uint64_t val)
 }
 #endif
 
+static bool zeroFill = true;
+
+void SCSIRequest::SetZeroFill(bool fill)
+{
+    zeroFill = fill;
+}
+
+bool SCSIRequest::GetZeroFill(void)
+{
+    return zeroFill;
+}
+
 SCSIRequest::SCSIRequest() :
     mExecuted(false),
     mLinkBit(false),
     mOutBuffer(NULL),
     mOutBufferSize(0),
     mInBuffer(NULL),
-    mInBufferSize(0)
+    mInBufferSize(0),
+    mInBufferValid(0),
+    mInBufferDirty(0),
+    mTimeout(0),
+    mTimedOut(false)
 {
     mTask = (struct scsi_task *)malloc(sizeof(scsi_task));
     if (mTask == NULL)
@@ -102,7 +121,11 @@ SCSIRequest::SCSIRequest(unsigned int cdbSize) :
     mOutBuffer(NULL),
     mOutBufferSize(0),
     mInBuffer(NULL),
-    mInBufferSize(0)
+    mInBufferSize(0),
+    mInBufferValid(0),
+    mInBufferDirty(0),
+    mTimeout(0),
+    mTimedOut(false)
 {
     if (cdbSize > sizeof(mTask->cdb)) {
         EString estr;
@@ -128,7 +151,11 @@ SCSIRequest::SCSIRequest(unsigned int cdbSize,
     mOutBuffer(outBuffer),
     mOutBufferSize(outBufferSize),
     mInBuffer(inBuffer),
-    mInBufferSize(inBufferSize)
+    mInBufferSize(inBufferSize),
+    mInBufferValid(0),
+    mInBufferDirty(inBufferSize),
+    mTimeout(0),
+    mTimedOut(false)
 {
     if (cdbSize > sizeof(mTask->cdb)) {
         throw CException("Invalid CDB Size");
@@ -142,6 +169,63 @@ SCSIRequest::SCSIRequest(unsigned int cdbSize,
     mTask->xfer_dir = SCSI_XFER_NONE;
 }
 
+// A fresh task carrying the same CDB as ours
+struct scsi_task *SCSIRequest::newTask(void)
+{
+    struct scsi_task *task;
+
+    task = (struct scsi_task *)malloc(sizeof(scsi_task));
+    if (task == NULL)
+        throw std::bad_alloc();  // Convert to standard exception
+    memset(task, 0, sizeof(scsi_task));
+    task->cdb_size = mTask->cdb_size;
+    task->xfer_dir = mTask->xfer_dir;
+    memcpy(task->cdb, mTask->cdb, sizeof(task->cdb));
+    return task;
+}
+
+/*
+ * Replace the task with a fresh one. libiscsi hangs the returned data and
+ * sense off the task, so this is the simplest way to get rid of them.
+ */
+void SCSIRequest::Reset(void)
+{
+    struct scsi_task *task;
+
+    TRACE_SCOPE("build", this);
+
+    task = newTask();
+    scsi_free_scsi_task(mTask);
+    mTask = task;
+    mInBufferValid = 0;
+    mExecuted = false;
+    mTimedOut = false;
+}
+
+struct scsi_task *SCSIRequest::DetachTask(void)
+{
+    struct scsi_task *task = mTask;
+
+    mTask = newTask();
+    return task;
+}
+
+uint32_t SCSIRequest::GetOutBufferDigest(void)
+{
+    if (!mOutBuffer)
+        return CRC32C(NULL, 0);
+
+    return CRC32C(mOutBuffer.get(), mOutBufferSize);
+}
+
+uint32_t SCSIRequest::GetInBufferDigest(void)
+{
+    if (!mInBuffer)
+        return CRC32C(NULL, 0);
+
+    return CRC32C(mInBuffer.get(), mInBufferValid);
+}
+
 void SCSIRequest::setCdbBitArray(unsigned int byteOffset,
                                  unsigned int startBit, // starts at 0
                                  unsigned int bitLength,
@@ -196,6 +280,15 @@ std::string SCSIRequest::StatusString()
         case SCSI_STATUS_RESERVATION_CONFLICT:
             return "RESERVATION CONFLICT";
 
+        case SCSI_STATUS_TASK_SET_FULL:
+            return "TASK SET FULL";
+
+        case SCSI_STATUS_ACA_ACTIVE:
+            return "ACA ACTIVE";
+
+        case SCSI_STATUS_TASK_ABORTED:
+            return "TASK ABORTED";
+
         case SCSI_STATUS_CANCELLED:
             return "CANCELLED";
 
@@ -285,10 +378,12 @@ void SCSIRequest::setOutBuffer(boost::shared_array<uint8_t> buffer,
     mOutBufferSize = bufferSize;
 }
 
-void SCSIRequest::createOutBuffer(unsigned int length) {
-    mOutBuffer = boost::shared_array<uint8_t>(new uint8_t[length]);
+void SCSIRequest::createOutBuffer(unsigned int length, bool data) {
+    mOutBuffer = IOBufferAllocator::GetDefault().Allocate(length);
     mOutBufferSize = length;
-    memset(mOutBuffer.get(), 0, mOutBufferSize);
+    // Parameter lists rely on the fields they do not set being zero
+    if (!data || zeroFill)
+        memset(mOutBuffer.get(), 0, mOutBufferSize);
 }
 
 void SCSIRequest::SetOutBufferBitArray(unsigned int byteOffset,
@@ -449,12 +544,62 @@ void SCSIRequest::setInBuffer(boost::shared_array<uint8_t> buffer,
 {
     mInBuffer = buffer;
     mInBufferSize = bufferSize;
+    mInBufferValid = 0;
+    mInBufferDirty = bufferSize;    // We have no idea what is in it
 }
 
 void SCSIRequest::createInBuffer(unsigned int length) {
-    mInBuffer = boost::shared_array<uint8_t>(new uint8_t[length]);
+    mInBuffer = IOBufferAllocator::GetDefault().Allocate(length);
     mInBufferSize = length;
-    memset(mInBuffer.get(), 0, mInBufferSize);
+    mInBufferValid = 0;
+    if (zeroFill)
+    {
+        memset(mInBuffer.get(), 0, mInBufferSize);
+        mInBufferDirty = 0;
+    }
+    else
+        mInBufferDirty = length;
+}
+
+void SCSIRequest::growInBuffer(unsigned int length)
+{
+    if (!mInBuffer || length > mInBufferSize)
+        createInBuffer(length);
+}
+
+void SCSIRequest::SetAllocationLength(unsigned int length)
+{
+    EString estr;
+    estr.Format("%s: Opcode 0x%02X has no allocation length to set to %u",
+                __func__, mTask->cdb[0], length);
+    throw CException(estr);
+}
+
+/*
+ * Only the bytes that may have been written need clearing
+ */
+void SCSIRequest::ResetInBuffer(void)
+{
+    if (mInBuffer && zeroFill)
+    {
+        memset(mInBuffer.get(), 0, mInBufferDirty);
+        mInBufferDirty = 0;
+    }
+    mInBufferValid = 0;
+}
+
+void SCSIRequest::SetInBufferData(const uint8_t *data, unsigned int length)
+{
+    if (!mInBuffer)
+        return;
+
+    if (length > mInBufferSize)
+        length = mInBufferSize;
+
+    memcpy(mInBuffer.get(), data, length);
+    mInBufferValid = length;
+    if (length > mInBufferDirty)
+        mInBufferDirty = length;
 }
 
 bool SCSIRequest::GetInBufferBool(unsigned int byteOffset,
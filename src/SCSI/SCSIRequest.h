@@ -108,7 +108,16 @@ public:
      *  Gets size of data actually written to the InBuffer
      *  @params[out] length Amount of data actually written to the buffer
      */
-    void ResetInBuffer(void) { if (mInBuffer) memset(mInBuffer.get(), 0, mInBufferSize); }
+    void ResetInBuffer(void);
+    /**
+     *  How much of the InBuffer holds data from the last execution. Anything
+     *  past this is zeros, or, without zero fill, whatever was there before.
+     */
+    unsigned int GetInBufferValidSize(void) { return mInBufferValid; }
+    /**
+     *  Called by the transport with the data the target returned
+     */
+    void SetInBufferData(const uint8_t *data, unsigned int length);
     unsigned int GetInBufferTransferSize(void) { return mTask->datain.size; }
     bool GetInBufferBool(unsigned int byteOffset,
                                       unsigned int bitOffset) const;
@@ -127,9 +136,75 @@ public:
     scsi_residual GetResidualType() { return mTask->residual_status; }
     unsigned int GetResidual() { return mTask->residual; }
 
+    /**
+     *  The CRC32C of the data to be sent and of the data actually
+     *  received. libiscsi has no data digest, so this is the way to check
+     *  that what comes back is what went out.
+     */
+    uint32_t GetOutBufferDigest(void);
+    uint32_t GetInBufferDigest(void);
+
     void SetExecuted(void) { mExecuted = true; }
     bool IsExecuted(void) { return mExecuted; }
 
+    /**
+     *  Prepares the request to be executed again, eg, after a retryable
+     *  status. The CDB, transfer direction and buffers are kept, but the
+     *  status, sense and returned data of the last execution are discarded.
+     */
+    void Reset(void);
+
+    /**
+     *  Hands over the task, for whoever still has a pointer to it to free,
+     *  and carries on with a fresh one with the same CDB, as Reset.
+     */
+    struct scsi_task *DetachTask(void);
+
+    /**
+     *  Can this request be sent again if the connection is lost while it is
+     *  in flight? Anything that does not write is assumed to be. Requests
+     *  that change state on the target should say no.
+     */
+    virtual bool IsRedriveSafe(void)
+        { return mTask->xfer_dir != SCSI_XFER_WRITE; }
+
+    /**
+     *  How long the transport gives this request before treating it as
+     *  hung, in mSec. 0, the default, means the session's command timeout.
+     *  See iSCSILibWrapper::SetCommandTimeout.
+     */
+    void SetTimeout(unsigned int ms) { mTimeout = ms; }
+    unsigned int GetTimeout(void) const { return mTimeout; }
+    /**
+     *  Set by the transport when it gave up on the request because its
+     *  timeout passed. The status is then SCSI_STATUS_CANCELLED.
+     */
+    void SetTimedOut(void) { mTimedOut = true; }
+    bool IsTimedOut(void) const { return mTimedOut; }
+
+    /**
+     *  For requests whose data starts with how much the target has to
+     *  return, like REPORT LUNS. How many bytes that was on the last
+     *  execution, or 0 if the request does not say. If it is more than
+     *  GetInBufferTransferSize, the data was cut short.
+     */
+    virtual unsigned int GetAvailableLength(void) { return 0; }
+    /**
+     *  Change the allocation length, ready to execute again. The InBuffer
+     *  is kept unless it is too small. Only requests that have an
+     *  allocation length support this.
+     */
+    virtual void SetAllocationLength(unsigned int length);
+
+    /**
+     *  Whether new InBuffers, and OutBuffers that carry data rather than
+     *  parameters, are zero filled. On by default. Turn it off for large
+     *  transfers where the target overwrites the buffer anyway; then only
+     *  GetInBufferValidSize bytes of an InBuffer mean anything.
+     */
+    static void SetZeroFill(bool zeroFill);
+    static bool GetZeroFill(void);
+
     std::string StatusString();
     std::string ErroTypeString();
     std::string SenseKeyString();
@@ -147,8 +222,11 @@ protected:
     /**
      *  Creates's Buffer to be sent
      *  @params[in] length positive integer describing size of buffer to create
+     *  @params[in] data true if the caller fills it all in, like WRITE data,
+     *              so it need not be zeroed when zero fill is off
+     *  The buffer is page aligned and comes from the default IOBufferAllocator
      */
-    void createOutBuffer(unsigned int length);
+    void createOutBuffer(unsigned int length, bool data = false);
     /**
      *  Set's Buffer to write recieve data to
      *  @params[in] buffer the buffer, pass NULL if empty
@@ -158,8 +236,13 @@ protected:
     /**
      *  Creates's Buffer to be sent
      *  @params[in] length positive integer describing size of buffer to create
+     *  The buffer is page aligned and comes from the default IOBufferAllocator
      */
     void createInBuffer(unsigned int length);
+    /**
+     *  Replaces the InBuffer only if it is smaller than length
+     */
+    void growInBuffer(unsigned int length);
 
     void setCdbBitArray(unsigned int byteOffset,
                         unsigned int startBit, // starts at 0
@@ -216,6 +299,8 @@ protected:
     // Dirty little secret ... 
     void scsi_clean_scsi_task(struct scsi_task *task);
 
+    struct scsi_task *newTask(void);
+
 protected:
     bool mExecuted;
     bool mLinkBit;
@@ -224,6 +309,10 @@ protected:
     unsigned int mOutBufferSize;
     boost::shared_array<uint8_t> mInBuffer;
     unsigned int mInBufferSize;
+    unsigned int mInBufferValid;    // Bytes returned by the target
+    unsigned int mInBufferDirty;    // Bytes that might not be zero
+    unsigned int mTimeout;          // mSec, 0 for the session's
+    bool mTimedOut;
 
 };
 
@@ -30,6 +30,10 @@ public:
     SCSIReserve6();
     ~SCSIReserve6();
 
+    // Losing the connection may have released the reservation. The test
+    // should see that rather than have us quietly take it again.
+    virtual bool IsRedriveSafe(void) { return false; }
+
 private:
 };
 
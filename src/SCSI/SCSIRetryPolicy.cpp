@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * The retry policy used by the iSCSILibWrapper retrying executors.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "SCSIRetryPolicy.h"
+#include "EString.h"
+
+// NOT READY, LOGICAL UNIT IS IN PROCESS OF BECOMING READY
+#define SCSI_SENSE_ASCQ_BECOMING_READY 0x0401
+
+static uint64_t senseKey(scsi_sense_key key, unsigned int ascq)
+{
+    return ((uint64_t)key << 32) | ascq;
+}
+
+SCSIRetryPolicy::SCSIRetryPolicy(unsigned int maxRetries) :
+    mMaxRetries(maxRetries),
+    mInitialBackoff(1000),      // 1mS
+    mMaxBackoff(1000000),       // 1S
+    mJitterPercent(50),
+    mSeed((unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)this),
+    mQueueDepth(1),
+    mMinQueueDepth(1),
+    mMaxQueueDepth(1),
+    mRampUpAfter(64),
+    mGoodRun(0)
+{
+    SetStatusAction(SCSI_STATUS_BUSY, ACTION_BACKOFF);
+    SetStatusAction(SCSI_STATUS_TASK_SET_FULL, ACTION_THROTTLE);
+    SetSenseAction(SCSI_SENSE_UNIT_ATTENTION, ACTION_RETRY);
+    SetSenseAction(SCSI_SENSE_NOT_READY, ACTION_BACKOFF,
+                   SCSI_SENSE_ASCQ_BECOMING_READY);
+
+    ResetCounters();
+}
+
+void SCSIRetryPolicy::SetStatusAction(scsi_status status, Action action)
+{
+    mStatusActions[status] = action;
+}
+
+void SCSIRetryPolicy::SetSenseAction(scsi_sense_key key,
+                                     Action action,
+                                     unsigned int ascq)
+{
+    mSenseActions[senseKey(key, ascq)] = action;
+}
+
+void SCSIRetryPolicy::ClearActions(void)
+{
+    mStatusActions.clear();
+    mSenseActions.clear();
+}
+
+void SCSIRetryPolicy::SetBackoff(unsigned int initialUsecs,
+                                 unsigned int maxUsecs,
+                                 unsigned int jitterPercent)
+{
+    if (jitterPercent > 100 || initialUsecs > maxUsecs)
+    {
+        EString estr;
+        estr.Format("%s: Invalid backoff: initial %u, max %u, jitter %u%%",
+                    __func__, initialUsecs, maxUsecs, jitterPercent);
+        throw CException(estr);
+    }
+
+    mInitialBackoff = initialUsecs;
+    mMaxBackoff = maxUsecs;
+    mJitterPercent = jitterPercent;
+}
+
+void SCSIRetryPolicy::SetQueueDepth(unsigned int maxDepth,
+                                    unsigned int minDepth,
+                                    unsigned int rampUpAfter)
+{
+    if (minDepth == 0 || minDepth > maxDepth)
+    {
+        EString estr;
+        estr.Format("%s: Invalid queue depth: min %u, max %u",
+                    __func__, minDepth, maxDepth);
+        throw CException(estr);
+    }
+
+    mMaxQueueDepth = maxDepth;
+    mMinQueueDepth = minDepth;
+    mQueueDepth = maxDepth;
+    mRampUpAfter = rampUpAfter;
+    mGoodRun = 0;
+}
+
+/*
+ * Find the action for this request. Sense entries are only consulted for
+ * a CHECK CONDITION. The most specific match wins.
+ */
+SCSIRetryPolicy::Action SCSIRetryPolicy::lookup(SCSIRequest &request) const
+{
+    std::map<uint64_t, Action>::const_iterator sit;
+    std::map<int, Action>::const_iterator it;
+
+    if (request.GetStatus() == SCSI_STATUS_CHECK_CONDITION)
+    {
+        sit = mSenseActions.find(senseKey(request.GetSCSISenseKey(),
+                                          request.GetSCSIASCQ()));
+        if (sit != mSenseActions.end())
+            return sit->second;
+
+        sit = mSenseActions.find(senseKey(request.GetSCSISenseKey(),
+                                          ANY_ASCQ));
+        if (sit != mSenseActions.end())
+            return sit->second;
+    }
+
+    it = mStatusActions.find(request.GetStatus());
+    if (it != mStatusActions.end())
+        return it->second;
+
+    return ACTION_NONE;
+}
+
+void SCSIRetryPolicy::recordRetry(SCSIRequest &request, Action action)
+{
+    mCounters.retries++;
+
+    switch (request.GetStatus())
+    {
+    case SCSI_STATUS_BUSY:
+        mCounters.busy++;
+        break;
+    case SCSI_STATUS_TASK_SET_FULL:
+        mCounters.taskSetFull++;
+        break;
+    case SCSI_STATUS_CHECK_CONDITION:
+        if (request.GetSCSISenseKey() == SCSI_SENSE_UNIT_ATTENTION)
+        {
+            mCounters.unitAttentions++;
+            break;
+        }
+        // Fall through
+    default:
+        mCounters.otherRetries++;
+        break;
+    }
+
+    // The data has to go over the wire again
+    if (request.GetTask()->xfer_dir == SCSI_XFER_READ)
+        mCounters.retriedBytes += request.GetInBufferSize();
+    else if (request.GetTask()->xfer_dir == SCSI_XFER_WRITE)
+        mCounters.retriedBytes += request.GetOutBufferSize();
+
+    if (action == ACTION_THROTTLE)
+    {
+        unsigned int depth = mQueueDepth / 2;
+
+        if (depth < mMinQueueDepth)
+            depth = mMinQueueDepth;
+        if (depth != mQueueDepth)
+        {
+            mQueueDepth = depth;
+            mCounters.queueDepthDrops++;
+        }
+    }
+
+    mGoodRun = 0;
+}
+
+SCSIRetryPolicy::Action SCSIRetryPolicy::Classify(SCSIRequest &request,
+                                                  unsigned int retries)
+{
+    Action action = lookup(request);
+
+    mCounters.attempts++;
+
+    if (action != ACTION_NONE && retries >= mMaxRetries)
+    {
+        mCounters.exhausted++;
+        action = ACTION_NONE;
+    }
+
+    if (action != ACTION_NONE)
+    {
+        recordRetry(request, action);
+        return action;
+    }
+
+    mCounters.commands++;
+
+    // Additive increase once the target has been keeping up for a while
+    if (request.GetStatus() == SCSI_STATUS_GOOD &&
+        mQueueDepth < mMaxQueueDepth &&
+        ++mGoodRun >= mRampUpAfter)
+    {
+        mQueueDepth++;
+        mGoodRun = 0;
+    }
+
+    return ACTION_NONE;
+}
+
+unsigned int SCSIRetryPolicy::GetBackoffDelay(unsigned int retries)
+{
+    uint64_t delay = mInitialBackoff;
+    unsigned int jitter;
+
+    // Avoid shifting past the top, the cap takes over long before that
+    for (unsigned int i = 0; i < retries && delay < mMaxBackoff; i++)
+        delay *= 2;
+    if (delay > mMaxBackoff)
+        delay = mMaxBackoff;
+
+    jitter = (unsigned int)(delay * mJitterPercent / 100);
+    if (jitter)
+        delay -= rand_r(&mSeed) % (jitter + 1);
+
+    mCounters.backoffUsecs += delay;
+    return (unsigned int)delay;
+}
+
+void SCSIRetryPolicy::ResetCounters(void)
+{
+    memset(&mCounters, 0, sizeof(mCounters));
+}
+
+std::string SCSIRetryPolicy::CountersString(void) const
+{
+    EString str;
+
+    str.Format("commands %llu, attempts %llu, retries %llu "
+               "(busy %llu, task set full %llu, unit attention %llu, "
+               "other %llu), exhausted %llu, retried bytes %llu, "
+               "backoff %llu uS, queue depth %u/%u (%llu drops)",
+               (unsigned long long)mCounters.commands,
+               (unsigned long long)mCounters.attempts,
+               (unsigned long long)mCounters.retries,
+               (unsigned long long)mCounters.busy,
+               (unsigned long long)mCounters.taskSetFull,
+               (unsigned long long)mCounters.unitAttentions,
+               (unsigned long long)mCounters.otherRetries,
+               (unsigned long long)mCounters.exhausted,
+               (unsigned long long)mCounters.retriedBytes,
+               (unsigned long long)mCounters.backoffUsecs,
+               mQueueDepth, mMaxQueueDepth,
+               (unsigned long long)mCounters.queueDepthDrops);
+    return str;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __SCSIRetryPolicy_h__
+#define __SCSIRetryPolicy_h__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include "SCSIRequest.h"
+
+/**
+ * \struct SCSIRetryCounters
+ *
+ * What the retry policy has seen. The retried bytes and backoff time are
+ * the throughput lost to retries: data that had to be moved again and time
+ * during which the command was parked rather than on the wire.
+ */
+struct SCSIRetryCounters
+{
+    uint64_t commands;          // Commands completed, successfully or not
+    uint64_t attempts;          // Times a command was sent to the target
+    uint64_t retries;           // attempts - commands, roughly
+    uint64_t busy;              // BUSY statuses seen
+    uint64_t taskSetFull;       // TASK SET FULL statuses seen
+    uint64_t unitAttentions;    // UNIT ATTENTIONs retried
+    uint64_t otherRetries;      // Retries due to any other policy entry
+    uint64_t exhausted;         // Commands that ran out of retries
+    uint64_t retriedBytes;      // Data transferred again due to retries
+    uint64_t backoffUsecs;      // Time spent waiting before retries
+    uint64_t queueDepthDrops;   // Times the queue depth was reduced
+};
+
+/**
+ * \class SCSIRetryPolicy
+ *
+ * Decides what to do with a completed SCSIRequest: accept it, retry it
+ * straight away, retry it after an exponential backoff with jitter, or
+ * throttle, ie, back off and also reduce the queue depth.
+ *
+ * Actions can be set per SCSI status and per sense key, optionally
+ * qualified by ASC/ASCQ. A sense entry with an ASCQ beats one without, and
+ * any sense entry beats the entry for CHECK CONDITION.
+ *
+ * The defaults retry UNIT ATTENTION immediately (this clears the bus reset
+ * every new session sees), back off on BUSY and NOT READY/BECOMING READY
+ * and throttle on TASK SET FULL.
+ *
+ * The queue depth is a simple additive increase, multiplicative decrease
+ * controller: halved on TASK SET FULL and increased by one after a run of
+ * successful commands. Synchronous execution ignores it.
+ */
+class SCSIRetryPolicy
+{
+public:
+    enum Action {
+        ACTION_NONE,        // Command is done, good or bad
+        ACTION_RETRY,       // Retry at once
+        ACTION_BACKOFF,     // Retry after a backoff delay
+        ACTION_THROTTLE,    // Reduce queue depth and retry after a delay
+    };
+
+    enum { ANY_ASCQ = 0xFFFFFFFF };
+
+    SCSIRetryPolicy(unsigned int maxRetries = 5);
+    virtual ~SCSIRetryPolicy() {}
+
+    void SetStatusAction(scsi_status status, Action action);
+    void SetSenseAction(scsi_sense_key key, Action action,
+                        unsigned int ascq = ANY_ASCQ);
+    void ClearActions(void);
+
+    void SetMaxRetries(unsigned int maxRetries) { mMaxRetries = maxRetries; }
+    unsigned int GetMaxRetries(void) const { return mMaxRetries; }
+
+    /**
+     *  Sets the backoff. The delay before retry n (counting from 0) is
+     *  min(initial * 2^n, max) microseconds, reduced by a random amount of
+     *  up to jitterPercent percent so that many initiators do not retry in
+     *  lock step.
+     */
+    void SetBackoff(unsigned int initialUsecs,
+                    unsigned int maxUsecs,
+                    unsigned int jitterPercent = 50);
+
+    void SetQueueDepth(unsigned int maxDepth,
+                       unsigned int minDepth = 1,
+                       unsigned int rampUpAfter = 64);
+    unsigned int GetQueueDepth(void) const { return mQueueDepth; }
+    unsigned int GetMaxQueueDepth(void) const { return mMaxQueueDepth; }
+
+    /**
+     *  Works out what should happen to a request that has just completed
+     *  and updates the counters and queue depth. Executors must call this
+     *  exactly once per completed attempt.
+     *  @params[in] request the completed request
+     *  @params[in] retries how many times it has been retried already
+     */
+    virtual Action Classify(SCSIRequest &request, unsigned int retries);
+
+    /**
+     *  Returns the delay, in microseconds, before retry number 'retries'
+     *  and counts it as backoff time.
+     */
+    unsigned int GetBackoffDelay(unsigned int retries);
+
+    const SCSIRetryCounters &GetCounters(void) const { return mCounters; }
+    void ResetCounters(void);
+    std::string CountersString(void) const;
+
+protected:
+    Action lookup(SCSIRequest &request) const;
+    void recordRetry(SCSIRequest &request, Action action);
+
+    unsigned int mMaxRetries;
+    unsigned int mInitialBackoff;
+    unsigned int mMaxBackoff;
+    unsigned int mJitterPercent;
+    unsigned int mSeed;
+
+    unsigned int mQueueDepth;
+    unsigned int mMinQueueDepth;
+    unsigned int mMaxQueueDepth;
+    unsigned int mRampUpAfter;
+    unsigned int mGoodRun;
+
+    std::map<int, Action> mStatusActions;
+    // Keyed by (sense key << 32) | ascq
+    std::map<uint64_t, Action> mSenseActions;
+
+    SCSIRetryCounters mCounters;
+};
+
+#endif
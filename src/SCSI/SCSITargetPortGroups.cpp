@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * REPORT and SET TARGET PORT GROUPS, for ALUA.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include "SCSIRequest.h"
+#include "SCSITargetPortGroups.h"
+#include "EString.h"
+#include "CException.h"
+
+#define SCSI_OPCODE_MAINTENANCE_IN  0xA3
+#define SCSI_OPCODE_MAINTENANCE_OUT 0xA4
+#define SCSI_SA_TARGET_PORT_GROUPS  0x0A
+
+SCSIReportTargetPortGroups::SCSIReportTargetPortGroups(
+        unsigned int allocationLength) :
+    SCSIRequest(12),
+    mParsed(false)
+{
+    setCdbByte(0, SCSI_OPCODE_MAINTENANCE_IN);
+    setCdbBitArray(1, 0, 5, SCSI_SA_TARGET_PORT_GROUPS);
+    setCdbLong(6, allocationLength);
+    createInBuffer(allocationLength);
+    SetXferDir(SCSI_XFER_READ);
+}
+
+/*
+ * Each descriptor is 8 bytes plus 4 for each port. Only take those that
+ * were returned whole.
+ */
+void SCSIReportTargetPortGroups::parse(void)
+{
+    unsigned int end;
+    unsigned int next = 4;
+
+    if (mParsed)
+        return;
+
+    end = GetInBufferLong(0) + 4;
+    if (end > GetInBufferTransferSize())
+        end = GetInBufferTransferSize();
+
+    while (next + 8 <= end)
+    {
+        unsigned int length = 8 + 4 * GetInBufferByte(next + 7);
+
+        if (next + length > end)
+            break;
+
+        mOffsets.push_back(next);
+        next += length;
+    }
+
+    mParsed = true;
+}
+
+unsigned int SCSIReportTargetPortGroups::offset(unsigned int group)
+{
+    parse();
+
+    if (group >= mOffsets.size())
+    {
+        EString estr;
+        estr.Format("%s: No target port group %u, only %u",
+                    __func__, group, (unsigned int)mOffsets.size());
+        throw CException(estr);
+    }
+
+    return mOffsets[group];
+}
+
+unsigned int SCSIReportTargetPortGroups::GetGroupCount(void)
+{
+    parse();
+    return mOffsets.size();
+}
+
+uint16_t SCSIReportTargetPortGroups::GetGroupId(unsigned int group)
+{
+    return GetInBufferShort(offset(group) + 2);
+}
+
+SCSIReportTargetPortGroups::AccessState
+SCSIReportTargetPortGroups::GetAccessState(unsigned int group)
+{
+    return (AccessState)GetInBufferBitArray(offset(group), 0, 4);
+}
+
+bool SCSIReportTargetPortGroups::GetPreferred(unsigned int group)
+{
+    return GetInBufferBool(offset(group), 7);
+}
+
+uint8_t SCSIReportTargetPortGroups::GetStatusCode(unsigned int group)
+{
+    return GetInBufferByte(offset(group) + 5);
+}
+
+unsigned int SCSIReportTargetPortGroups::GetPortCount(unsigned int group)
+{
+    return GetInBufferByte(offset(group) + 7);
+}
+
+uint16_t SCSIReportTargetPortGroups::GetRelativePortId(unsigned int group,
+                                                       unsigned int port)
+{
+    if (port >= GetPortCount(group))
+    {
+        EString estr;
+        estr.Format("%s: No port %u in target port group %u",
+                    __func__, port, group);
+        throw CException(estr);
+    }
+
+    return GetInBufferShort(offset(group) + 8 + 4 * port + 2);
+}
+
+unsigned int SCSIReportTargetPortGroups::GetAvailableLength(void)
+{
+    if (GetInBufferTransferSize() < 4)
+        return 0;
+
+    return GetInBufferLong(0) + 4;
+}
+
+void SCSIReportTargetPortGroups::SetAllocationLength(unsigned int length)
+{
+    setCdbLong(6, length);
+    growInBuffer(length);
+    Reset();
+    mParsed = false;
+    mOffsets.clear();
+}
+
+std::string SCSIReportTargetPortGroups::AccessStateString(AccessState state)
+{
+    switch (state)
+    {
+    case ACTIVE_OPTIMIZED:
+        return "active/optimized";
+    case ACTIVE_NON_OPTIMIZED:
+        return "active/non-optimized";
+    case STANDBY:
+        return "standby";
+    case UNAVAILABLE:
+        return "unavailable";
+    case LBA_DEPENDENT:
+        return "LBA dependent";
+    case OFFLINE:
+        return "offline";
+    case TRANSITIONING:
+        return "transitioning";
+    default:
+        return "reserved";
+    }
+}
+
+SCSISetTargetPortGroups::SCSISetTargetPortGroups(uint16_t group,
+        SCSIReportTargetPortGroups::AccessState state) :
+    SCSIRequest(12)
+{
+    setGroups(std::vector<std::pair<uint16_t,
+                          SCSIReportTargetPortGroups::AccessState> >(
+                  1, std::make_pair(group, state)));
+}
+
+SCSISetTargetPortGroups::SCSISetTargetPortGroups(
+        const std::vector<std::pair<uint16_t,
+                          SCSIReportTargetPortGroups::AccessState> > &groups) :
+    SCSIRequest(12)
+{
+    setGroups(groups);
+}
+
+/*
+ * Four reserved bytes and then four for each group
+ */
+void SCSISetTargetPortGroups::setGroups(
+        const std::vector<std::pair<uint16_t,
+                          SCSIReportTargetPortGroups::AccessState> > &groups)
+{
+    unsigned int length = 4 + 4 * groups.size();
+
+    if (!groups.size())
+        throw CException("SCSISetTargetPortGroups: No groups to set");
+
+    setCdbByte(0, SCSI_OPCODE_MAINTENANCE_OUT);
+    setCdbBitArray(1, 0, 5, SCSI_SA_TARGET_PORT_GROUPS);
+    setCdbLong(6, length);
+
+    createOutBuffer(length);
+    for (unsigned int i = 0; i < groups.size(); i++)
+    {
+        SetOutBufferBitArray(4 + 4 * i, 0, 4, groups[i].second);
+        SetOutBufferShort(4 + 4 * i + 2, groups[i].first);
+    }
+
+    SetXferDir(SCSI_XFER_WRITE);
+}
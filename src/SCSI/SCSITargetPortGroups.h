@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __SCSITargetPortGroups_h__
+#define __SCSITargetPortGroups_h__
+
+#include <vector>
+
+#include "iSCSILibWrapper.h"
+#include "SCSIRequest.h"
+
+/*
+ * REPORT TARGET PORT GROUPS, for the ALUA state of each group of target
+ * ports. Descriptors are variable length, so they are found on first use.
+ * Use iSCSIExecSCSISyncSized to get all of them.
+ */
+class SCSIReportTargetPortGroups : public SCSIRequest
+{
+public:
+    enum AccessState {
+        ACTIVE_OPTIMIZED        = 0x0,
+        ACTIVE_NON_OPTIMIZED    = 0x1,
+        STANDBY                 = 0x2,
+        UNAVAILABLE             = 0x3,
+        LBA_DEPENDENT           = 0x4,
+        OFFLINE                 = 0xE,
+        TRANSITIONING           = 0xF,
+    };
+
+    // Space for the header and a few two-port groups
+    SCSIReportTargetPortGroups(unsigned int allocationLength = 256);
+    ~SCSIReportTargetPortGroups() {}
+
+    unsigned int GetGroupCount(void);
+    uint16_t GetGroupId(unsigned int group);
+    AccessState GetAccessState(unsigned int group);
+    bool GetPreferred(unsigned int group);
+    uint8_t GetStatusCode(unsigned int group);
+    unsigned int GetPortCount(unsigned int group);
+    uint16_t GetRelativePortId(unsigned int group, unsigned int port);
+
+    virtual unsigned int GetAvailableLength(void);
+    virtual void SetAllocationLength(unsigned int length);
+
+    static std::string AccessStateString(AccessState state);
+
+private:
+    void parse(void);
+    unsigned int offset(unsigned int group);
+
+    bool mParsed;
+    std::vector<unsigned int> mOffsets;
+};
+
+/*
+ * SET TARGET PORT GROUPS, for explicit ALUA. Groups not listed are left
+ * for the target to decide.
+ */
+class SCSISetTargetPortGroups : public SCSIRequest
+{
+public:
+    SCSISetTargetPortGroups(uint16_t group,
+                            SCSIReportTargetPortGroups::AccessState state);
+    SCSISetTargetPortGroups(
+        const std::vector<std::pair<uint16_t,
+                          SCSIReportTargetPortGroups::AccessState> > &groups);
+    ~SCSISetTargetPortGroups() {}
+
+    // Asking for the same states twice does no harm
+    virtual bool IsRedriveSafe(void) { return true; }
+
+private:
+    SCSISetTargetPortGroups();
+    void setGroups(
+        const std::vector<std::pair<uint16_t,
+                          SCSIReportTargetPortGroups::AccessState> > &groups);
+};
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * Splitting large I/Os into commands that suit the target's block limits.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include "SCSITransferSplitter.h"
+#include "SCSIInquiry.h"
+#include "EString.h"
+#include "CException.h"
+
+SCSITransferSplitter::SCSITransferSplitter(uint32_t commandLimit) :
+    mCommandLimit(commandLimit),
+    mMaxTransfer(0),
+    mOptimalTransfer(0),
+    mGranularity(0),
+    mMaxUnmap(0),
+    mUnmapGranularity(0),
+    mUnmapAlignment(0)
+{
+}
+
+void SCSITransferSplitter::SetLimits(SCSIInquiryBlockLimitsVPDPage &page)
+{
+    if (!page.IsExecuted() || page.GetStatus() != SCSI_STATUS_GOOD)
+        throw CException("SCSITransferSplitter::SetLimits: No Block Limits page");
+
+    if (page.GetMaxTransferLength())
+        mMaxTransfer = page.GetMaxTransferLength();
+    if (page.GetOptimalTransferLength())
+        mOptimalTransfer = page.GetOptimalTransferLength();
+    if (page.GetOptimalTransferLengthGranularity())
+        mGranularity = page.GetOptimalTransferLengthGranularity();
+
+    SetUnmapLimits(page.GetMaxUnmapLBACount(),
+                   page.GetOptimalUnmapGranularity(),
+                   page.GetUnmapGranularityAlignmentValid() ?
+                       page.GetUnmapGranularityAlignment() : 0);
+}
+
+void SCSITransferSplitter::SetUnmapLimits(uint32_t maxBlocks,
+                                          uint32_t granularity,
+                                          uint32_t alignment)
+{
+    mMaxUnmap = maxBlocks;
+    mUnmapGranularity = granularity;
+    mUnmapAlignment = granularity ? alignment % granularity : 0;
+}
+
+uint32_t SCSITransferSplitter::GetTransferBlocks(void) const
+{
+    uint32_t limit = mCommandLimit;
+    uint32_t blocks;
+
+    if (mMaxTransfer && mMaxTransfer < limit)
+        limit = mMaxTransfer;
+
+    blocks = mOptimalTransfer && mOptimalTransfer <= limit ?
+                 mOptimalTransfer : limit;
+
+    // Whole granules, if it fits at least one
+    if (mGranularity && blocks >= mGranularity)
+        blocks -= blocks % mGranularity;
+
+    return blocks;
+}
+
+void SCSITransferSplitter::Split(uint64_t lba,
+                                 uint64_t blocks,
+                                 std::vector<SCSIExtent> &extents) const
+{
+    uint32_t size = GetTransferBlocks();
+    uint32_t first = size;
+
+    if (!size)
+        throw CException("SCSITransferSplitter::Split: Command limit is 0");
+
+    // Cut the first short so the rest start on a granule
+    if (mGranularity && size % mGranularity == 0 && lba % mGranularity)
+        first = size - lba % mGranularity;
+
+    while (blocks)
+    {
+        uint32_t length = blocks < first ? (uint32_t)blocks : first;
+
+        extents.push_back(SCSIExtent(lba, length));
+        lba += length;
+        blocks -= length;
+        first = size;
+    }
+}
+
+uint64_t SCSITransferSplitter::SplitUnmap(uint64_t lba,
+                                          uint64_t blocks,
+                                          std::vector<SCSIExtent> &extents) const
+{
+    uint64_t end = lba + blocks;
+    uint64_t size = mMaxUnmap ? mMaxUnmap : 0xFFFFFFFF;
+    uint64_t start = lba;
+
+    if (mUnmapGranularity)
+    {
+        uint64_t g = mUnmapGranularity;
+        // How far each end is past an aligned granule boundary
+        uint64_t startOff = (lba + g - mUnmapAlignment) % g;
+        uint64_t endOff = (end + g - mUnmapAlignment) % g;
+
+        if (startOff)
+            start += g - startOff;
+        // No whole granule in the range, which may end before the first
+        if (end < endOff || end - endOff <= start)
+            return blocks;
+        end -= endOff;
+
+        // Keep every command a whole number of granules
+        if (size >= g)
+            size -= size % g;
+    }
+
+    for (uint64_t next = start; next < end; next += size)
+        extents.push_back(SCSIExtent(next, (uint32_t)(end - next < size ?
+                                                      end - next : size)));
+
+    return blocks - (end - start);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __SCSITransferSplitter_h__
+#define __SCSITransferSplitter_h__
+
+#include <stdint.h>
+#include <vector>
+
+class SCSIInquiryBlockLimitsVPDPage;
+
+/**
+ * \struct SCSIExtent
+ *
+ * A run of logical blocks, ie, one command's worth
+ */
+struct SCSIExtent {
+    SCSIExtent(uint64_t l = 0, uint32_t b = 0) : lba(l), blocks(b) {}
+
+    uint64_t lba;
+    uint32_t blocks;
+};
+
+/**
+ * \class SCSITransferSplitter
+ *
+ * Not a request. Cuts a large logical I/O into commands the target likes,
+ * going by its Block Limits VPD page:
+ * - No command is longer than MAXIMUM TRANSFER LENGTH, nor than the CDB
+ *   can carry (65535 blocks for the 10 byte commands, by default),
+ * - Commands are OPTIMAL TRANSFER LENGTH long where possible, and all but
+ *   the first start on an OPTIMAL TRANSFER LENGTH GRANULARITY boundary.
+ *   The first is cut short so the rest line up.
+ * - For UNMAP, only whole unmap granules, aligned as the target says, are
+ *   unmapped, in commands of at most MAXIMUM UNMAP LBA COUNT. The partial
+ *   granules at either end would not free anything anyway.
+ * Any limit left at 0 is treated as not given.
+ */
+class SCSITransferSplitter
+{
+public:
+    SCSITransferSplitter(uint32_t commandLimit = 65535);
+
+    // Zero fields are left alone. Throws if the page has not been executed.
+    void SetLimits(SCSIInquiryBlockLimitsVPDPage &page);
+
+    void SetCommandLimit(uint32_t blocks) { mCommandLimit = blocks; }
+    void SetMaxTransfer(uint32_t blocks) { mMaxTransfer = blocks; }
+    void SetOptimalTransfer(uint32_t blocks) { mOptimalTransfer = blocks; }
+    void SetGranularity(uint32_t blocks) { mGranularity = blocks; }
+    void SetUnmapLimits(uint32_t maxBlocks,
+                        uint32_t granularity,
+                        uint32_t alignment = 0);
+
+    // The length most commands will be
+    uint32_t GetTransferBlocks(void) const;
+
+    // Appends to extents
+    void Split(uint64_t lba, uint64_t blocks,
+               std::vector<SCSIExtent> &extents) const;
+
+    /*
+     * One extent per UNMAP command. Returns how many blocks were left out
+     * because they are not whole granules.
+     */
+    uint64_t SplitUnmap(uint64_t lba, uint64_t blocks,
+                        std::vector<SCSIExtent> &extents) const;
+
+private:
+    uint32_t mCommandLimit;
+    uint32_t mMaxTransfer;
+    uint32_t mOptimalTransfer;
+    uint32_t mGranularity;
+    uint32_t mMaxUnmap;
+    uint32_t mUnmapGranularity;
+    uint32_t mUnmapAlignment;
+};
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * UNMAP, to deallocate ranges of a thin provisioned LUN.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include "SCSIRequest.h"
+#include "SCSIUnmap.h"
+#include "EString.h"
+#include "CException.h"
+
+#define SCSI_OPCODE_UNMAP 0x42
+
+SCSIUnmap::SCSIUnmap(const std::vector<SCSIExtent> &extents) :
+    SCSIRequest(10)
+{
+    setExtents(extents);
+}
+
+SCSIUnmap::SCSIUnmap(uint64_t lba, uint32_t blocks) :
+    SCSIRequest(10)
+{
+    setExtents(std::vector<SCSIExtent>(1, SCSIExtent(lba, blocks)));
+}
+
+SCSIUnmap::~SCSIUnmap()
+{
+}
+
+/*
+ * An 8 byte header and then 16 bytes for each block descriptor
+ */
+void SCSIUnmap::setExtents(const std::vector<SCSIExtent> &extents)
+{
+    unsigned int length = 8 + 16 * extents.size();
+
+    if (!extents.size() || length > 0xFFFF)
+    {
+        EString estr;
+        estr.Format("%s: Cannot UNMAP %u extents", __func__,
+                    (unsigned int)extents.size());
+        throw CException(estr);
+    }
+
+    setCdbByte(0, SCSI_OPCODE_UNMAP);
+    setCdbShort(7, length);
+
+    createOutBuffer(length);
+    SetOutBufferShort(0, length - 2);
+    SetOutBufferShort(2, length - 8);
+    for (unsigned int i = 0; i < extents.size(); i++)
+    {
+        unsigned int offset = 8 + 16 * i;
+
+        SetOutBufferLong(offset, extents[i].lba >> 32);
+        SetOutBufferLong(offset + 4, extents[i].lba & 0xFFFFFFFF);
+        SetOutBufferLong(offset + 8, extents[i].blocks);
+    }
+
+    SetXferDir(SCSI_XFER_WRITE);
+}
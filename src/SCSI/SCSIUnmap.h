@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __SCSIUnmap_h__
+#define __SCSIUnmap_h__
+
+#include <vector>
+
+#include "iSCSILibWrapper.h"
+#include "SCSIRequest.h"
+#include "SCSITransferSplitter.h"
+
+/*
+ * UNMAP, with one block descriptor per extent. Use
+ * SCSITransferSplitter::SplitUnmap to get extents the target will act on.
+ */
+class SCSIUnmap : public SCSIRequest
+{
+public:
+    SCSIUnmap(const std::vector<SCSIExtent> &extents);
+    SCSIUnmap(uint64_t lba, uint32_t blocks);
+    ~SCSIUnmap();
+
+    void SetAnchor(bool anchor) { setCdbBitArray(1, 0, 1, anchor ? 1 : 0); }
+
+    // Unmapping twice does no more harm than once
+    virtual bool IsRedriveSafe(void) { return true; }
+
+private:
+    SCSIUnmap();
+    void setExtents(const std::vector<SCSIExtent> &extents);
+};
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __SCSIWrite_h__
+#define __SCSIWrite_h__
+
+#include "iSCSILibWrapper.h"
+#include "SCSIRequest.h"
+
+/*
+ * WRITE 10. The transfer length is in blocks, so we need the block size to
+ * size the buffer. If you supply a buffer it must be at least
+ * blocks * blockSize bytes.
+ */
+class SCSIWrite10 : public SCSIRequest
+{
+public:
+    SCSIWrite10(unsigned int blocks,
+                unsigned int blockSize,
+                boost::shared_array<uint8_t> buffer = boost::shared_array<uint8_t>());
+    ~SCSIWrite10();
+
+    void SetLBA(uint32_t lba);
+    void SetFUA(bool fua) { setCdbBitArray(1, 3, 1, fua ? 1 : 0); }
+
+private:
+    SCSIWrite10();
+    unsigned int mLBA;
+};
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __SCSIWriteBuffer_h__
+#define __SCSIWriteBuffer_h__
+
+#include "iSCSILibWrapper.h"
+#include "SCSIRequest.h"
+
+/*
+ * WRITE BUFFER (10), in data or echo buffer mode. The other modes download
+ * microcode and are best left alone. The data goes to the target's memory,
+ * not its media, so this measures what the transport can move. Echo
+ * buffers are small, see SCSIReadBuffer::MODE_ECHO_DESCRIPTOR.
+ */
+class SCSIWriteBuffer : public SCSIRequest
+{
+public:
+    enum Mode {
+        MODE_DATA = 0x02,
+        MODE_ECHO = 0x0A,
+    };
+
+    SCSIWriteBuffer(Mode mode,
+                    unsigned int length,
+                    boost::shared_array<uint8_t> buffer = boost::shared_array<uint8_t>());
+    ~SCSIWriteBuffer();
+
+    Mode GetMode(void) const { return mMode; }
+    void SetBufferID(uint8_t id) { setCdbByte(2, id); }
+    void SetBufferOffset(uint32_t offset);
+
+    // Writing the same data to the same buffer twice does no harm
+    virtual bool IsRedriveSafe(void) { return true; }
+
+private:
+    SCSIWriteBuffer();
+    Mode mMode;
+};
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * CRC32C. The hardware version follows Mark Adler's: the crc32 instruction
+ * takes three cycles but can start one every cycle, so we run three
+ * independent CRCs over adjacent blocks and then stitch them together by
+ * shifting the earlier ones over the zeros the later blocks stand for.
+ */
+
+#include <string.h>
+#include <boost/thread/once.hpp>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "CRC32C.h"
+
+#define POLY 0x82f63b78
+
+// Block sizes for the three-way hardware version
+#define LONG_BLOCK 8192
+#define SHORT_BLOCK 256
+
+static uint32_t crcTable[8][256];
+static uint32_t longShift[4][256];
+static uint32_t shortShift[4][256];
+static bool haveHardware;
+static boost::once_flag initOnce = BOOST_ONCE_INIT;
+
+static uint32_t gf2MatrixTimes(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    while (vec)
+    {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2MatrixSquare(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2MatrixTimes(mat, mat[n]);
+}
+
+/*
+ * Build the operator that appends len zero bytes to a CRC. len must be a
+ * power of two.
+ */
+static void zerosOperator(uint32_t *even, size_t len)
+{
+    uint32_t odd[32];
+    uint32_t row = 1;
+
+    // One zero bit
+    odd[0] = POLY;
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2MatrixSquare(even, odd);     // Two zero bits
+    gf2MatrixSquare(odd, even);     // Four zero bits
+
+    // The first square gives one zero byte, then two, four ...
+    do
+    {
+        gf2MatrixSquare(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2MatrixSquare(odd, even);
+        len >>= 1;
+    } while (len);
+
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void zerosTable(uint32_t zeros[][256], size_t len)
+{
+    uint32_t op[32];
+
+    zerosOperator(op, len);
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        zeros[0][n] = gf2MatrixTimes(op, n);
+        zeros[1][n] = gf2MatrixTimes(op, n << 8);
+        zeros[2][n] = gf2MatrixTimes(op, n << 16);
+        zeros[3][n] = gf2MatrixTimes(op, n << 24);
+    }
+}
+
+static uint32_t shift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void init(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crcTable[0][n] = crc;
+    }
+
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = crcTable[0][n];
+
+        for (int k = 1; k < 8; k++)
+        {
+            crc = crcTable[0][crc & 0xff] ^ (crc >> 8);
+            crcTable[k][n] = crc;
+        }
+    }
+
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+    {
+        haveHardware = true;
+        zerosTable(longShift, LONG_BLOCK);
+        zerosTable(shortShift, SHORT_BLOCK);
+    }
+#endif
+}
+
+uint32_t CRC32CSoftware(const void *buf, size_t len, uint32_t crc)
+{
+    const unsigned char *next = (const unsigned char *)buf;
+    uint64_t crc0;
+
+    boost::call_once(init, initOnce);
+
+    crc0 = crc ^ 0xffffffff;
+
+    while (len && ((uintptr_t)next & 7))
+    {
+        crc0 = crcTable[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+
+    // Little endian only, like the rest of the x86 path
+    while (len >= 8)
+    {
+        crc0 ^= *(const uint64_t *)next;
+        crc0 = crcTable[7][crc0 & 0xff] ^
+               crcTable[6][(crc0 >> 8) & 0xff] ^
+               crcTable[5][(crc0 >> 16) & 0xff] ^
+               crcTable[4][(crc0 >> 24) & 0xff] ^
+               crcTable[3][(crc0 >> 32) & 0xff] ^
+               crcTable[2][(crc0 >> 40) & 0xff] ^
+               crcTable[1][(crc0 >> 48) & 0xff] ^
+               crcTable[0][crc0 >> 56];
+        next += 8;
+        len -= 8;
+    }
+
+    while (len)
+    {
+        crc0 = crcTable[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+#if defined(__x86_64__)
+
+// Spelled out so we do not need -msse4.2 for the whole library
+static inline uint64_t crc32q(uint64_t crc, const unsigned char *p)
+{
+    __asm__("crc32q\t(%1), %0" : "=r"(crc) : "r"(p), "0"(crc));
+    return crc;
+}
+
+static inline uint64_t crc32b(uint64_t crc, const unsigned char *p)
+{
+    __asm__("crc32b\t(%1), %0" : "=r"(crc) : "r"(p), "0"(crc));
+    return crc;
+}
+
+static uint32_t crc32cHardware(const void *buf, size_t len, uint32_t crc)
+{
+    const unsigned char *next = (const unsigned char *)buf;
+    const unsigned char *end;
+    uint64_t crc0, crc1, crc2;
+
+    crc0 = crc ^ 0xffffffff;
+
+    while (len && ((uintptr_t)next & 7))
+    {
+        crc0 = crc32b(crc0, next++);
+        len--;
+    }
+
+    while (len >= LONG_BLOCK * 3)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG_BLOCK;
+        do
+        {
+            crc0 = crc32q(crc0, next);
+            crc1 = crc32q(crc1, next + LONG_BLOCK);
+            crc2 = crc32q(crc2, next + LONG_BLOCK * 2);
+            next += 8;
+        } while (next < end);
+        crc0 = shift(longShift, (uint32_t)crc0) ^ crc1;
+        crc0 = shift(longShift, (uint32_t)crc0) ^ crc2;
+        next += LONG_BLOCK * 2;
+        len -= LONG_BLOCK * 3;
+    }
+
+    while (len >= SHORT_BLOCK * 3)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT_BLOCK;
+        do
+        {
+            crc0 = crc32q(crc0, next);
+            crc1 = crc32q(crc1, next + SHORT_BLOCK);
+            crc2 = crc32q(crc2, next + SHORT_BLOCK * 2);
+            next += 8;
+        } while (next < end);
+        crc0 = shift(shortShift, (uint32_t)crc0) ^ crc1;
+        crc0 = shift(shortShift, (uint32_t)crc0) ^ crc2;
+        next += SHORT_BLOCK * 2;
+        len -= SHORT_BLOCK * 3;
+    }
+
+    end = next + (len - (len & 7));
+    while (next < end)
+    {
+        crc0 = crc32q(crc0, next);
+        next += 8;
+    }
+    len &= 7;
+
+    while (len)
+    {
+        crc0 = crc32b(crc0, next++);
+        len--;
+    }
+
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+#endif
+
+uint32_t CRC32C(const void *buf, size_t len, uint32_t crc)
+{
+    boost::call_once(init, initOnce);
+
+#if defined(__x86_64__)
+    if (haveHardware)
+        return crc32cHardware(buf, len, crc);
+#endif
+
+    return CRC32CSoftware(buf, len, crc);
+}
+
+bool CRC32CHardware(void)
+{
+    boost::call_once(init, initOnce);
+
+    return haveHardware;
+}
+
+const char *CRC32CImplementation(void)
+{
+    return CRC32CHardware() ? "SSE4.2" : "table";
+}
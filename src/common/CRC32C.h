@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * CRC32C (Castagnoli), the checksum iSCSI digests use. libiscsi computes
+ * the header digest itself and has no data digest, so this is for checking
+ * data end to end, see SCSIRequest::Get{In,Out}BufferDigest, and for
+ * estimating what digests cost. Uses the SSE4.2 crc32 instruction when the
+ * CPU has it, running three streams at once to hide its latency, and
+ * slicing-by-8 tables otherwise.
+ */
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The digest of len bytes, continuing from crc. Pass the previous result
+ * as crc to digest a buffer in pieces. The initial and final inversion are
+ * done for you, so CRC32C("123456789", 9) is 0xe3069283.
+ */
+uint32_t CRC32C(const void *buf, size_t len, uint32_t crc = 0);
+
+// The table version, whatever the CPU, eg, to compare against
+uint32_t CRC32CSoftware(const void *buf, size_t len, uint32_t crc = 0);
+
+bool CRC32CHardware(void);
+const char *CRC32CImplementation(void);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * The request buffer allocators.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <new>
+
+#include "IOBufferPool.h"
+#include "NUMA.h"
+#include "EString.h"
+#include "CException.h"
+
+static IOBufferAllocator *defaultAllocator = NULL;
+static __thread IOBufferAllocator *threadAllocator = NULL;
+
+void IOBufferAllocator::SetDefault(IOBufferAllocator *allocator)
+{
+    defaultAllocator = allocator;
+}
+
+void IOBufferAllocator::SetThreadDefault(IOBufferAllocator *allocator)
+{
+    threadAllocator = allocator;
+}
+
+IOBufferAllocator &IOBufferAllocator::GetDefault(void)
+{
+    if (threadAllocator)
+        return *threadAllocator;
+
+    if (!defaultAllocator)
+        return IOBufferPool::GetInstance();
+
+    return *defaultAllocator;
+}
+
+IOBufferPool::IOBufferPool(unsigned int slabSize, bool hugePages, int node) :
+    mSlabSize(slabSize),
+    mHugePages(hugePages),
+    mNode(node)
+{
+    if (slabSize < ALIGNMENT || (slabSize & (slabSize - 1)))
+    {
+        EString estr;
+        estr.Format("%s: Slab size must be a power of two of at least %u: %u",
+                    __func__, ALIGNMENT, slabSize);
+        throw CException(estr);
+    }
+
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+/*
+ * If anything is still out there we leave the memory alone, it goes when
+ * the process does.
+ */
+IOBufferPool::~IOBufferPool()
+{
+    if (mStats.outstanding)
+        return;
+
+    for (unsigned int i = 0; i < mRegions.size(); i++)
+        munmap(mRegions[i].first, mRegions[i].second);
+}
+
+IOBufferPool &IOBufferPool::GetInstance()
+{
+    static IOBufferPool theInstance; // Note, static
+
+    return theInstance;
+}
+
+IOBufferPool &IOBufferPool::GetNodeInstance(int node)
+{
+    static boost::mutex poolsMutex;
+    static std::map<int, IOBufferPool *> pools;
+    boost::mutex::scoped_lock lock(poolsMutex);
+
+    if (node < 0 || node >= NUMANodeCount())
+    {
+        EString estr;
+        estr.Format("%s: No such NUMA node: %d", __func__, node);
+        throw CException(estr);
+    }
+
+    // Never freed, buffers from them can be anywhere
+    if (!pools[node])
+        pools[node] = new IOBufferPool(HUGE_PAGE_SIZE, false, node);
+
+    return *pools[node];
+}
+
+void IOBufferPool::SetHugePages(bool hugePages)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    mHugePages = hugePages;
+}
+
+size_t IOBufferPool::roundSize(unsigned int length)
+{
+    size_t size = ALIGNMENT;
+
+    while (size < length)
+        size <<= 1;
+
+    return size;
+}
+
+uint8_t *IOBufferPool::mapRegion(size_t size)
+{
+    void *region = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (mHugePages && !(size % HUGE_PAGE_SIZE))
+    {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED)
+            mStats.hugeRegions++;
+    }
+#endif
+
+    if (region == MAP_FAILED)
+    {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED)
+            throw std::bad_alloc();  // Convert to standard exception
+
+#ifdef MADV_HUGEPAGE
+        if (mHugePages)
+            madvise(region, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    // Before anyone touches it, or the first toucher's node wins
+    if (mNode >= 0)
+        NUMABindMemory(region, size, mNode);
+
+    mRegions.push_back(std::make_pair((uint8_t *)region, size));
+    mStats.regions++;
+    mStats.bytesMapped += size;
+
+    return (uint8_t *)region;
+}
+
+/*
+ * Called with the mutex held
+ */
+uint8_t *IOBufferPool::get(size_t size)
+{
+    std::vector<uint8_t *> &freeList = mFree[size];
+    uint8_t *buffer;
+
+    if (freeList.size())
+    {
+        buffer = freeList.back();
+        freeList.pop_back();
+        mStats.reused++;
+        return buffer;
+    }
+
+    if (size >= mSlabSize)
+        return mapRegion(size);
+
+    // Carve a new slab up, keeping the first piece
+    buffer = mapRegion(mSlabSize);
+    for (size_t offset = mSlabSize - size; offset > 0; offset -= size)
+        freeList.push_back(buffer + offset);
+
+    return buffer;
+}
+
+void IOBufferPool::release(uint8_t *buffer, size_t size)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    mFree[size].push_back(buffer);
+    mStats.outstanding--;
+}
+
+boost::shared_array<uint8_t> IOBufferPool::Allocate(unsigned int length)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    Releaser releaser;
+    uint8_t *buffer;
+
+    releaser.pool = this;
+    releaser.size = roundSize(length);
+
+    buffer = get(releaser.size);
+    mStats.allocations++;
+    mStats.outstanding++;
+
+    return boost::shared_array<uint8_t>(buffer, releaser);
+}
+
+void IOBufferPool::Prefault(unsigned int length, unsigned int count)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    size_t size = roundSize(length);
+    std::vector<uint8_t *> buffers;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        uint8_t *buffer = get(size);
+
+        // Writing is what gets us our own pages
+        for (size_t offset = 0; offset < size; offset += ALIGNMENT)
+            buffer[offset] = 0;
+        buffers.push_back(buffer);
+    }
+
+    for (unsigned int i = 0; i < buffers.size(); i++)
+        mFree[size].push_back(buffers[i]);
+}
+
+IOBufferPoolStats IOBufferPool::GetStats(void)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    return mStats;
+}
+
+std::string IOBufferPool::StatsString(void)
+{
+    IOBufferPoolStats stats = GetStats();
+    EString str;
+
+    str.Format("allocations %llu, reused %llu, regions %llu "
+               "(%llu huge), mapped %llu bytes, outstanding %llu",
+               (unsigned long long)stats.allocations,
+               (unsigned long long)stats.reused,
+               (unsigned long long)stats.regions,
+               (unsigned long long)stats.hugeRegions,
+               (unsigned long long)stats.bytesMapped,
+               (unsigned long long)stats.outstanding);
+    return str;
+}
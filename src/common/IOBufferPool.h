@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __IOBufferPool_h__
+#define __IOBufferPool_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <vector>
+#include <string>
+
+#include <boost/shared_array.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * \class IOBufferAllocator
+ *
+ * Where request buffers come from. SCSIRequest::createInBuffer and
+ * createOutBuffer get theirs from the default allocator, which is the
+ * IOBufferPool singleton unless SetDefault says otherwise.
+ */
+class IOBufferAllocator
+{
+public:
+    virtual ~IOBufferAllocator() {}
+
+    virtual boost::shared_array<uint8_t> Allocate(unsigned int length) = 0;
+
+    // The allocator must outlive every buffer it hands out
+    static void SetDefault(IOBufferAllocator *allocator);
+    // Overrides the default for the calling thread only. NULL to undo.
+    static void SetThreadDefault(IOBufferAllocator *allocator);
+    static IOBufferAllocator &GetDefault(void);
+};
+
+/**
+ * \class IOBufferHeapAllocator
+ *
+ * Plain new[], which is what SCSIRequest used to do.
+ */
+class IOBufferHeapAllocator : public IOBufferAllocator
+{
+public:
+    boost::shared_array<uint8_t> Allocate(unsigned int length)
+        { return boost::shared_array<uint8_t>(new uint8_t[length]); }
+};
+
+/**
+ * \struct IOBufferPoolStats
+ */
+struct IOBufferPoolStats {
+    uint64_t allocations;
+    uint64_t reused;            // Satisfied from a free list
+    uint64_t regions;           // Slabs and large buffers mapped
+    uint64_t hugeRegions;       // Of which backed by huge pages
+    uint64_t bytesMapped;
+    uint64_t outstanding;       // Buffers handed out and not yet freed
+};
+
+/**
+ * \class IOBufferPool
+ *
+ * Hands out page aligned buffers. Sizes are rounded up to a power of two,
+ * at least a page. Buffers up to the slab size are carved from slabs, larger
+ * ones are mapped by themselves. Either way, freed buffers go on a free list
+ * for their size and are never given back to the system, so a test that
+ * keeps reusing the same sizes stops taking page faults once warmed up.
+ *
+ * With huge pages on, slabs and large buffers are mapped with MAP_HUGETLB,
+ * which needs pages reserved in /proc/sys/vm/nr_hugepages. If none are
+ * available we fall back to normal pages and ask for transparent huge pages.
+ *
+ * Given a NUMA node, the pool's memory is bound to that node before it is
+ * first touched. GetNodeInstance keeps one pool per node for the life of
+ * the process.
+ *
+ * The contents of a buffer are whatever the last user left there.
+ */
+class IOBufferPool : public IOBufferAllocator
+{
+public:
+    enum {
+        ALIGNMENT = 4096,
+        HUGE_PAGE_SIZE = 2 * 1024 * 1024,
+    };
+
+    IOBufferPool(unsigned int slabSize = HUGE_PAGE_SIZE,
+                 bool hugePages = false,
+                 int node = -1);
+    ~IOBufferPool();
+
+    static IOBufferPool &GetInstance();
+    static IOBufferPool &GetNodeInstance(int node);
+
+    int GetNode(void) const { return mNode; }
+
+    boost::shared_array<uint8_t> Allocate(unsigned int length);
+
+    // Affects slabs mapped from now on
+    void SetHugePages(bool hugePages);
+
+    /**
+     *  Map and touch enough memory for count buffers of length bytes and put
+     *  them on the free list, so the test does not fault them in as it goes.
+     */
+    void Prefault(unsigned int length, unsigned int count);
+
+    IOBufferPoolStats GetStats(void);
+    std::string StatsString(void);
+
+private:
+    struct Releaser {
+        IOBufferPool *pool;
+        size_t size;
+        void operator()(uint8_t *buffer) { pool->release(buffer, size); }
+    };
+
+    static size_t roundSize(unsigned int length);
+    uint8_t *mapRegion(size_t size);
+    uint8_t *get(size_t size);
+    void release(uint8_t *buffer, size_t size);
+
+    boost::mutex mMutex;
+    size_t mSlabSize;
+    bool mHugePages;
+    int mNode;
+    std::map<size_t, std::vector<uint8_t *> > mFree;
+    std::vector<std::pair<uint8_t *, size_t> > mRegions;
+    IOBufferPoolStats mStats;
+};
+
+#endif
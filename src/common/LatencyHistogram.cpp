@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * Log-linear latency histograms.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <string>
+
+#include "LatencyHistogram.h"
+#include "EString.h"
+
+/*
+ * Values below SUB_BUCKETS get a bucket each. Above that, the top SUB_BITS
+ * bits below the leading one pick the bucket within its power of two.
+ */
+unsigned int LatencyHistogram::bucketOf(uint64_t value)
+{
+    unsigned int msb;
+
+    if (value < SUB_BUCKETS)
+        return (unsigned int)value;
+
+    msb = 63 - __builtin_clzll(value);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS +
+           (unsigned int)((value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucketTop(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    shift = bucket / SUB_BUCKETS - 1;
+    return ((uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+LatencyHistogram::LatencyHistogram() :
+    mBuckets((64 - SUB_BITS + 1) * SUB_BUCKETS)
+{
+    Reset();
+}
+
+void LatencyHistogram::Reset(void)
+{
+    for (unsigned int i = 0; i < mBuckets.size(); i++)
+        mBuckets[i] = 0;
+    mCount = 0;
+    mMin = ~0ULL;
+    mMax = 0;
+    mSum = 0;
+}
+
+void LatencyHistogram::Record(uint64_t value)
+{
+    mBuckets[bucketOf(value)]++;
+    mCount++;
+    mSum += value;
+    if (value < mMin)
+        mMin = value;
+    if (value > mMax)
+        mMax = value;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other)
+{
+    for (unsigned int i = 0; i < mBuckets.size(); i++)
+        mBuckets[i] += other.mBuckets[i];
+    mCount += other.mCount;
+    mSum += other.mSum;
+    if (other.mCount && other.mMin < mMin)
+        mMin = other.mMin;
+    if (other.mMax > mMax)
+        mMax = other.mMax;
+}
+
+double LatencyHistogram::GetMean(void) const
+{
+    return mCount ? mSum / mCount : 0;
+}
+
+uint64_t LatencyHistogram::GetPercentile(double percentile) const
+{
+    uint64_t wanted, seen = 0;
+
+    if (!mCount)
+        return 0;
+
+    wanted = (uint64_t)(mCount * percentile / 100.0 + 0.5);
+    if (wanted < 1)
+        wanted = 1;
+    if (wanted > mCount)
+        wanted = mCount;
+
+    for (unsigned int i = 0; i < mBuckets.size(); i++)
+    {
+        seen += mBuckets[i];
+        if (seen >= wanted)
+        {
+            uint64_t top = bucketTop(i);
+
+            // No point claiming more than we saw
+            return top > mMax ? mMax : top;
+        }
+    }
+
+    return mMax;
+}
+
+std::string LatencyHistogram::SummaryString(double divisor) const
+{
+    EString str;
+
+    str.Format("count %llu, min %.1f, mean %.1f, p50 %.1f, p90 %.1f, "
+               "p99 %.1f, p99.9 %.1f, max %.1f",
+               (unsigned long long)mCount,
+               GetMin() / divisor,
+               GetMean() / divisor,
+               GetPercentile(50) / divisor,
+               GetPercentile(90) / divisor,
+               GetPercentile(99) / divisor,
+               GetPercentile(99.9) / divisor,
+               GetMax() / divisor);
+    return str;
+}
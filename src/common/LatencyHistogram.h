@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __LatencyHistogram_h__
+#define __LatencyHistogram_h__
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+/**
+ * \class LatencyHistogram
+ *
+ * Records values, normally latencies in nanoseconds, in log-linear buckets:
+ * each power of two is split into 64 buckets, so any percentile is within
+ * about 1.5% of the true value, whatever the range. Recording is a few
+ * shifts and an increment. Not thread safe; give each thread its own and
+ * Merge them.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void Record(uint64_t value);
+    void Merge(const LatencyHistogram &other);
+    void Reset(void);
+
+    uint64_t GetCount(void) const { return mCount; }
+    uint64_t GetMin(void) const { return mCount ? mMin : 0; }
+    uint64_t GetMax(void) const { return mMax; }
+    double GetMean(void) const;
+    // percentile is 0 to 100. Returns the top of the bucket it falls in.
+    uint64_t GetPercentile(double percentile) const;
+
+    // "min ... mean ... p50 ... p99 ... max", scaled by divisor, eg, 1000
+    // for nanoseconds in uS
+    std::string SummaryString(double divisor = 1000.0) const;
+
+private:
+    enum {
+        SUB_BITS = 6,
+        SUB_BUCKETS = 1 << SUB_BITS,
+    };
+
+    static unsigned int bucketOf(uint64_t value);
+    static uint64_t bucketTop(unsigned int bucket);
+
+    std::vector<uint64_t> mBuckets;
+    uint64_t mCount;
+    uint64_t mMin;
+    uint64_t mMax;
+    double mSum;
+};
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __MPSCRing_h__
+#define __MPSCRing_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "EString.h"
+#include "CException.h"
+
+/**
+ * \class MPSCRing
+ *
+ * A bounded, lock free queue for any number of producers and one consumer,
+ * after Dmitry Vyukov's. Each slot carries a sequence number that says
+ * whose turn it is: producers claim a slot by advancing the tail with a
+ * compare and swap, fill it, then publish it by bumping its sequence. The
+ * consumer owns the head outright.
+ *
+ * The size must be a power of two.
+ */
+template <typename T>
+class MPSCRing
+{
+public:
+    MPSCRing(unsigned int size) :
+        mSlots(size),
+        mMask(size - 1),
+        mTail(0),
+        mHead(0)
+    {
+        if (size < 2 || (size & (size - 1)))
+        {
+            EString estr;
+            estr.Format("%s: Ring size must be a power of two: %u",
+                        __func__, size);
+            throw CException(estr);
+        }
+
+        for (unsigned int i = 0; i < size; i++)
+            mSlots[i].seq = i;
+    }
+
+    // Any thread. False if the ring is full.
+    bool Push(const T &item)
+    {
+        size_t pos = mTail;
+        slot *s;
+
+        for (;;)
+        {
+            intptr_t diff;
+
+            s = &mSlots[pos & mMask];
+            diff = (intptr_t)s->seq - (intptr_t)pos;
+            __sync_synchronize();
+
+            if (diff == 0)
+            {
+                if (__sync_bool_compare_and_swap(&mTail, pos, pos + 1))
+                    break;
+                pos = mTail;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = mTail;
+        }
+
+        s->item = item;
+        __sync_synchronize();
+        s->seq = pos + 1;
+        return true;
+    }
+
+    // The consumer only. False if the ring is empty.
+    bool Pop(T &item)
+    {
+        slot *s = &mSlots[mHead & mMask];
+
+        if (s->seq != mHead + 1)
+            return false;
+        __sync_synchronize();
+
+        item = s->item;
+        __sync_synchronize();
+        s->seq = mHead + mMask + 1;
+        mHead++;
+        return true;
+    }
+
+    // The consumer only
+    bool Empty(void) const
+    {
+        return mSlots[mHead & mMask].seq != mHead + 1;
+    }
+
+private:
+    struct slot {
+        volatile size_t seq;
+        T item;
+    };
+
+    std::vector<slot> mSlots;
+    size_t mMask;
+    // Apart, so producers and the consumer do not share a cache line
+    volatile size_t mTail;
+    char mPad[64];
+    size_t mHead;
+};
+
+#endif
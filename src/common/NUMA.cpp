@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * NUMA topology, thread pinning and memory binding.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <string>
+
+#include "NUMA.h"
+#include "EString.h"
+#include "CException.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+#define MPOL_PREFERRED 1
+#define MAX_NODES 1024
+
+/*
+ * Parse a sysfs list like "0-3,8-11"
+ */
+static std::vector<int> parseList(const char *list)
+{
+    std::vector<int> items;
+    const char *next = list;
+
+    while (*next && *next != '\n')
+    {
+        char *end;
+        int first, last;
+
+        first = last = strtol(next, &end, 10);
+        if (end == next)
+            break;
+        if (*end == '-')
+        {
+            next = end + 1;
+            last = strtol(next, &end, 10);
+        }
+        for (int i = first; i <= last; i++)
+            items.push_back(i);
+
+        next = end;
+        if (*next == ',')
+            next++;
+    }
+
+    return items;
+}
+
+static std::vector<int> readList(const std::string &path)
+{
+    char buf[4096];
+    FILE *file;
+
+    if (!(file = fopen(path.c_str(), "r")))
+        return std::vector<int>();
+
+    if (!fgets(buf, sizeof(buf), file))
+        buf[0] = 0;
+    fclose(file);
+
+    return parseList(buf);
+}
+
+int NUMANodeCount(void)
+{
+    std::vector<int> nodes = readList(NODE_DIR "/online");
+
+    if (!nodes.size())
+        return 1;
+
+    return nodes.back() + 1;
+}
+
+std::vector<int> NUMANodeCPUs(int node)
+{
+    EString path;
+    std::vector<int> cpus;
+
+    path.Format(NODE_DIR "/node%d/cpulist", node);
+    cpus = readList(path);
+
+    // No NUMA information. Everything is on node 0
+    if (!cpus.size() && node == 0 && NUMANodeCount() == 1)
+    {
+        long count = sysconf(_SC_NPROCESSORS_CONF);
+
+        for (long i = 0; i < count; i++)
+            cpus.push_back(i);
+    }
+
+    return cpus;
+}
+
+int NUMANodeOfCPU(int cpu)
+{
+    int nodes = NUMANodeCount();
+
+    for (int node = 0; node < nodes; node++)
+    {
+        std::vector<int> cpus = NUMANodeCPUs(node);
+
+        for (unsigned int i = 0; i < cpus.size(); i++)
+            if (cpus[i] == cpu)
+                return node;
+    }
+
+    return -1;
+}
+
+void NUMAPinThread(const std::vector<int> &cpus)
+{
+    NUMAPinThread(pthread_self(), cpus);
+}
+
+void NUMAPinThread(pthread_t thread, const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    int res;
+
+    CPU_ZERO(&set);
+    for (unsigned int i = 0; i < cpus.size(); i++)
+    {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+        {
+            EString estr;
+            estr.Format("%s: Invalid CPU: %d", __func__, cpus[i]);
+            throw CException(estr);
+        }
+        CPU_SET(cpus[i], &set);
+    }
+
+    if ((res = pthread_setaffinity_np(thread, sizeof(set), &set)))
+    {
+        EString estr;
+        estr.Format("%s: pthread_setaffinity_np failed: %s",
+                    __func__, strerror(res));
+        throw CException(estr);
+    }
+}
+
+bool NUMABindMemory(void *addr, size_t length, int node)
+{
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+
+    if (node < 0 || node >= MAX_NODES)
+        return false;
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+
+    // The kernel wants one more than the number of bits
+    return syscall(SYS_mbind, addr, length, MPOL_PREFERRED,
+                   mask, MAX_NODES + 1, 0) == 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * Just enough NUMA to keep a session, its thread and its buffers on one
+ * node. The topology comes from sysfs and memory is bound with mbind
+ * directly, so we do not need libnuma. On a machine without NUMA it all
+ * looks like one node with every CPU on it.
+ */
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+int NUMANodeCount(void);
+std::vector<int> NUMANodeCPUs(int node);
+// -1 if we cannot tell
+int NUMANodeOfCPU(int cpu);
+
+// Throw a CException if the CPUs are not usable
+void NUMAPinThread(const std::vector<int> &cpus);
+void NUMAPinThread(pthread_t thread, const std::vector<int> &cpus);
+
+/*
+ * Prefer node for the pages of a region not yet touched. Returns false if
+ * the kernel would not do it, in which case the pages go where they go.
+ */
+bool NUMABindMemory(void *addr, size_t length, int node);
+
+#endif
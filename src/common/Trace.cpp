@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * Per-thread trace rings and their export. See Trace.h.
+ */
+
+#ifdef SCSITEST_TRACE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <map>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include "Trace.h"
+#include "EString.h"
+#include "CException.h"
+
+struct TraceEvent {
+    uint64_t start;
+    uint64_t end;
+    const void *id;
+    const char *name;
+    bool async;
+};
+
+struct TraceRing {
+    std::vector<TraceEvent> events;
+    uint64_t count;
+    unsigned int thread;
+};
+
+volatile bool traceEnabled = false;
+
+static boost::mutex traceMutex;
+static std::vector<TraceRing *> traceRings;    // Never freed
+static unsigned int traceRingEvents = 65536;
+static uint64_t traceStartTicks;
+static uint64_t traceStartNs;
+static __thread TraceRing *traceRing;
+
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void TraceStart(unsigned int ringEvents)
+{
+    boost::mutex::scoped_lock lock(traceMutex);
+
+    if (!ringEvents)
+        throw CException("TraceStart: Need room for at least one event");
+
+    traceRingEvents = ringEvents;
+    for (unsigned int i = 0; i < traceRings.size(); i++)
+        traceRings[i]->count = 0;
+
+    // The TSC rate is worked out against the clock at export time
+    traceStartNs = monotonicNs();
+    traceStartTicks = TraceNow();
+    traceEnabled = true;
+}
+
+void TraceStop(void)
+{
+    traceEnabled = false;
+}
+
+void TraceRecord(const char *name, const void *id,
+                 uint64_t start, uint64_t end, bool async)
+{
+    TraceRing *ring = traceRing;
+    TraceEvent *event;
+
+    if (!ring)
+    {
+        boost::mutex::scoped_lock lock(traceMutex);
+
+        ring = new TraceRing;
+        ring->events.resize(traceRingEvents);
+        ring->count = 0;
+        ring->thread = syscall(SYS_gettid);
+        traceRings.push_back(ring);
+        traceRing = ring;
+    }
+
+    event = &ring->events[ring->count++ % ring->events.size()];
+    event->start = start;
+    event->end = end;
+    event->id = id;
+    event->name = name;
+    event->async = async;
+}
+
+/*
+ * Call fn for every event still in the rings, oldest first per thread.
+ * Times are in uS since TraceStart.
+ */
+template <class Fn>
+static void forEachEvent(Fn &fn)
+{
+    boost::mutex::scoped_lock lock(traceMutex);
+    uint64_t ticks = TraceNow() - traceStartTicks;
+    uint64_t ns = monotonicNs() - traceStartNs;
+    double ticksPerUsec = ns ? ticks * 1000.0 / ns : 1.0;
+
+    for (unsigned int i = 0; i < traceRings.size(); i++)
+    {
+        TraceRing *ring = traceRings[i];
+        uint64_t size = ring->events.size();
+        uint64_t first = ring->count > size ? ring->count - size : 0;
+
+        for (uint64_t j = first; j < ring->count; j++)
+        {
+            const TraceEvent &event = ring->events[j % size];
+
+            // From before the last TraceStart
+            if (event.start < traceStartTicks)
+                continue;
+
+            fn(ring->thread, event,
+               (event.start - traceStartTicks) / ticksPerUsec,
+               (event.end - event.start) / ticksPerUsec);
+        }
+    }
+}
+
+static FILE *openExport(const std::string &path)
+{
+    FILE *fp = fopen(path.c_str(), "w");
+
+    if (!fp)
+    {
+        EString estr;
+        estr.Format("Cannot open trace file %s: %s",
+                    path.c_str(), strerror(errno));
+        throw CException(estr);
+    }
+
+    return fp;
+}
+
+static void closeExport(FILE *fp, const std::string &path)
+{
+    if (ferror(fp) | fclose(fp))
+    {
+        EString estr;
+        estr.Format("Error writing trace file %s", path.c_str());
+        throw CException(estr);
+    }
+}
+
+struct ChromeWriter {
+    FILE *fp;
+    int pid;
+    bool first;
+
+    void operator()(unsigned int thread, const TraceEvent &event,
+                    double ts, double dur)
+    {
+        if (event.async)
+        {
+            // A begin and end pair, matched by id
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"scsi\",\"ph\":\"b\","
+                        "\"ts\":%.3f,\"pid\":%d,\"tid\":%u,\"id\":\"%p\"},"
+                        "\n{\"name\":\"%s\",\"cat\":\"scsi\",\"ph\":\"e\","
+                        "\"ts\":%.3f,\"pid\":%d,\"tid\":%u,\"id\":\"%p\"}",
+                    first ? "" : ",",
+                    event.name, ts, pid, thread, event.id,
+                    event.name, ts + dur, pid, thread, event.id);
+        }
+        else
+        {
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"scsi\",\"ph\":\"X\","
+                        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+                        "\"args\":{\"id\":\"%p\"}}",
+                    first ? "" : ",",
+                    event.name, ts, dur, pid, thread, event.id);
+        }
+        first = false;
+    }
+};
+
+void TraceExportChrome(const std::string &path)
+{
+    ChromeWriter writer;
+
+    writer.fp = openExport(path);
+    writer.pid = getpid();
+    writer.first = true;
+
+    fprintf(writer.fp, "{\"traceEvents\":[");
+    forEachEvent(writer);
+    fprintf(writer.fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    closeExport(writer.fp, path);
+}
+
+/*
+ * Total time per thread and stage, in nS, as "thread;stage count" lines
+ */
+struct FoldedTotals {
+    std::map<std::string, double> totals;
+
+    void operator()(unsigned int thread, const TraceEvent &event,
+                    double ts, double dur)
+    {
+        EString key;
+
+        key.Format("thread %u;%s", thread, event.name);
+        totals[key] += dur * 1000.0;
+    }
+};
+
+void TraceExportFolded(const std::string &path)
+{
+    FoldedTotals folded;
+    std::map<std::string, double>::const_iterator it;
+    FILE *fp;
+
+    forEachEvent(folded);
+
+    fp = openExport(path);
+    for (it = folded.totals.begin(); it != folded.totals.end(); it++)
+        fprintf(fp, "%s %llu\n", it->first.c_str(),
+                (unsigned long long)(it->second + 0.5));
+    closeExport(fp, path);
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * Hot path tracing. Build with SCSITEST_TRACE defined (make TRACE=1) and
+ * the wrapper and requests record when each command goes through each
+ * stage:
+ *   build    - filling in the CDB, SCSIRequest::Reset and SetLBA
+ *   submit   - handing the command to libiscsi, iscsi_scsi_command_async
+ *   send     - libiscsi writing PDUs to the socket
+ *   receive  - libiscsi reading PDUs, including running the callbacks
+ *   target   - from submission to completion, ie, waiting on the target
+ *   complete - our completion work, including copying read data
+ * Events go into a ring per thread, timed with the TSC, and can be written
+ * out as Chrome trace events (chrome://tracing, Perfetto) or as folded
+ * stacks for flamegraph.pl.
+ *
+ * Without SCSITEST_TRACE the macros are empty and none of this is
+ * compiled. With it, recording still only happens between TraceStart and
+ * TraceStop and costs two TSC reads and a store.
+ */
+#ifndef __Trace_h__
+#define __Trace_h__
+
+#ifdef SCSITEST_TRACE
+
+#include <stdint.h>
+#include <string>
+
+#if !defined(__x86_64__) && !defined(__i386__)
+#include <time.h>
+#endif
+
+static inline uint64_t TraceNow(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+extern volatile bool traceEnabled;
+
+// Each thread keeps its last ringEvents events. Start clears what was
+// recorded before; the size only applies to threads that have not yet
+// traced.
+void TraceStart(unsigned int ringEvents = 65536);
+void TraceStop(void);
+
+/*
+ * An async event can overlap others on its thread, eg, the time a command
+ * spends at the target. Names must be string constants.
+ */
+void TraceRecord(const char *name, const void *id,
+                 uint64_t start, uint64_t end, bool async = false);
+
+// Only while the traced threads are stopped or idle. Throw on I/O errors.
+void TraceExportChrome(const std::string &path);
+void TraceExportFolded(const std::string &path);
+
+class TraceScope
+{
+public:
+    TraceScope(const char *name, const void *id) :
+        mName(name), mId(id), mStart(traceEnabled ? TraceNow() : 0)
+        {}
+    ~TraceScope()
+    {
+        if (mStart)
+            TraceRecord(mName, mId, mStart, TraceNow());
+    }
+
+private:
+    const char *mName;
+    const void *mId;
+    uint64_t mStart;
+};
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+#define TRACE_SCOPE(name, id) TraceScope TRACE_JOIN(traceScope, __LINE__)(name, id)
+#define TRACE_NOW(start) ((start) = traceEnabled ? TraceNow() : 0)
+#define TRACE_ASYNC(name, id, start) \
+    do { \
+        if (start) \
+            TraceRecord(name, id, start, TraceNow(), true); \
+    } while (0)
+
+#else
+
+#define TRACE_SCOPE(name, id) do { } while (0)
+#define TRACE_NOW(start) do { } while (0)
+#define TRACE_ASYNC(name, id, start) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * A per-session cache of device metadata, invalidated by Unit Attentions.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include "iSCSIDeviceCache.h"
+#include "iSCSILibWrapper.h"
+#include "EString.h"
+#include "CException.h"
+
+// Unit Attention ASC/ASCQs that make cached data stale
+#define SCSI_SENSE_ASC_POWER_ON_OR_RESET            0x29
+#define SCSI_SENSE_ASCQ_CAPACITY_DATA_CHANGED       0x2A09
+#define SCSI_SENSE_ASCQ_MICROCODE_CHANGED           0x3F01
+#define SCSI_SENSE_ASCQ_INQUIRY_DATA_CHANGED        0x3F03
+#define SCSI_SENSE_ASCQ_REPORTED_LUNS_DATA_CHANGED  0x3F0E
+
+iSCSIDeviceCache::iSCSIDeviceCache(iSCSILibWrapper &iscsi) :
+    mIscsi(iscsi),
+    mHits(0),
+    mMisses(0),
+    mInvalidations(0)
+{
+}
+
+void iSCSIDeviceCache::fetch(SCSIRequest &request,
+                             unsigned int lun,
+                             const char *what)
+{
+    mIscsi.iSCSIExecSCSISyncRetry(request, lun, mRetryPolicy);
+    if (request.GetStatus() != SCSI_STATUS_GOOD)
+    {
+        EString estr;
+        estr.Format("%s failed on LUN %u: Status: %s, SenseKey: %s, ASCQ: %s",
+                    what, lun,
+                    request.StatusString().c_str(),
+                    request.SenseKeyString().c_str(),
+                    request.ASCQString().c_str());
+        throw CException(estr);
+    }
+}
+
+boost::shared_ptr<SCSIInquiry> iSCSIDeviceCache::GetInquiry(unsigned int lun)
+{
+    return get(lun, &Entry::inquiry, "INQUIRY");
+}
+
+boost::shared_ptr<SCSIInquirySupportedVPDPages>
+iSCSIDeviceCache::GetSupportedVPDPages(unsigned int lun)
+{
+    return get(lun, &Entry::pages, "INQUIRY VPD 0x00");
+}
+
+boost::shared_ptr<SCSIInquiryUnitSerialNumVPDPage>
+iSCSIDeviceCache::GetUnitSerialNum(unsigned int lun)
+{
+    return get(lun, &Entry::serial, "INQUIRY VPD 0x80");
+}
+
+boost::shared_ptr<SCSIInquiryDeviceIdVPDPage>
+iSCSIDeviceCache::GetDeviceId(unsigned int lun)
+{
+    return get(lun, &Entry::deviceId, "INQUIRY VPD 0x83");
+}
+
+boost::shared_ptr<SCSIReadCapacity10>
+iSCSIDeviceCache::GetCapacity(unsigned int lun)
+{
+    return get(lun, &Entry::capacity, "READ CAPACITY 10");
+}
+
+/*
+ * Only ask for the page if the LUN says it has it, and remember if not
+ */
+boost::shared_ptr<SCSIInquiryBlockLimitsVPDPage>
+iSCSIDeviceCache::GetBlockLimits(unsigned int lun)
+{
+    boost::shared_ptr<SCSIInquiryBlockLimitsVPDPage> limits;
+
+    if (mEntries[lun].limitsChecked)
+    {
+        mHits++;
+        return mEntries[lun].limits;
+    }
+
+    if (!GetSupportedVPDPages(lun)->HasPage(0xB0))
+    {
+        mEntries[lun].limitsChecked = true;
+        return limits;
+    }
+
+    limits = get(lun, &Entry::limits, "INQUIRY VPD 0xB0");
+    mEntries[lun].limitsChecked = true;
+    return limits;
+}
+
+void iSCSIDeviceCache::dropCapacity(Entry &entry)
+{
+    entry.capacity.reset();
+    entry.limits.reset();
+    entry.limitsChecked = false;
+}
+
+void iSCSIDeviceCache::dropAll(Entry &entry)
+{
+    entry.inquiry.reset();
+    entry.pages.reset();
+    entry.serial.reset();
+    entry.deviceId.reset();
+    dropCapacity(entry);
+}
+
+void iSCSIDeviceCache::Invalidate(unsigned int lun)
+{
+    std::map<unsigned int, Entry>::iterator it = mEntries.find(lun);
+
+    if (it == mEntries.end())
+        return;
+
+    dropAll(it->second);
+    mInvalidations++;
+}
+
+void iSCSIDeviceCache::InvalidateAll(void)
+{
+    std::map<unsigned int, Entry>::iterator it;
+
+    for (it = mEntries.begin(); it != mEntries.end(); it++)
+        dropAll(it->second);
+    mInvalidations++;
+}
+
+void iSCSIDeviceCache::Observe(unsigned int lun, SCSIRequest &request)
+{
+    std::map<unsigned int, Entry>::iterator it;
+    unsigned int ascq;
+
+    if (request.GetStatus() != SCSI_STATUS_CHECK_CONDITION ||
+        request.GetSCSISenseKey() != SCSI_SENSE_UNIT_ATTENTION)
+        return;
+
+    ascq = request.GetSCSIASCQ();
+
+    // This one is about the target, not the LUN it came back on
+    if (ascq == SCSI_SENSE_ASCQ_REPORTED_LUNS_DATA_CHANGED)
+    {
+        InvalidateAll();
+        return;
+    }
+
+    if ((it = mEntries.find(lun)) == mEntries.end())
+        return;
+
+    if (ascq == SCSI_SENSE_ASCQ_CAPACITY_DATA_CHANGED)
+    {
+        dropCapacity(it->second);
+        mInvalidations++;
+    }
+    else if (ascq == SCSI_SENSE_ASCQ_INQUIRY_DATA_CHANGED ||
+             ascq == SCSI_SENSE_ASCQ_MICROCODE_CHANGED ||
+             (ascq >> 8) == SCSI_SENSE_ASC_POWER_ON_OR_RESET)
+    {
+        dropAll(it->second);
+        mInvalidations++;
+    }
+}
+
+std::string iSCSIDeviceCache::StatsString(void) const
+{
+    EString str;
+
+    str.Format("LUNs %u, hits %llu, misses %llu, invalidations %llu",
+               (unsigned int)mEntries.size(),
+               (unsigned long long)mHits,
+               (unsigned long long)mMisses,
+               (unsigned long long)mInvalidations);
+    return str;
+}
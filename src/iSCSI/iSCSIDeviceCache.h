@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __iSCSIDeviceCache_h__
+#define __iSCSIDeviceCache_h__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+#include "SCSIInquiry.h"
+#include "SCSIReadCapacity.h"
+#include "SCSIRetryPolicy.h"
+
+class iSCSILibWrapper;
+
+/**
+ * \class iSCSIDeviceCache
+ *
+ * The parsed device metadata for each LUN on a session: standard INQUIRY,
+ * the supported, unit serial number, device ID and block limits VPD pages,
+ * and READ CAPACITY 10. Each is fetched the first time it is asked for and
+ * handed out from the cache after that.
+ *
+ * The session feeds every completion to Observe, and entries are dropped
+ * when the target says they are stale with a Unit Attention:
+ * - CAPACITY DATA HAS CHANGED drops the capacity and block limits,
+ * - INQUIRY DATA HAS CHANGED, MICROCODE HAS BEEN CHANGED and any power on
+ *   or reset drop everything for the LUN,
+ * - REPORTED LUNS DATA HAS CHANGED drops everything for every LUN, as the
+ *   LUN numbers may now refer to other devices.
+ * What the getters return stays valid after that, it is just no longer
+ * what the cache holds.
+ *
+ * Use the session's EnableDeviceCache and GetDeviceCache rather than
+ * making one of these.
+ */
+class iSCSIDeviceCache
+{
+public:
+    iSCSIDeviceCache(iSCSILibWrapper &iscsi);
+
+    // These throw if the command fails
+    boost::shared_ptr<SCSIInquiry> GetInquiry(unsigned int lun);
+    boost::shared_ptr<SCSIInquirySupportedVPDPages>
+        GetSupportedVPDPages(unsigned int lun);
+    boost::shared_ptr<SCSIInquiryUnitSerialNumVPDPage>
+        GetUnitSerialNum(unsigned int lun);
+    boost::shared_ptr<SCSIInquiryDeviceIdVPDPage>
+        GetDeviceId(unsigned int lun);
+    boost::shared_ptr<SCSIReadCapacity10> GetCapacity(unsigned int lun);
+    // Empty if the LUN does not have the page
+    boost::shared_ptr<SCSIInquiryBlockLimitsVPDPage>
+        GetBlockLimits(unsigned int lun);
+
+    void Invalidate(unsigned int lun);
+    void InvalidateAll(void);
+
+    // Called by the session with every completed request
+    void Observe(unsigned int lun, SCSIRequest &request);
+
+    uint64_t GetHits(void) const { return mHits; }
+    uint64_t GetMisses(void) const { return mMisses; }
+    uint64_t GetInvalidations(void) const { return mInvalidations; }
+    std::string StatsString(void) const;
+
+private:
+    struct Entry {
+        Entry() : limitsChecked(false) {}
+
+        boost::shared_ptr<SCSIInquiry> inquiry;
+        boost::shared_ptr<SCSIInquirySupportedVPDPages> pages;
+        boost::shared_ptr<SCSIInquiryUnitSerialNumVPDPage> serial;
+        boost::shared_ptr<SCSIInquiryDeviceIdVPDPage> deviceId;
+        boost::shared_ptr<SCSIReadCapacity10> capacity;
+        boost::shared_ptr<SCSIInquiryBlockLimitsVPDPage> limits;
+        bool limitsChecked;     // limits is empty if the LUN has no page
+    };
+
+    void fetch(SCSIRequest &request, unsigned int lun, const char *what);
+    void dropCapacity(Entry &entry);
+    void dropAll(Entry &entry);
+
+    template <class T>
+    boost::shared_ptr<T> get(unsigned int lun,
+                             boost::shared_ptr<T> Entry::*field,
+                             const char *what)
+    {
+        // A Unit Attention seen while fetching can clear the entry, but
+        // never removes it from the map
+        Entry &entry = mEntries[lun];
+        boost::shared_ptr<T> value = entry.*field;
+
+        if (value)
+        {
+            mHits++;
+            return value;
+        }
+
+        mMisses++;
+        value.reset(new T());
+        fetch(*value, lun, what);
+        entry.*field = value;
+        return value;
+    }
+
+    iSCSILibWrapper &mIscsi;
+    SCSIRetryPolicy mRetryPolicy;
+    std::map<unsigned int, Entry> mEntries;
+    uint64_t mHits;
+    uint64_t mMisses;
+    uint64_t mInvalidations;
+};
+
+#endif
@@ -25,13 +25,26 @@
  **/
 
 #include <algorithm>
+#include <deque>
+#include <map>
 #include <signal.h>
 #include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition.hpp>
 #include "iSCSILibWrapper.h"
+#include "iSCSIMetrics.h"
+#include "iSCSIDeviceCache.h"
+#include "SCSIRetryPolicy.h"
+#include "IOBufferPool.h"
+#include "NUMA.h"
+#include "Trace.h"
 #include "EString.h"
 #include "CException.h"
 
@@ -57,6 +70,20 @@ void iSCSIBackGround::StartBackGroundTask()
     mStop = false;
     //printf("%s: Starting background thread", __func__);
     mThread = boost::thread(&iSCSIBackGround::BackGroundThread, this);
+
+    if (mCPUs.size())
+        NUMAPinThread(mThread.native_handle(), mCPUs);
+}
+
+void iSCSIBackGround::SetCPUAffinity(const std::vector<int> &cpus)
+{
+    boost::mutex::scoped_lock lock(mWorkMutex);
+
+    mCPUs = cpus;
+
+    // Otherwise it happens when the thread starts
+    if (mThread.joinable() && mCPUs.size())
+        NUMAPinThread(mThread.native_handle(), mCPUs);
 }
 
 void iSCSIBackGround::StopBackGroundTask()
@@ -216,6 +243,43 @@ iSCSILibWrapper::iSCSILibWrapper(int timeout)
     mRedirected = false;
     memset(&mClient, 0, sizeof(mClient));
     mIscsi = NULL;
+    mAsyncActive = false;
+    mOutstanding = 0;
+    mWaitFor = 0;
+    mSyncCommand = NULL;
+    mSessionQualifier = 0;
+    mRecovery = false;
+    mRecovering = false;
+    mRecoveryPending = false;
+    mInBackground = false;
+    mRecoveryAttempts = 10;
+    mRecoveryDelay = 1000;
+    mPausePending = false;
+    mLastCompletion = boost::get_system_time();
+    memset(&mRecoveryStats, 0, sizeof(mRecoveryStats));
+    mNUMANode = -1;
+    mLatency = false;
+    mPingInterval = 0;
+    mPingOutstanding = false;
+    mPingWait = false;
+    mPingStatus = SCSI_STATUS_GOOD;
+    mPingSent = 0;
+    mNextPing = 0;
+    mLastPing = 0;
+    mPingFailures = 0;
+    mCommandTimeout = 0;
+    mTimeoutAction = TIMEOUT_ABORT_TASK;
+    mTimerFd = -1;
+    mTimerArmed = 0;
+    mNextSerial = 1;
+    mDropSession = false;
+    memset(&mTimeoutStats, 0, sizeof(mTimeoutStats));
+    mBusyPoll = false;
+    mBusyPollUsecs = 0;
+    mBusyPollFd = -1;
+    mBusyPollSocket = false;
+    mMetrics = NULL;
+    mDeviceCache = NULL;
 }
 
 iSCSILibWrapper::~iSCSILibWrapper()
@@ -225,26 +289,46 @@ iSCSILibWrapper::~iSCSILibWrapper()
         iscsi_disconnect(mIscsi);
     if (mClient.error_message)
         free(mClient.error_message);
+    delete mMetrics;
+    delete mDeviceCache;
     if (mClient.target_name)
         free(mClient.target_name);
     if (mClient.target_address)
         free(mClient.target_address);
     if (mIscsi)
         iscsi_destroy_context(mIscsi);
+    deleteZombies();
+    if (mTimerFd >= 0)
+        close(mTimerFd);
 }
 
 void iSCSILibWrapper::ServiceISCSIEvents(bool oneShot)
 {
     // Event loop to drive the connection through its paces
 
+    // Only the background thread asks for one shot
+    mInBackground = oneShot;
+
     while (mClient.finished == 0 && mClient.error == 0 || oneShot)
     {
+        // Dead, and waiting for the foreground to reconnect it
+        if (mRecoveryPending)
+            break;
+
+        struct pollfd pfds[2];
+        unsigned int count = 1;
         int res = 0;
 
         mPfd.fd = iscsi_get_fd(mIscsi);
         mPfd.events = iscsi_which_events(mIscsi);
+        pfds[0] = mPfd;
+
+        // Deadlines wake us even when the socket is quiet
+        if (iSCSIGetTimerPollFd(pfds[1]))
+            count++;
 
-        if ((res = poll(&mPfd, 1, mTimeout)) <= 0)
+        // Never spin for the background thread, it serves everyone
+        if ((res = pollEvents(pfds, count, mBusyPoll && !oneShot)) <= 0)
         {
             mError = true;
             if (res)
@@ -258,14 +342,11 @@ void iSCSILibWrapper::ServiceISCSIEvents(bool oneShot)
             throw CException(mErrorString);
         }
 
-        if (iscsi_service(mIscsi, mPfd.revents) < 0)
-        {
-            mError = true;
-            mErrorString.Format("%s: iscsi_service failed with: %s",
-                               __func__,
-                              iscsi_get_error(mIscsi));
-            throw CException(mErrorString);
-        }
+        mPfd.revents = pfds[0].revents;
+        if (mPfd.revents)
+            iSCSIServiceEvents(mPfd.revents);
+        if (count > 1 && pfds[1].revents)
+            iSCSIServiceTimers();
 
         if (oneShot)
         {
@@ -273,6 +354,8 @@ void iSCSILibWrapper::ServiceISCSIEvents(bool oneShot)
         }
     }
 
+    mInBackground = false;
+
     // Get the iscsi error if there is one at this point
     if (mClient.error != 0)
     {
@@ -283,6 +366,131 @@ void iSCSILibWrapper::ServiceISCSIEvents(bool oneShot)
     }
 }
 
+/*
+ * Wait for the socket or timerfd, like poll with our timeout. Spinning
+ * polls without waiting instead, checking the clock for the timeout as it
+ * goes. With no timeout, a second of nothing ends the spin and we sleep.
+ */
+int iSCSILibWrapper::pollEvents(struct pollfd *pfds,
+                                unsigned int count,
+                                bool spin)
+{
+    uint64_t limit;
+    int res;
+
+    if (!spin)
+        return poll(pfds, count, mTimeout);
+
+    // A reconnect brings a new socket
+    if (pfds[0].fd != mBusyPollFd)
+        setBusyPollSocket(pfds[0].fd);
+
+    limit = iSCSIMetrics::Now() + (mTimeout >= 0 ? mTimeout * 1000ULL :
+                                   BUSY_POLL_MAX_SPIN * 1000ULL);
+
+    while ((res = poll(pfds, count, 0)) == 0)
+    {
+        if (iSCSIMetrics::Now() >= limit)
+            break;
+    }
+
+    if (res == 0 && mTimeout < 0)
+        res = poll(pfds, count, -1);
+
+    return res;
+}
+
+void iSCSILibWrapper::setBusyPollSocket(int fd)
+{
+    mBusyPollFd = fd;
+    mBusyPollSocket = false;
+
+#ifdef SO_BUSY_POLL
+    int usecs = mBusyPollUsecs;
+
+    if (fd >= 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0)
+        mBusyPollSocket = true;
+#endif
+}
+
+void iSCSILibWrapper::SetBusyPoll(bool enable, unsigned int socketUsecs)
+{
+    // Stop the socket spinning, it is taken up again on the next wait
+    if (mBusyPollFd >= 0 && mIscsi && iscsi_get_fd(mIscsi) == mBusyPollFd)
+    {
+        mBusyPollUsecs = 0;
+        setBusyPollSocket(mBusyPollFd);
+    }
+
+    mBusyPoll = enable;
+    mBusyPollUsecs = enable ? socketUsecs : 0;
+    mBusyPollFd = -1;
+    mBusyPollSocket = false;
+}
+
+/*
+ * Let libiscsi deal with the events poll found. This is also used by
+ * callers that poll several connections at once.
+ */
+void iSCSILibWrapper::iSCSIServiceEvents(short revents)
+{
+    TRACE_SCOPE(revents & POLLOUT ? "send" : "receive", this);
+
+    if (iscsi_service(mIscsi, revents) < 0)
+    {
+        // Lost the connection. If we can, get it back and let the caller
+        // carry on waiting for whatever it was waiting for.
+        if (!mRecovery || mRecovering)
+        {
+            mError = true;
+            mErrorString.Format("%s: iscsi_service failed with: %s",
+                               __func__,
+                              iscsi_get_error(mIscsi));
+            throw CException(mErrorString);
+        }
+
+        // Reconnecting sleeps between attempts, which would hold up every
+        // other connection's keepalives. The next call that uses the
+        // session recovers it instead.
+        if (mInBackground)
+        {
+            mRecoveryPending = true;
+            return;
+        }
+
+        recoverSession();
+    }
+
+    // Other event loops may not be polling the timerfd, and failed task
+    // management is escalated from there
+    if (mDropSession ||
+        (mTimers.size() && mTimers[0]->deadline <= iSCSIMetrics::Now()))
+        checkDeadlines();
+
+    // Paced pings only, iSCSIPing sends its own. Queued now, it goes out
+    // when the caller next polls.
+    if (mPingInterval && !mPingOutstanding && !mRecovering &&
+        iSCSIMetrics::Now() >= mNextPing && iscsi_is_logged_in(mIscsi))
+    {
+        try
+        {
+            sendPing();
+        }
+        catch (CException &)
+        {
+            mPingFailures++;
+        }
+    }
+}
+
+void iSCSILibWrapper::iSCSIGetPollFd(struct pollfd &pfd)
+{
+    pfd.fd = iscsi_get_fd(mIscsi);
+    pfd.events = iscsi_which_events(mIscsi);
+    pfd.revents = 0;
+}
+
 /*
  * Connect Callback 
  */
@@ -311,6 +519,28 @@ static void connect_cb(struct iscsi_context *iscsi, int status, void *command_da
  * Connect to the target. Must set a target and address before calling this
  */
 void iSCSILibWrapper::iSCSIConnect(void)
+{
+    connectTransport(mAddress);
+
+    // Add to the background task
+    iSCSIBackGround::GetInstance().AddConnection(*this);
+}
+
+/*
+ * Create a context and connect it to the address given. This leaves the
+ * background thread alone so session recovery can use it.
+ */
+void iSCSILibWrapper::connectTransport(const std::string &address)
+{
+    startConnect(address);
+
+    ServiceISCSIEvents();
+}
+
+/*
+ * Start connecting, without waiting for it
+ */
+void iSCSILibWrapper::startConnect(const std::string &address)
 {
     if (mIscsi)
     {
@@ -337,6 +567,14 @@ void iSCSILibWrapper::iSCSIConnect(void)
         throw CException(mErrorString);
     }
 
+    // Sessions from the same initiator to the same target are told apart
+    // by the qualifier at the end of the ISID
+    if (mSessionQualifier)
+    {
+        mIscsi->isid[4] = mSessionQualifier >> 8;
+        mIscsi->isid[5] = mSessionQualifier & 0xFF;
+    }
+
     if (iscsi_set_alias(mIscsi, "scqadleader") != 0)
     {
         mError = true;
@@ -347,7 +585,7 @@ void iSCSILibWrapper::iSCSIConnect(void)
         throw CException(mErrorString);
     }
 
-    std::string target = std::string(mAddress);
+    std::string target = std::string(address);
 
     // If it does not have the port number, add it on. This is actually not
     // The best test ... but we will often only be given strings from discovery.
@@ -368,12 +606,6 @@ void iSCSILibWrapper::iSCSIConnect(void)
                            iscsi_get_error(mIscsi));
         throw CException(mErrorString);
     }
-
-    ServiceISCSIEvents();
-
-    // Add to the background task
-    iSCSIBackGround::GetInstance().AddConnection(*this);
-
 }
 
 /*
@@ -562,6 +794,40 @@ void iSCSILibWrapper::iSCSINormalLogin(void)
     // Remove us from the background thread
     iSCSIBackGround::GetInstance().RemoveConnection(*this);
 
+    normalLoginTransport();
+
+    // Add to the background task
+    iSCSIBackGround::GetInstance().AddConnection(*this);
+
+    // Now check to see if we have been redirected and recover the new address.
+    if (mClient.error)
+    {
+        std::string errStr(iscsi_get_error(mIscsi));
+
+        if (errStr.find("Target moved temporarily(257)") != 
+            std::string::npos)
+        {
+            mRedirected = true;
+            mNewAddress = std::string(iscsi_get_target_address(mIscsi));
+        }
+    }
+}
+
+/*
+ * Log in on the current context, leaving the background thread alone
+ */
+void iSCSILibWrapper::normalLoginTransport(void)
+{
+    startNormalLogin();
+
+    ServiceISCSIEvents();
+}
+
+/*
+ * Start logging in, without waiting for it
+ */
+void iSCSILibWrapper::startNormalLogin(void)
+{
     if (!mClient.connected || mClient.error)
     {
         if (mClient.error)
@@ -580,7 +846,15 @@ void iSCSILibWrapper::iSCSINormalLogin(void)
     mClient.finished = 0;
 
     iscsi_set_session_type(mIscsi, ISCSI_SESSION_NORMAL);
-    iscsi_set_header_digest(mIscsi, ISCSI_HEADER_DIGEST_CRC32C_NONE);
+    iscsi_set_header_digest(mIscsi, mLoginParams.headerDigest);
+#ifdef SCSITEST_LOGIN_PARAMS
+    iscsi_set_immediate_data(mIscsi, mLoginParams.immediateData ?
+                                     ISCSI_IMMEDIATE_DATA_YES :
+                                     ISCSI_IMMEDIATE_DATA_NO);
+    iscsi_set_initial_r2t(mIscsi, mLoginParams.initialR2T ?
+                                  ISCSI_INITIAL_R2T_YES :
+                                  ISCSI_INITIAL_R2T_NO);
+#endif
 
     if (iscsi_set_targetname(mIscsi, mTarget.c_str()))
     {
@@ -601,24 +875,128 @@ void iSCSILibWrapper::iSCSINormalLogin(void)
         mError = true;
         throw CException(mErrorString);
     }
+}
 
-    ServiceISCSIEvents();
+void iSCSILibWrapper::iSCSIStartConnect(void)
+{
+    startConnect(mAddress);
+}
 
-    // Add to the background task
+void iSCSILibWrapper::iSCSIStartNormalLogin(void)
+{
+    startNormalLogin();
+}
+
+/*
+ * The same error as the waiting versions would have thrown
+ */
+void iSCSILibWrapper::checkStep(const char *func)
+{
+    if (!mClient.error)
+        return;
+
+    mError = true;
+    mErrorString.Format("%s: %s: %s", func,
+                        mClient.error_message ? mClient.error_message : "",
+                        iscsi_get_error(mIscsi));
+    throw CException(mErrorString);
+}
+
+void iSCSILibWrapper::iSCSIFinishConnect(void)
+{
+    checkStep(__func__);
+}
+
+void iSCSILibWrapper::iSCSIFinishNormalLogin(void)
+{
+    checkStep(__func__);
+
+    // Logged in, so NOP-INs need answering from here on
     iSCSIBackGround::GetInstance().AddConnection(*this);
+}
 
-    // Now check to see if we have been redirected and recover the new address.
-    if (mClient.error)
+void iSCSILibWrapper::BindCurrentThread(void)
+{
+    std::vector<int> cpus = mCPUs;
+
+    if (!cpus.size() && mNUMANode >= 0)
+        cpus = NUMANodeCPUs(mNUMANode);
+
+    if (cpus.size())
+        NUMAPinThread(cpus);
+
+    if (mNUMANode >= 0)
+        IOBufferAllocator::SetThreadDefault(
+            &IOBufferPool::GetNodeInstance(mNUMANode));
+}
+
+void iSCSILibWrapper::SetLoginParams(const iSCSILoginParams &params)
+{
+#ifndef SCSITEST_LOGIN_PARAMS
+    iSCSILoginParams defaults;
+    EString estr;
+
+    if (params.immediateData != defaults.immediateData ||
+        params.initialR2T != defaults.initialR2T)
     {
-        std::string errStr(iscsi_get_error(mIscsi));
+        estr.Format("%s: ImmediateData and InitialR2T need make "
+                    "LOGIN_PARAMS=1, see INSTALL: %s",
+                    __func__,
+                    LoginParamsString(params).c_str());
+        throw CException(estr);
+    }
+#endif
 
-        if (errStr.find("Target moved temporarily(257)") != 
-            std::string::npos)
-        {
-            mRedirected = true;
-            mNewAddress = std::string(iscsi_get_target_address(mIscsi));
-        }
+    mLoginParams = params;
+}
+
+/*
+ * libiscsi has no way to ask what the login ended up with, short of its
+ * private context. The header digest has always been there.
+ */
+enum iscsi_header_digest iSCSILibWrapper::GetNegotiatedHeaderDigest(void)
+{
+    if (!mIscsi || !iscsi_is_logged_in(mIscsi))
+    {
+        mErrorString.Format("%s: Not logged in to target %s",
+                            __func__,
+                            mTarget.c_str());
+        mError = true;
+        throw CException(mErrorString);
     }
+
+    return mIscsi->header_digest;
+}
+
+std::string iSCSILibWrapper::LoginParamsString(const iSCSILoginParams &params) const
+{
+    EString str;
+    const char *digest;
+
+    switch (params.headerDigest)
+    {
+    case ISCSI_HEADER_DIGEST_NONE:
+        digest = "None";
+        break;
+    case ISCSI_HEADER_DIGEST_NONE_CRC32C:
+        digest = "None,CRC32C";
+        break;
+    case ISCSI_HEADER_DIGEST_CRC32C_NONE:
+        digest = "CRC32C,None";
+        break;
+    case ISCSI_HEADER_DIGEST_CRC32C:
+        digest = "CRC32C";
+        break;
+    default:
+        digest = "Unknown";
+        break;
+    }
+
+    str.Format("HeaderDigest=%s ImmediateData=%s InitialR2T=%s",
+               digest,
+               params.immediateData ? "Yes" : "No",
+               params.initialR2T ? "Yes" : "No");
+    return str;
 }
 
 /*
@@ -726,40 +1104,24 @@ void iSCSILibWrapper::iSCSIDisconnect(void)
 }
 
 /*
- * The callback for command execution
- */
-static void exec_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
-{
-    struct wrapper_client_state *client = 
-		((iSCSILibWrapper *)private_data)->GetClientState();
-    struct scsi_task *task = (struct scsi_task *)command_data;
-
-    if (task)
-        task->status = status;
-    client->finished = 1;
-}
-
-/*
- * Execute a SCSI request synchronously
+ * Check that a request can be executed on this connection
  */
-void iSCSILibWrapper::iSCSIExecSCSISync(SCSIRequest &request, unsigned int lun)
+void iSCSILibWrapper::checkSCSIRequest(SCSIRequest &request, const char *func)
 {
-    // Remove us from the background thread
-    iSCSIBackGround::GetInstance().RemoveConnection(*this);
-
-    struct iscsi_data data;
-    struct scsi_task *task = request.GetTask();
+    // Lost while the background thread had it
+    if (mRecoveryPending)
+        recoverSession();
 
     if (!mClient.connected || mClient.error)
     {
         if (mClient.error)
             mErrorString.Format("%s: previous error prevents executing SCSI request on target %s: %s",
-                               __func__,
+                               func,
                                mTarget.c_str(),
                                iscsi_get_error(mIscsi));
         else
             mErrorString.Format("%s: Executing request on target %s not possible without a connection!",
-                               __func__,
+                               func,
                                mTarget.c_str());
         mError = true;
         throw CException(mErrorString);
@@ -769,79 +1131,1430 @@ void iSCSILibWrapper::iSCSIExecSCSISync(SCSIRequest &request, unsigned int lun)
     if (request.IsExecuted())
     {
         EString estr;
-        estr.Format("%s: SCSI Request already executed!", __func__);
+        estr.Format("%s: SCSI Request already executed!", func);
         mError = true;
         throw CException(estr);
     }
 
-    if (!task)  // Throw an exception
+    if (!request.GetTask())  // Throw an exception
     {
         EString estr;
-        estr.Format("%s: SCSIRequest does not have a task defined", __func__);
+        estr.Format("%s: SCSIRequest does not have a task defined", func);
         mError = true;
         throw CException(estr);
     }
+}
+
+/*
+ * Hand a checked request to libiscsi. The data descriptor must stay valid
+ * until the command completes.
+ */
+void iSCSILibWrapper::submitSCSIRequest(SCSIRequest &request,
+                                        unsigned int lun,
+                                        struct iscsi_data *data,
+                                        iscsi_command_cb cb,
+                                        void *privateData)
+{
+    struct scsi_task *task = request.GetTask();
+
+    TRACE_SCOPE("submit", &request);
 
     switch (task->xfer_dir)
     {
         default:
         case SCSI_XFER_NONE:
-            data.data = NULL;
-            data.size = 0;
+            data->data = NULL;
+            data->size = 0;
             break;
 
         case SCSI_XFER_READ:
-            data.data = (unsigned char *)request.GetInBuffer().get();
-            data.size = request.GetInBufferSize();
+            data->data = (unsigned char *)request.GetInBuffer().get();
+            data->size = request.GetInBufferSize();
             break;
 
         case SCSI_XFER_WRITE:
-            data.data = (unsigned char *)request.GetOutBuffer().get();
-            data.size = request.GetOutBufferSize();
+            data->data = (unsigned char *)request.GetOutBuffer().get();
+            data->size = request.GetOutBufferSize();
             break;
     }
 
-    task-> expxferlen = data.size;
-
-    mClient.finished = 0;
+    task-> expxferlen = data->size;
 
     if (iscsi_scsi_command_async(mIscsi, 
                                  lun, 
                                  task,
-                                 exec_cb, 
-                                 &data,
-                                 this))
+                                 cb, 
+                                 data,
+                                 privateData))
     {
-        EString estr;
-        estr.Format("%s: Error executing SCSI request: %s", __func__,
-                    iscsi_get_error(mIscsi));
+        mErrorString.Format("%s: Error executing SCSI request: %s", __func__,
+                            iscsi_get_error(mIscsi));
         mError = true;
         throw CException(mErrorString);
     }
+}
 
-    ServiceISCSIEvents();
+/*
+ * Now, transfer any data back ... this might have to change if Ronnie
+ * adds support for it in the library ...
+ */
+void iSCSILibWrapper::completeSCSIRequest(SCSIRequest &request,
+                                          unsigned int lun,
+                                          uint64_t started)
+{
+    struct scsi_task *task = request.GetTask();
 
-    // Add to the background task
-    iSCSIBackGround::GetInstance().AddConnection(*this);
+    TRACE_SCOPE("complete", &request);
 
-    /*
-     * Now, transfer any data back ... this might have to change if Ronnie
-     * adds support for it in the library ...
-     */
+    // Anything the target answered counts as I/O flowing again
+    if (task->status != SCSI_STATUS_CANCELLED)
+    {
+        mLastCompletion = boost::get_system_time();
+
+        if (mPausePending)
+        {
+            uint64_t pause = (mLastCompletion - mPauseStart).total_microseconds();
+
+            mRecoveryStats.lastPauseUsecs = pause;
+            mRecoveryStats.totalPauseUsecs += pause;
+            if (pause > mRecoveryStats.maxPauseUsecs)
+                mRecoveryStats.maxPauseUsecs = pause;
+            mPausePending = false;
+        }
+    }
 
     switch (task->xfer_dir)
     {
     case SCSI_XFER_READ:
-        memcpy(request.GetInBuffer().get(),
-               task->datain.data, 
-               std::min(request.GetInBufferSize(), 
-                        (unsigned int)task->datain.size));
+        request.SetInBufferData(task->datain.data,
+                                (unsigned int)task->datain.size);
         break;
     default:
         break;
     }
 
     request.SetExecuted();
+
+    if (mMetrics)
+        mMetrics->Completed(lun, request, started);
+
+    if (mLatency && started && task->status != SCSI_STATUS_CANCELLED)
+        mCommandLatency.Record((iSCSIMetrics::Now() - started) * 1000);
+
+    if (mDeviceCache)
+        mDeviceCache->Observe(lun, request);
+
+    for (unsigned int i = 0; i < mObservers.size(); i++)
+        mObservers[i]->Observe(*this, lun, request);
+}
+
+void iSCSILibWrapper::EnableMetrics(void)
+{
+    if (!mMetrics)
+        mMetrics = new iSCSIMetrics();
+}
+
+void iSCSILibWrapper::EnableDeviceCache(void)
+{
+    if (!mDeviceCache)
+        mDeviceCache = new iSCSIDeviceCache(*this);
+}
+
+void iSCSILibWrapper::AddObserver(iSCSIObserver &observer)
+{
+    if (std::find(mObservers.begin(), mObservers.end(), &observer) ==
+        mObservers.end())
+        mObservers.push_back(&observer);
+}
+
+void iSCSILibWrapper::RemoveObserver(iSCSIObserver &observer)
+{
+    std::vector<iSCSIObserver *>::iterator it;
+
+    it = std::find(mObservers.begin(), mObservers.end(), &observer);
+    if (it != mObservers.end())
+        mObservers.erase(it);
+}
+
+void iSCSILibWrapper::ResetSessionState(void)
+{
+    if (mOutstanding)
+    {
+        mErrorString.Format("%s: %u requests still outstanding",
+                            __func__, mOutstanding);
+        throw CException(mErrorString);
+    }
+
+    mError = false;
+    mErrorString.clear();
+    mRedirected = false;
+    mNewAddress.clear();
+    mObservers.clear();
+    mRecovery = false;
+    mRecoveryAttempts = 10;
+    mRecoveryDelay = 1000;
+    mPausePending = false;
+    memset(&mRecoveryStats, 0, sizeof(mRecoveryStats));
+    mNUMANode = -1;
+    mCPUs.clear();
+    mPingInterval = 0;
+    // A reply to one still in flight is just recorded and dropped
+    mPingOutstanding = false;
+    mPingWait = false;
+    mLatency = false;
+    ResetLatency();
+    mCommandTimeout = 0;
+    mTimeoutAction = TIMEOUT_ABORT_TASK;
+    memset(&mTimeoutStats, 0, sizeof(mTimeoutStats));
+    SetBusyPoll(false);
+    if (mDeviceCache)
+        mDeviceCache->InvalidateAll();
+}
+
+void iSCSILibWrapper::sendPing(void)
+{
+    if (iscsi_nop_out_async(mIscsi, pingCallback, NULL, 0, this))
+    {
+        mErrorString.Format("%s: Failed to send NOP-OUT to target %s: %s",
+                            __func__,
+                            mTarget.c_str(),
+                            iscsi_get_error(mIscsi));
+        throw CException(mErrorString);
+    }
+
+    mPingOutstanding = true;
+    mPingSent = iSCSIMetrics::Now();
+    mNextPing = mPingSent + mPingInterval * 1000ULL;
+}
+
+void iSCSILibWrapper::pingCallback(struct iscsi_context *iscsi,
+                                   int status,
+                                   void *command_data,
+                                   void *private_data)
+{
+    iSCSILibWrapper *obj = (iSCSILibWrapper *)private_data;
+
+    // The context is being thrown away under us
+    if (obj->mRecovering)
+        return;
+
+    obj->mPingOutstanding = false;
+    obj->mPingStatus = status;
+
+    if (status == SCSI_STATUS_GOOD)
+    {
+        obj->mLastPing = (iSCSIMetrics::Now() - obj->mPingSent) * 1000;
+        obj->mPingLatency.Record(obj->mLastPing);
+    }
+    else
+    {
+        obj->mPingFailures++;
+    }
+
+    if (obj->mPingWait)
+        obj->mClient.finished = 1;
+}
+
+void iSCSILibWrapper::SetCommandTimeout(unsigned int ms,
+                                        TimeoutAction action)
+{
+    mCommandTimeout = ms;
+    mTimeoutAction = action;
+}
+
+/*
+ * Give the command its deadline, if it has one, and arm the timerfd if
+ * that is now the earliest
+ */
+void iSCSILibWrapper::timerAdd(struct wrapper_command *cmd,
+                               SCSIRequest &request)
+{
+    unsigned int ms = request.GetTimeout() ? request.GetTimeout() :
+                                             mCommandTimeout;
+
+    cmd->serial = mNextSerial++;
+    cmd->timerIndex = NO_TIMER;
+    cmd->deadline = 0;
+
+    if (!ms)
+        return;
+
+    cmd->deadline = iSCSIMetrics::Now() + ms * 1000ULL;
+    cmd->timerIndex = mTimers.size();
+    mTimers.push_back(cmd);
+    timerSiftUp(cmd->timerIndex);
+
+    if (!mTimerArmed || cmd->deadline < mTimerArmed)
+        timerArm();
+}
+
+/*
+ * Take a command out of the heap. The timerfd is left as it is: if it fires
+ * for nothing we just arm it for whatever is next. That saves a system call
+ * on nearly every completion.
+ */
+void iSCSILibWrapper::timerRemove(struct wrapper_command *cmd)
+{
+    unsigned int index = cmd->timerIndex;
+    struct wrapper_command *last;
+
+    if (index == NO_TIMER)
+        return;
+
+    cmd->timerIndex = NO_TIMER;
+    last = mTimers.back();
+    mTimers.pop_back();
+
+    if (index < mTimers.size())
+    {
+        mTimers[index] = last;
+        last->timerIndex = index;
+        timerSiftUp(index);
+        timerSiftDown(last->timerIndex);
+    }
+}
+
+// The target completed the command
+void iSCSILibWrapper::timerComplete(struct wrapper_command *cmd)
+{
+    if (!cmd->deadline)
+        return;
+
+    timerRemove(cmd);
+    if (!cmd->request->IsTimedOut() && iSCSIMetrics::Now() >= cmd->deadline)
+        mTimeoutStats.late++;
+}
+
+void iSCSILibWrapper::timerSwap(unsigned int a, unsigned int b)
+{
+    struct wrapper_command *cmd = mTimers[a];
+
+    mTimers[a] = mTimers[b];
+    mTimers[b] = cmd;
+    mTimers[a]->timerIndex = a;
+    mTimers[b]->timerIndex = b;
+}
+
+void iSCSILibWrapper::timerSiftUp(unsigned int index)
+{
+    while (index > 0)
+    {
+        unsigned int parent = (index - 1) / 2;
+
+        if (mTimers[parent]->deadline <= mTimers[index]->deadline)
+            break;
+
+        timerSwap(parent, index);
+        index = parent;
+    }
+}
+
+void iSCSILibWrapper::timerSiftDown(unsigned int index)
+{
+    for (;;)
+    {
+        unsigned int child = index * 2 + 1;
+
+        if (child >= mTimers.size())
+            break;
+        if (child + 1 < mTimers.size() &&
+            mTimers[child + 1]->deadline < mTimers[child]->deadline)
+            child++;
+        if (mTimers[index]->deadline <= mTimers[child]->deadline)
+            break;
+
+        timerSwap(index, child);
+        index = child;
+    }
+}
+
+// Arm the timerfd for the earliest deadline, or disarm it
+void iSCSILibWrapper::timerArm(void)
+{
+    struct itimerspec its;
+
+    if (mTimerFd < 0)
+    {
+        mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (mTimerFd < 0)
+        {
+            mErrorString.Format("%s: timerfd_create failed: %s",
+                                __func__, strerror(errno));
+            throw CException(mErrorString);
+        }
+    }
+
+    // Same clock as iSCSIMetrics::Now, and zero disarms it
+    mTimerArmed = mTimers.size() ? mTimers[0]->deadline : 0;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = mTimerArmed / 1000000;
+    its.it_value.tv_nsec = (mTimerArmed % 1000000) * 1000;
+
+    if (timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    {
+        mErrorString.Format("%s: timerfd_settime failed: %s",
+                            __func__, strerror(errno));
+        throw CException(mErrorString);
+    }
+}
+
+void iSCSILibWrapper::clearTimers(void)
+{
+    for (unsigned int i = 0; i < mTimers.size(); i++)
+        mTimers[i]->timerIndex = NO_TIMER;
+    mTimers.clear();
+    mResettingLuns.clear();
+}
+
+bool iSCSILibWrapper::iSCSIGetTimerPollFd(struct pollfd &pfd)
+{
+    if (mTimerFd < 0)
+        return false;
+
+    pfd.fd = mTimerFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return true;
+}
+
+void iSCSILibWrapper::iSCSIServiceTimers(void)
+{
+    uint64_t expirations;
+
+    if (mTimerFd >= 0 &&
+        read(mTimerFd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN)
+    {
+        mErrorString.Format("%s: Reading the timerfd failed: %s",
+                            __func__, strerror(errno));
+        throw CException(mErrorString);
+    }
+
+    checkDeadlines();
+}
+
+void iSCSILibWrapper::checkDeadlines(void)
+{
+    uint64_t now = iSCSIMetrics::Now();
+
+    if (mRecovering)
+        return;
+
+    while (mTimers.size() && mTimers[0]->deadline <= now)
+    {
+        struct wrapper_command *cmd = mTimers[0];
+
+        timerRemove(cmd);
+        mTimeoutStats.expired++;
+        expireCommand(cmd);
+    }
+
+    if (mTimerArmed && mTimerArmed <= now)
+        timerArm();
+
+    if (mDropSession)
+        dropSession();
+}
+
+void iSCSILibWrapper::expireCommand(struct wrapper_command *cmd)
+{
+    switch (mTimeoutAction)
+    {
+    case TIMEOUT_ABORT_TASK:
+        sendTaskMgmt(cmd, false);
+        break;
+
+    case TIMEOUT_LUN_RESET:
+        // One reset takes care of everything on the LUN
+        if (!mResettingLuns.count(cmd->lun))
+            sendTaskMgmt(cmd, true);
+        break;
+
+    case TIMEOUT_DROP_SESSION:
+        dropSession();
+        break;
+    }
+}
+
+/*
+ * Only destroying the context makes libiscsi let go of a command, so this
+ * is where failed task management ends up too.
+ */
+void iSCSILibWrapper::dropSession(void)
+{
+    mDropSession = false;
+    mTimeoutStats.sessionDrops++;
+    if (mRecovery && !mRecovering)
+    {
+        // Not on the background thread, see iSCSIServiceEvents
+        if (mInBackground)
+            mRecoveryPending = true;
+        else
+            recoverSession();
+        return;
+    }
+
+    iscsi_disconnect(mIscsi);
+    mClient.connected = 0;
+    mError = true;
+    mErrorString.Format("%s: Command to target %s timed out, dropped the session",
+                        __func__,
+                        mTarget.c_str());
+    throw CException(mErrorString);
+}
+
+struct wrapper_task_mgmt {
+    iSCSILibWrapper *wrapper;
+    uint64_t serial;
+    unsigned int lun;
+    bool lunReset;
+};
+
+void iSCSILibWrapper::sendTaskMgmt(struct wrapper_command *cmd, bool lunReset)
+{
+    struct wrapper_task_mgmt *tmf;
+
+    if (lunReset)
+    {
+        sendLunReset(cmd->lun);
+        return;
+    }
+
+    tmf = new wrapper_task_mgmt;
+    tmf->wrapper = this;
+    tmf->serial = cmd->serial;
+    tmf->lun = cmd->lun;
+    tmf->lunReset = false;
+
+    mTimeoutStats.aborts++;
+    if (iscsi_task_mgmt_abort_task_async(mIscsi, cmd->request->GetTask(),
+                                         taskMgmtCallback, tmf))
+    {
+        mTimeoutStats.tmfFailures++;
+        delete tmf;
+        escalate(cmd->lun, false);
+    }
+}
+
+void iSCSILibWrapper::sendLunReset(unsigned int lun)
+{
+    struct wrapper_task_mgmt *tmf = new wrapper_task_mgmt;
+
+    tmf->wrapper = this;
+    tmf->serial = 0;
+    tmf->lun = lun;
+    tmf->lunReset = true;
+
+    mTimeoutStats.lunResets++;
+    if (iscsi_task_mgmt_async(mIscsi, lun, ISCSI_TM_LUN_RESET,
+                              0xffffffff, 0, taskMgmtCallback, tmf))
+    {
+        mTimeoutStats.tmfFailures++;
+        delete tmf;
+        escalate(lun, true);
+        return;
+    }
+
+    mResettingLuns.insert(lun);
+}
+
+/*
+ * Task management that failed leaves libiscsi holding the command, and a
+ * late response would still land in its task, so the command cannot be
+ * given back yet. Try something bigger. Dropping the session may throw,
+ * which must not happen inside a libiscsi callback, so that is left to
+ * checkDeadlines.
+ */
+void iSCSILibWrapper::escalate(unsigned int lun, bool lunReset)
+{
+    if (lunReset)
+        mDropSession = true;
+    // A reset already on its way takes this command with it
+    else if (!mResettingLuns.count(lun))
+        sendLunReset(lun);
+}
+
+/*
+ * Responses on a connection arrive in order, so once the task management
+ * response is here, anything it covered that has not completed never will.
+ */
+void iSCSILibWrapper::taskMgmtCallback(struct iscsi_context *iscsi,
+                                       int status,
+                                       void *command_data,
+                                       void *private_data)
+{
+    struct wrapper_task_mgmt *tmf = (struct wrapper_task_mgmt *)private_data;
+    iSCSILibWrapper *obj = tmf->wrapper;
+
+    if (!obj->mRecovering)
+    {
+        if (tmf->lunReset)
+            obj->mResettingLuns.erase(tmf->lun);
+
+        if (status)
+        {
+            obj->mTimeoutStats.tmfFailures++;
+            obj->escalate(tmf->lun, tmf->lunReset);
+        }
+        else
+            obj->cancelTimedOut(tmf->serial, tmf->lun, tmf->lunReset);
+    }
+
+    delete tmf;
+}
+
+/*
+ * Complete what we gave up on with SCSI_STATUS_CANCELLED. libiscsi still
+ * has the commands, so keep them as zombies until it lets go of them or
+ * the context goes.
+ */
+void iSCSILibWrapper::cancelTimedOut(uint64_t serial,
+                                     unsigned int lun,
+                                     bool wholeLun)
+{
+    std::list<struct wrapper_command *>::iterator it, next;
+
+    for (it = mInFlight.begin(); it != mInFlight.end(); it = next)
+    {
+        struct wrapper_command *cmd = *it;
+        SCSIRequest &request = *cmd->request;
+
+        next = it;
+        ++next;
+
+        if (wholeLun ? cmd->lun != lun : cmd->serial != serial)
+            continue;
+
+        mInFlight.erase(it);
+        timerRemove(cmd);
+        makeZombie(cmd);
+
+        request.GetTask()->status = SCSI_STATUS_CANCELLED;
+        request.SetTimedOut();
+        completeSCSIRequest(request, cmd->lun, cmd->started);
+        mCompleted.push_back(&request);
+        mOutstanding--;
+        mTimeoutStats.timedOut++;
+    }
+
+    if (mSyncCommand &&
+        (wholeLun ? mSyncCommand->lun == lun : mSyncCommand->serial == serial))
+    {
+        struct wrapper_command *cmd = mSyncCommand;
+        SCSIRequest &request = *cmd->request;
+
+        timerRemove(cmd);
+        makeZombie(cmd);
+        request.GetTask()->status = SCSI_STATUS_CANCELLED;
+        request.SetTimedOut();
+        mTimeoutStats.timedOut++;
+
+        mSyncCommand = NULL;
+        mClient.finished = 1;
+    }
+
+    if (mWaitFor && mCompleted.size() >= mWaitFor)
+        mClient.finished = 1;
+}
+
+/*
+ * libiscsi keeps pointers to the task and data of a command until it calls
+ * back or the context goes, so take them off the request, which its owner
+ * is free to reuse or delete once it has it back.
+ */
+void iSCSILibWrapper::makeZombie(struct wrapper_command *cmd)
+{
+    SCSIRequest &request = *cmd->request;
+
+    cmd->task = request.DetachTask();
+    if (cmd->task->xfer_dir == SCSI_XFER_READ)
+        cmd->buffer = request.GetInBuffer();
+    else if (cmd->task->xfer_dir == SCSI_XFER_WRITE)
+        cmd->buffer = request.GetOutBuffer();
+    cmd->request = NULL;
+    mZombies.push_back(cmd);
+}
+
+void iSCSILibWrapper::deleteZombies(void)
+{
+    for (std::list<struct wrapper_command *>::iterator it = mZombies.begin();
+         it != mZombies.end(); ++it)
+        delete *it;
+    mZombies.clear();
+}
+
+std::string iSCSILibWrapper::TimeoutStatsString(void) const
+{
+    EString str;
+
+    str.Format("expired %llu, late %llu, timed out %llu, aborts %llu, "
+               "LUN resets %llu, session drops %llu, task management "
+               "failures %llu",
+               (unsigned long long)mTimeoutStats.expired,
+               (unsigned long long)mTimeoutStats.late,
+               (unsigned long long)mTimeoutStats.timedOut,
+               (unsigned long long)mTimeoutStats.aborts,
+               (unsigned long long)mTimeoutStats.lunResets,
+               (unsigned long long)mTimeoutStats.sessionDrops,
+               (unsigned long long)mTimeoutStats.tmfFailures);
+    return str;
+}
+
+/*
+ * Send a NOP-OUT and wait for the NOP-IN. If a paced ping is already out
+ * we just wait for that one.
+ */
+uint64_t iSCSILibWrapper::iSCSIPing(void)
+{
+    if (!mClient.connected || mClient.error)
+    {
+        mErrorString.Format("%s: Pinging target %s not possible without a connection!",
+                            __func__,
+                            mTarget.c_str());
+        throw CException(mErrorString);
+    }
+
+    if (!mAsyncActive)
+        iSCSIBackGround::GetInstance().RemoveConnection(*this);
+
+    // Lost while the background thread had it
+    if (mRecoveryPending)
+        recoverSession();
+
+    mLatency = true;
+    mClient.finished = 0;
+    mPingWait = true;
+
+    try
+    {
+        if (!mPingOutstanding)
+            sendPing();
+        ServiceISCSIEvents();
+    }
+    catch (...)
+    {
+        mPingWait = false;
+        throw;
+    }
+
+    mPingWait = false;
+
+    if (!mAsyncActive)
+        iSCSIBackGround::GetInstance().AddConnection(*this);
+
+    if (mPingStatus != SCSI_STATUS_GOOD)
+    {
+        mErrorString.Format("%s: NOP-OUT to target %s failed: status %d",
+                            __func__,
+                            mTarget.c_str(),
+                            mPingStatus);
+        throw CException(mErrorString);
+    }
+
+    return mLastPing;
+}
+
+void iSCSILibWrapper::SetPingInterval(unsigned int ms)
+{
+    mPingInterval = ms;
+    if (ms)
+        mLatency = true;
+    mNextPing = iSCSIMetrics::Now();
+}
+
+void iSCSILibWrapper::ResetLatency(void)
+{
+    mPingLatency.Reset();
+    mCommandLatency.Reset();
+    mPingFailures = 0;
+}
+
+/*
+ * Take the round trip from the command latency at the same percentile.
+ * The difference is only an estimate of the time at the target: the two
+ * distributions are not independent samples of the same commands.
+ */
+std::string iSCSILibWrapper::LatencyString(void) const
+{
+    static const double percentiles[] = { 50, 90, 99 };
+    std::string str;
+    EString line;
+
+    line.Format("ping (uS): %s, failures %llu\n",
+                mPingLatency.SummaryString().c_str(),
+                (unsigned long long)mPingFailures);
+    str.append(line);
+    line.Format("command (uS): %s\n",
+                mCommandLatency.SummaryString().c_str());
+    str.append(line);
+
+    if (!mPingLatency.GetCount() || !mCommandLatency.GetCount())
+        return str;
+
+    str.append("target (uS):");
+    for (unsigned int i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+        uint64_t command = mCommandLatency.GetPercentile(percentiles[i]);
+        uint64_t ping = mPingLatency.GetPercentile(percentiles[i]);
+
+        line.Format(" p%.0f %.1f", percentiles[i],
+                    command > ping ? (command - ping) / 1000.0 : 0.0);
+        str.append(line);
+    }
+    str.append("\n");
+
+    return str;
+}
+
+/*
+ * Execute a SCSI request synchronously
+ */
+void iSCSILibWrapper::iSCSIExecSCSISync(SCSIRequest &request, unsigned int lun)
+{
+    struct wrapper_command *cmd;
+    uint64_t started;
+
+    // Remove us from the background thread, unless async requests already
+    // have done so
+    if (!mAsyncActive)
+        iSCSIBackGround::GetInstance().RemoveConnection(*this);
+
+    checkSCSIRequest(request, __func__);
+
+    mClient.finished = 0;
+
+    cmd = new wrapper_command;
+    cmd->wrapper = this;
+    cmd->request = &request;
+    cmd->lun = lun;
+    cmd->started = mMetrics || mLatency ? iSCSIMetrics::Now() : 0;
+    cmd->timerIndex = NO_TIMER;
+    cmd->deadline = 0;
+    started = cmd->started;
+
+    try
+    {
+        submitSCSIRequest(request, lun, &cmd->data, syncExecCallback, cmd);
+    }
+    catch (...)
+    {
+        delete cmd;
+        throw;
+    }
+
+    // Recovery and task management need to know what we are waiting for
+    mSyncCommand = cmd;
+
+    try
+    {
+        if (mMetrics)
+            mMetrics->Submitted(lun, request.GetTask()->cdb[0]);
+        TRACE_NOW(cmd->traceSubmitted);
+        timerAdd(cmd, request);
+
+        ServiceISCSIEvents();
+        TRACE_ASYNC("target", &request, cmd->traceSubmitted);
+    }
+    catch (...)
+    {
+        // libiscsi still has it, so it has to outlive the request
+        if (mSyncCommand == cmd)
+        {
+            mSyncCommand = NULL;
+            timerRemove(cmd);
+            makeZombie(cmd);
+        }
+        else if (cmd->request)
+        {
+            timerRemove(cmd);
+            delete cmd;
+        }
+        throw;
+    }
+
+    // Given up on, it is a zombie now, see cancelTimedOut
+    if (cmd->request)
+    {
+        timerComplete(cmd);
+        delete cmd;
+    }
+
+    // Add to the background task
+    if (!mAsyncActive)
+        iSCSIBackGround::GetInstance().AddConnection(*this);
+
+    completeSCSIRequest(request, lun, started);
+}
+
+/*
+ * The callback for synchronous commands. Once we have given up on one the
+ * caller may have reused or freed its request, so leave that alone.
+ */
+void iSCSILibWrapper::syncExecCallback(struct iscsi_context *iscsi,
+                                       int status,
+                                       void *command_data,
+                                       void *private_data)
+{
+    struct wrapper_command *cmd = (struct wrapper_command *)private_data;
+    iSCSILibWrapper *obj = cmd->wrapper;
+    struct scsi_task *task = (struct scsi_task *)command_data;
+
+    // Re-driven or cancelled once we have reconnected
+    if (obj->mRecovering)
+        return;
+
+    if (!cmd->request)
+    {
+        obj->mZombies.remove(cmd);
+        delete cmd;
+        return;
+    }
+
+    if (task)
+        task->status = status;
+    obj->mSyncCommand = NULL;
+    obj->mClient.finished = 1;
+}
+
+/*
+ * The callback for asynchronous commands. Queue the request for the next
+ * iSCSIWaitSCSIAsync and let the event loop go once it has enough.
+ */
+void iSCSILibWrapper::asyncExecCallback(struct iscsi_context *iscsi,
+                                        int status,
+                                        void *command_data,
+                                        void *private_data)
+{
+    struct wrapper_command *cmd = (struct wrapper_command *)private_data;
+    iSCSILibWrapper *obj = cmd->wrapper;
+    struct scsi_task *task = (struct scsi_task *)command_data;
+
+    // The context is being thrown away under us. Keep the command, it will
+    // be re-driven or cancelled once we have reconnected.
+    if (obj->mRecovering)
+        return;
+
+    // Already given up on, see cancelTimedOut
+    if (!cmd->request)
+    {
+        obj->mZombies.remove(cmd);
+        delete cmd;
+        return;
+    }
+
+    if (task)
+        task->status = status;
+
+    TRACE_ASYNC("target", cmd->request, cmd->traceSubmitted);
+
+    obj->mInFlight.erase(cmd->pos);
+    obj->timerComplete(cmd);
+    obj->completeSCSIRequest(*cmd->request, cmd->lun, cmd->started);
+    obj->mCompleted.push_back(cmd->request);
+    obj->mOutstanding--;
+
+    if (obj->mWaitFor && obj->mCompleted.size() >= obj->mWaitFor)
+        obj->mClient.finished = 1;
+
+    delete cmd;
+}
+
+/*
+ * Submit a request without waiting for it
+ */
+void iSCSILibWrapper::iSCSIExecSCSIAsync(SCSIRequest &request,
+                                         unsigned int lun)
+{
+    struct wrapper_command *cmd;
+
+    // The background thread must keep its hands off us while anything is
+    // outstanding. We give the connection back when it all drains.
+    if (!mAsyncActive)
+    {
+        iSCSIBackGround::GetInstance().RemoveConnection(*this);
+        mAsyncActive = true;
+    }
+
+    cmd = new wrapper_command;
+    cmd->wrapper = this;
+    cmd->request = &request;
+    cmd->lun = lun;
+
+    try
+    {
+        checkSCSIRequest(request, __func__);
+        cmd->started = mMetrics || mLatency ? iSCSIMetrics::Now() : 0;
+        submitSCSIRequest(request, lun, &cmd->data, asyncExecCallback, cmd);
+    }
+    catch (...)
+    {
+        delete cmd;
+
+        // Nothing went out, so the background thread can have it back
+        if (!mOutstanding)
+        {
+            mAsyncActive = false;
+            iSCSIBackGround::GetInstance().AddConnection(*this);
+        }
+        throw;
+    }
+
+    if (mMetrics)
+        mMetrics->Submitted(lun, request.GetTask()->cdb[0]);
+    TRACE_NOW(cmd->traceSubmitted);
+
+    cmd->pos = mInFlight.insert(mInFlight.end(), cmd);
+    mOutstanding++;
+    timerAdd(cmd, request);
+}
+
+void iSCSILibWrapper::iSCSIExecBatch(std::vector<SCSIRequest *> &requests,
+                                     unsigned int lun)
+{
+    try
+    {
+        for (unsigned int i = 0; i < requests.size(); i++)
+            iSCSIExecSCSIAsync(*requests[i], lun);
+    }
+    catch (...)
+    {
+        // Whatever made it in still goes out
+        iSCSIFlushAsync();
+        throw;
+    }
+
+    iSCSIFlushAsync();
+}
+
+static void setCork(int fd, int on)
+{
+#ifdef TCP_CORK
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+/*
+ * Write out what libiscsi has queued while the socket will take it. If it
+ * fills up, the rest goes from the wait loop as before. Uncorking sends
+ * the last partial segment.
+ */
+void iSCSILibWrapper::iSCSIFlushAsync(void)
+{
+    int fd;
+
+    if (!mAsyncActive || !mOutstanding)
+        return;
+
+    fd = iscsi_get_fd(mIscsi);
+    setCork(fd, 1);
+
+    // Each pass writes at least one PDU, so this is plenty
+    for (unsigned int pass = 0; pass <= mOutstanding; pass++)
+    {
+        struct pollfd pfd;
+
+        if (!(iscsi_which_events(mIscsi) & POLLOUT))
+            break;
+
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLOUT))
+            break;
+
+        try
+        {
+            iSCSIServiceEvents(POLLOUT);
+        }
+        catch (...)
+        {
+            // Left corked, every later command would wait out the kernel's
+            // 200 mS cork timer
+            if (mIscsi && iscsi_get_fd(mIscsi) == fd)
+                setCork(fd, 0);
+            throw;
+        }
+
+        // Recovery gives us a new connection, which was never corked
+        if (iscsi_get_fd(mIscsi) != fd)
+            return;
+    }
+
+    setCork(fd, 0);
+}
+
+/*
+ * Wait for at least minCompletions asynchronous requests to complete and
+ * return all those that have.
+ */
+void iSCSILibWrapper::iSCSIWaitSCSIAsync(std::vector<SCSIRequest *> &completed,
+                                         unsigned int minCompletions)
+{
+    if (minCompletions > mOutstanding + mCompleted.size())
+        minCompletions = mOutstanding + mCompleted.size();
+
+    if (mCompleted.size() < minCompletions)
+    {
+        mWaitFor = minCompletions;
+        mClient.finished = 0;
+
+        try
+        {
+            ServiceISCSIEvents();
+        }
+        catch (...)
+        {
+            mWaitFor = 0;
+            throw;
+        }
+
+        mWaitFor = 0;
+    }
+
+    completed.insert(completed.end(), mCompleted.begin(), mCompleted.end());
+    mCompleted.clear();
+
+    if (mAsyncActive && !mOutstanding)
+    {
+        mAsyncActive = false;
+        iSCSIBackGround::GetInstance().AddConnection(*this);
+    }
+}
+
+void iSCSILibWrapper::SetRecovery(bool enable,
+                                  unsigned int maxAttempts,
+                                  unsigned int retryDelay)
+{
+    mRecovery = enable;
+    mRecoveryAttempts = maxAttempts ? maxAttempts : 1;
+    mRecoveryDelay = retryDelay;
+}
+
+/*
+ * Throw away the dead context and log in again on a new one. We follow a
+ * few redirects in case the portal we knew about has handed the target to
+ * another node.
+ */
+void iSCSILibWrapper::reconnectSession(const unsigned char *isid)
+{
+    std::string address = mRedirected ? mNewAddress : mAddress;
+    unsigned int redirects = 0;
+
+    for (;;)
+    {
+        // No logout, the connection is gone anyway
+        if (mIscsi)
+        {
+            iscsi_destroy_context(mIscsi);
+            mIscsi = NULL;
+            deleteZombies();
+        }
+        if (mClient.error_message)
+        {
+            free(mClient.error_message);
+            mClient.error_message = NULL;
+        }
+        mClient.connected = 0;
+        mClient.logged_in = 0;
+        mClient.error = 0;
+
+        connectTransport(address);
+
+        // Same ISID and a zero TSIH: the target reinstates the old session
+        // and cleans up what was left of it
+        memcpy(mIscsi->isid, isid, sizeof(mIscsi->isid));
+
+        try
+        {
+            normalLoginTransport();
+            return;
+        }
+        catch (CException &e)
+        {
+            std::string errStr(iscsi_get_error(mIscsi));
+
+            if (errStr.find("Target moved temporarily(257)") ==
+                std::string::npos || redirects++ >= 4)
+                throw;
+
+            address = std::string(iscsi_get_target_address(mIscsi));
+            mRedirected = true;
+            mNewAddress = address;
+            mRecoveryStats.redirects++;
+        }
+    }
+}
+
+/*
+ * Called from the event loop when the connection has been lost. Reconnect,
+ * then re-drive or cancel whatever was in flight, and leave mClient.finished
+ * set the way the interrupted wait expects.
+ */
+void iSCSILibWrapper::recoverSession(void)
+{
+    unsigned char isid[sizeof(mIscsi->isid)];
+    unsigned int waitFor = mWaitFor;
+    bool syncPending = mSyncCommand != NULL;
+    std::list<struct wrapper_command *> inFlight;
+
+    // The pause runs from the last good completion, which may be well
+    // before we noticed anything was wrong
+    if (!mPausePending)
+    {
+        mPausePending = true;
+        mPauseStart = mLastCompletion;
+    }
+
+    memcpy(isid, mIscsi->isid, sizeof(isid));
+
+    mRecovering = true;
+    mWaitFor = 0;
+
+    // Whatever is re-driven gets a new deadline
+    clearTimers();
+    mDropSession = false;
+
+    for (unsigned int attempt = 1; ; attempt++)
+    {
+        try
+        {
+            reconnectSession(isid);
+            break;
+        }
+        catch (CException &e)
+        {
+            mRecoveryStats.failedAttempts++;
+            if (attempt >= mRecoveryAttempts)
+            {
+                mRecovering = false;
+                mWaitFor = waitFor;
+                mError = true;
+                mErrorString.Format("%s: Giving up on target %s after %u attempts: %s",
+                                    __func__,
+                                    mTarget.c_str(),
+                                    attempt,
+                                    e.getDesc().c_str());
+                throw CException(mErrorString);
+            }
+            boost::this_thread::sleep(
+                boost::posix_time::milliseconds(mRecoveryDelay));
+        }
+    }
+
+    mRecoveryStats.recoveries++;
+    mRecovering = false;
+    mRecoveryPending = false;
+
+    // Any ping went with the old context. iSCSIPing is still waiting for
+    // one, if it was.
+    mPingOutstanding = false;
+    if (mPingWait)
+        sendPing();
+
+    // Re-drive, in the original order, what we safely can
+    inFlight.swap(mInFlight);
+    for (std::list<struct wrapper_command *>::iterator it = inFlight.begin();
+         it != inFlight.end();
+         it++)
+    {
+        struct wrapper_command *cmd = *it;
+        SCSIRequest &request = *cmd->request;
+        bool safe = request.IsRedriveSafe();
+
+        request.Reset();
+
+        if (safe)
+        {
+            submitSCSIRequest(request, cmd->lun, &cmd->data,
+                              asyncExecCallback, cmd);
+            cmd->pos = mInFlight.insert(mInFlight.end(), cmd);
+            timerAdd(cmd, request);
+            mRecoveryStats.redriven++;
+        }
+        else
+        {
+            request.GetTask()->status = SCSI_STATUS_CANCELLED;
+            completeSCSIRequest(request, cmd->lun, cmd->started);
+            mCompleted.push_back(&request);
+            mOutstanding--;
+            mRecoveryStats.cancelled++;
+            delete cmd;
+        }
+    }
+
+    if (syncPending)
+    {
+        struct wrapper_command *cmd = mSyncCommand;
+        SCSIRequest &request = *cmd->request;
+        bool safe = request.IsRedriveSafe();
+
+        request.Reset();
+
+        if (safe)
+        {
+            submitSCSIRequest(request, cmd->lun, &cmd->data,
+                              syncExecCallback, cmd);
+            timerAdd(cmd, request);
+            mRecoveryStats.redriven++;
+        }
+        else
+        {
+            request.GetTask()->status = SCSI_STATUS_CANCELLED;
+            mRecoveryStats.cancelled++;
+            mSyncCommand = NULL;
+        }
+    }
+
+    mWaitFor = waitFor;
+    if (syncPending)
+        mClient.finished = mSyncCommand == NULL;
+    else if (mWaitFor)
+        mClient.finished = mCompleted.size() >= mWaitFor;
+}
+
+/*
+ * Execute a request synchronously, retrying it as the policy says
+ */
+void iSCSILibWrapper::iSCSIExecSCSISyncRetry(SCSIRequest &request,
+                                             unsigned int lun,
+                                             SCSIRetryPolicy &policy)
+{
+    unsigned int retries = 0;
+    SCSIRetryPolicy::Action action;
+
+    for (;;)
+    {
+        iSCSIExecSCSISync(request, lun);
+
+        action = policy.Classify(request, retries);
+        if (action == SCSIRetryPolicy::ACTION_NONE)
+            break;
+
+        if (mMetrics)
+            mMetrics->Retried(lun, request.GetTask()->cdb[0]);
+
+        // We are back with the background thread while we sleep, so
+        // NOP-INs still get answered during long backoffs
+        if (action != SCSIRetryPolicy::ACTION_RETRY)
+            boost::this_thread::sleep(boost::posix_time::microseconds(
+                                          policy.GetBackoffDelay(retries)));
+
+        request.Reset();
+        retries++;
+    }
+}
+
+void iSCSILibWrapper::iSCSIExecSCSISyncSized(SCSIRequest &request,
+                                             unsigned int lun,
+                                             SCSIRetryPolicy &policy)
+{
+    unsigned int available;
+
+    iSCSIExecSCSISyncRetry(request, lun, policy);
+    if (request.GetStatus() != SCSI_STATUS_GOOD)
+        return;
+
+    available = request.GetAvailableLength();
+    if (available <= request.GetInBufferTransferSize())
+        return;
+
+    request.SetAllocationLength(available);
+    iSCSIExecSCSISyncRetry(request, lun, policy);
+}
+
+/*
+ * Execute a set of requests, keeping as many outstanding as the policy's
+ * queue depth allows. Retries go to the front of the line; those that must
+ * back off are parked until their time comes.
+ */
+void iSCSILibWrapper::iSCSIExecSCSIQueued(std::vector<SCSIRequest *> &requests,
+                                          unsigned int lun,
+                                          SCSIRetryPolicy &policy)
+{
+    std::map<SCSIRequest *, unsigned int> retries;
+    std::deque<SCSIRequest *> ready;
+    std::multimap<boost::system_time, SCSIRequest *> parked;
+    std::vector<SCSIRequest *> completed;
+    unsigned int next = 0;
+    unsigned int inFlight = 0;
+
+    // We cannot tell our completions from someone else's
+    if (mOutstanding || mCompleted.size())
+    {
+        mErrorString.Format("%s: Asynchronous requests already outstanding on target %s",
+                            __func__,
+                            mTarget.c_str());
+        mError = true;
+        throw CException(mErrorString);
+    }
+
+    while (next < requests.size() || ready.size() || parked.size() || inFlight)
+    {
+        boost::system_time now = boost::get_system_time();
+
+        while (parked.size() && parked.begin()->first <= now)
+        {
+            ready.push_back(parked.begin()->second);
+            parked.erase(parked.begin());
+        }
+
+        while (inFlight < policy.GetQueueDepth() &&
+               (ready.size() || next < requests.size()))
+        {
+            SCSIRequest *request;
+
+            if (ready.size())
+            {
+                request = ready.front();
+                ready.pop_front();
+            }
+            else
+            {
+                request = requests[next++];
+                retries[request] = 0;
+            }
+
+            iSCSIExecSCSIAsync(*request, lun);
+            inFlight++;
+        }
+
+        if (!inFlight)
+        {
+            // Nothing to do but wait for the first parked request
+            boost::this_thread::sleep(parked.begin()->first);
+            continue;
+        }
+
+        completed.clear();
+        iSCSIWaitSCSIAsync(completed, 1);
+
+        for (unsigned int i = 0; i < completed.size(); i++)
+        {
+            SCSIRequest *request = completed[i];
+            unsigned int &count = retries[request];
+            SCSIRetryPolicy::Action action;
+
+            inFlight--;
+
+            action = policy.Classify(*request, count);
+            if (action == SCSIRetryPolicy::ACTION_NONE)
+                continue;
+
+            if (mMetrics)
+                mMetrics->Retried(lun, request->GetTask()->cdb[0]);
+
+            request->Reset();
+
+            if (action == SCSIRetryPolicy::ACTION_RETRY)
+                ready.push_front(request);
+            else
+                parked.insert(std::make_pair(
+                    boost::get_system_time() +
+                        boost::posix_time::microseconds(
+                            policy.GetBackoffDelay(count)),
+                    request));
+            count++;
+        }
+    }
 }
 
 // Task management functions ...
@@ -21,9 +21,12 @@
 #define __iSCSILibWrapper_h__
 
 #include <vector>
+#include <list>
+#include <set>
 #include <signal.h>
 
 #include "SCSIRequest.h"
+#include "LatencyHistogram.h"
 #include "EString.h"
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
@@ -57,6 +60,97 @@ struct wrapper_client_state {
 };
 
 class SCSIRequest;
+class SCSIRetryPolicy;
+class iSCSIMetrics;
+class iSCSIDeviceCache;
+class iSCSILibWrapper;
+
+/**
+ * \struct wrapper_command
+ *
+ * The state for one command. This is what libiscsi hands back to us as
+ * private data when the command completes. Once given up on, it owns the
+ * task and buffer libiscsi is still using, and request is NULL.
+ */
+struct wrapper_command {
+    wrapper_command() : task(NULL) {}
+    ~wrapper_command()
+    {
+        if (task)
+            scsi_free_scsi_task(task);
+    }
+
+    iSCSILibWrapper *wrapper;
+    SCSIRequest *request;
+    struct scsi_task *task;                 // Only once given up on
+    boost::shared_array<uint8_t> buffer;    // Likewise
+    unsigned int lun;
+    uint64_t started;           // For metrics
+    uint64_t serial;            // Matches task management responses
+    uint64_t deadline;          // iSCSIMetrics::Now, 0 for none
+    unsigned int timerIndex;    // In the deadline heap, or NO_TIMER
+#ifdef SCSITEST_TRACE
+    uint64_t traceSubmitted;
+#endif
+    struct iscsi_data data;
+    std::list<struct wrapper_command *>::iterator pos; // In mInFlight
+};
+
+/**
+ * \struct iSCSILoginParams
+ *
+ * The operational parameters we offer at login, those libiscsi has public
+ * setters for: the header digest and, from version 1.4, ImmediateData and
+ * InitialR2T. Build with make LOGIN_PARAMS=1 to use the latter. The
+ * defaults are what libiscsi offers by itself. The burst lengths and
+ * MaxRecvDataSegmentLength are always libiscsi's, and there is no
+ * DataDigest: libiscsi does not do data digests at all.
+ */
+struct iSCSILoginParams {
+    iSCSILoginParams() :
+        headerDigest(ISCSI_HEADER_DIGEST_CRC32C_NONE),
+        immediateData(true),
+        initialR2T(false)
+        {}
+
+    enum iscsi_header_digest headerDigest;
+    bool immediateData;
+    bool initialR2T;
+};
+
+/**
+ * \struct iSCSIRecoveryStats
+ *
+ * What session recovery has done. The pause is the time from the last
+ * completion before the connection was lost to the first completion after
+ * it was recovered, ie, how long I/O stalled from the application's view.
+ */
+struct iSCSIRecoveryStats {
+    unsigned int recoveries;        // Successful reconnects
+    unsigned int failedAttempts;    // Reconnect attempts that failed
+    unsigned int redirects;         // Redirects followed while reconnecting
+    uint64_t redriven;              // In-flight commands sent again
+    uint64_t cancelled;             // In-flight commands failed back
+    uint64_t lastPauseUsecs;
+    uint64_t maxPauseUsecs;
+    uint64_t totalPauseUsecs;
+};
+
+/**
+ * \struct iSCSITimeoutStats
+ *
+ * What command deadlines have caught. Late commands are those the target
+ * completed after their deadline; timed out ones were given up on.
+ */
+struct iSCSITimeoutStats {
+    uint64_t expired;           // Deadlines passed
+    uint64_t late;
+    uint64_t timedOut;          // Completed with SCSI_STATUS_CANCELLED
+    uint64_t aborts;            // ABORT TASKs sent
+    uint64_t lunResets;
+    uint64_t sessionDrops;
+    uint64_t tmfFailures;       // Task management that did not complete
+};
 
 /**
  * \class DiscoveryPair
@@ -81,6 +175,22 @@ private:
 
 class iSCSILibWrapper;
 
+/**
+ * \class iSCSIObserver
+ *
+ * Subclass this to be shown every request a session completes, before the
+ * application gets it back. Observers run in whichever thread is driving
+ * the session, and must not send commands on it from Observe.
+ */
+class iSCSIObserver
+{
+public:
+    virtual ~iSCSIObserver() {}
+    virtual void Observe(iSCSILibWrapper &iscsi,
+                         unsigned int lun,
+                         SCSIRequest &request) = 0;
+};
+
 /**
  * class iSCSIBackGround
  *
@@ -100,6 +210,9 @@ public:
     // Stop the background thread if no connections
     void StopBackGroundTask();
 
+    // Keep the keepalive thread off the CPUs doing the real work
+    void SetCPUAffinity(const std::vector<int> &cpus);
+
 private:
     iSCSIBackGround() {}
     iSCSIBackGround(iSCSIBackGround const &); // Hidden copy const
@@ -118,6 +231,7 @@ private:
     bool mStop;
 
     std::vector<iSCSILibWrapper *> mConnections;
+    std::vector<int> mCPUs;
 };
 
 /**
@@ -143,6 +257,16 @@ public:
         DiscoveryLogin, NormalLogin
     };
 
+    enum TimeoutAction {
+        TIMEOUT_ABORT_TASK,
+        TIMEOUT_LUN_RESET,
+        TIMEOUT_DROP_SESSION,
+    };
+
+    static const unsigned int NO_TIMER = 0xFFFFFFFF;
+    // mS a busy poll spins for when the session has no timeout
+    static const int BUSY_POLL_MAX_SPIN = 1000;
+
     iSCSILibWrapper(int timeout = -1);
     virtual ~iSCSILibWrapper();
 
@@ -154,6 +278,15 @@ public:
     void SetAddress(const std::string &address) { mAddress = address; }
     const std::string &GetAddress(void) const { return mAddress; }
     const std::string &GetError(void) const { return mErrorString; }
+    void SetSessionQualifier(uint16_t qualifier)
+        { mSessionQualifier = qualifier; }
+
+    // Takes effect at the next normal login
+    void SetLoginParams(const iSCSILoginParams &params);
+    const iSCSILoginParams &GetLoginParams(void) const { return mLoginParams; }
+    // Only the header digest can be read back after login
+    enum iscsi_header_digest GetNegotiatedHeaderDigest(void);
+    std::string LoginParamsString(const iSCSILoginParams &params) const;
     bool IsRedirected() { return mRedirected; }
     std::string &GetNewAddress() { return mNewAddress; }
 
@@ -171,6 +304,206 @@ public:
     void iSCSIExecSCSISync(SCSIRequest &request, unsigned int lun);
     void iSCSIDisconnect(void);
 
+    /*
+     * Asynchronous execution. Submit any number of requests and then
+     * collect them, in completion order, with iSCSIWaitSCSIAsync. The
+     * connection is kept away from the background thread while requests
+     * are outstanding.
+     */
+    void iSCSIExecSCSIAsync(SCSIRequest &request, unsigned int lun);
+    void iSCSIWaitSCSIAsync(std::vector<SCSIRequest *> &completed,
+                            unsigned int minCompletions = 1);
+    unsigned int GetOutstanding(void) const { return mOutstanding; }
+
+    /*
+     * Batches. libiscsi only queues PDUs when a command is submitted and
+     * writes them when it is next told the socket is writable. So
+     * iSCSIExecBatch queues all the requests and then writes the lot in one
+     * pass with the socket corked. They leave in as few segments as possible
+     * and we do not wait for a poll wakeup before sending. iSCSIFlushAsync
+     * does the writing for requests queued with iSCSIExecSCSIAsync. Collect
+     * the completions with iSCSIWaitSCSIAsync as usual.
+     */
+    void iSCSIExecBatch(std::vector<SCSIRequest *> &requests, unsigned int lun);
+    void iSCSIFlushAsync(void);
+
+    /*
+     * For driving several connections from one event loop. Poll the
+     * descriptor from iSCSIGetPollFd yourself, pass what you got to
+     * iSCSIServiceEvents and then collect with iSCSIWaitSCSIAsync(x, 0).
+     * Only do this while requests are outstanding, otherwise the background
+     * thread owns the connection.
+     */
+    void iSCSIGetPollFd(struct pollfd &pfd);
+    void iSCSIServiceEvents(short revents);
+
+    /*
+     * Connecting and logging in without waiting, so one thread can drive
+     * many logins at once. Start a step, then poll and service events as
+     * above until iSCSIStepDone, and finish it, which throws if it failed.
+     * The connection only goes to the background thread once the login
+     * is finished. A connection that fails before then was never given to
+     * it, so just delete the wrapper rather than disconnecting.
+     */
+    void iSCSIStartConnect(void);
+    void iSCSIFinishConnect(void);
+    void iSCSIStartNormalLogin(void);
+    void iSCSIFinishNormalLogin(void);
+    bool iSCSIStepDone(void) const
+        { return mClient.finished || mClient.error; }
+
+    /*
+     * NUMA placement. The wrapper has no thread of its own, its event loop
+     * runs in whichever thread calls it. So give the session a node, or
+     * CPUs, and call BindCurrentThread from the thread that will drive it.
+     * That pins the thread and makes it take request buffers from the
+     * node's IOBufferPool. CPUs default to all of the node's.
+     */
+    void SetNUMANode(int node) { mNUMANode = node; }
+    int GetNUMANode(void) const { return mNUMANode; }
+    void SetCPUAffinity(const std::vector<int> &cpus) { mCPUs = cpus; }
+    void BindCurrentThread(void);
+
+    /*
+     * Session recovery. When enabled, losing the connection does not throw.
+     * Instead we reconnect, following redirects, and log in with the same
+     * ISID so the target reinstates the session. In-flight requests that
+     * are safe to send again (see SCSIRequest::IsRedriveSafe) are re-driven,
+     * the rest complete with SCSI_STATUS_CANCELLED. We give up, and throw,
+     * after maxAttempts failed reconnects spaced retryDelay mSec apart.
+     * A connection lost while idle, in the background thread's hands, is
+     * recovered by whichever call uses the session next, so the background
+     * thread never sleeps between attempts.
+     */
+    void SetRecovery(bool enable,
+                     unsigned int maxAttempts = 10,
+                     unsigned int retryDelay = 1000);
+    const iSCSIRecoveryStats &GetRecoveryStats(void) const
+        { return mRecoveryStats; }
+
+    /*
+     * Execution with retries, as directed by the policy. The queued version
+     * keeps up to policy.GetQueueDepth() requests outstanding and so
+     * responds to the policy throttling on TASK SET FULL. Requests that
+     * run out of retries are left with their final status for the caller
+     * to check.
+     */
+    void iSCSIExecSCSISyncRetry(SCSIRequest &request,
+                                unsigned int lun,
+                                SCSIRetryPolicy &policy);
+    void iSCSIExecSCSIQueued(std::vector<SCSIRequest *> &requests,
+                             unsigned int lun,
+                             SCSIRetryPolicy &policy);
+    /*
+     * For requests that report how much data they had, like REPORT LUNS
+     * and PERSISTENT RESERVE IN. If the first execution was cut short,
+     * grow the request to fit exactly what the target said and send it
+     * once more. Something that grows again in between is still cut short.
+     */
+    void iSCSIExecSCSISyncSized(SCSIRequest &request,
+                                unsigned int lun,
+                                SCSIRetryPolicy &policy);
+
+    /*
+     * Metrics. Off until enabled, after that every command is counted by
+     * session, LUN and opcode. See iSCSIMetricsExporter for writing them
+     * out over time.
+     */
+    void EnableMetrics(void);
+    const iSCSIMetrics *GetMetrics(void) const { return mMetrics; }
+
+    /*
+     * Device metadata cache. Off until enabled, after that INQUIRY, VPD
+     * and capacity data can be had from it without going to the target
+     * each time. Unit Attentions on this session keep it up to date.
+     */
+    void EnableDeviceCache(void);
+    iSCSIDeviceCache *GetDeviceCache(void) { return mDeviceCache; }
+
+    /*
+     * NOP-OUT pings, for a baseline of the network round trip. iSCSIPing
+     * sends one, waits for the NOP-IN and returns the round trip. With an
+     * interval set, a ping is also sent every interval while the session
+     * is being driven, so the round trip is measured under the same load
+     * as the commands. Once either is used, command latencies are kept too,
+     * and LatencyString estimates the time spent at the target from the
+     * difference. Nanoseconds, to microsecond resolution. Only read them
+     * from the thread driving the session. The background thread only
+     * looks at an idle session every 15 seconds, so ping those directly.
+     */
+    uint64_t iSCSIPing(void);
+    void SetPingInterval(unsigned int ms);
+    const LatencyHistogram &GetPingLatency(void) const { return mPingLatency; }
+    const LatencyHistogram &GetCommandLatency(void) const
+        { return mCommandLatency; }
+    uint64_t GetPingFailures(void) const { return mPingFailures; }
+    void ResetLatency(void);
+    std::string LatencyString(void) const;
+
+    /*
+     * Command deadlines. The timeout given to the constructor only limits
+     * how long each poll waits for anything at all to happen, so with many
+     * commands outstanding one that never completes goes unnoticed. With a
+     * command timeout, every command gets a deadline, which
+     * SCSIRequest::SetTimeout can override. Deadlines are kept in a heap
+     * with a timerfd armed for the earliest. When one passes:
+     * - TIMEOUT_ABORT_TASK sends ABORT TASK for the command,
+     * - TIMEOUT_LUN_RESET resets its LUN, taking everything outstanding on
+     *   the LUN with it,
+     * - TIMEOUT_DROP_SESSION drops the connection and leaves the rest to
+     *   session recovery, or throws if recovery is off.
+     * Once the task management response is in, whatever it covered that
+     * the target has not completed completes with SCSI_STATUS_CANCELLED and
+     * IsTimedOut set. Until then libiscsi may still complete the command,
+     * so when an ABORT TASK fails the LUN is reset, and when that fails the
+     * session is dropped as for TIMEOUT_DROP_SESSION. An event loop driving
+     * several sessions should poll iSCSIGetTimerFd as well, and call
+     * iSCSIServiceTimers when it fires.
+     */
+    void SetCommandTimeout(unsigned int ms,
+                           TimeoutAction action = TIMEOUT_ABORT_TASK);
+    int iSCSIGetTimerFd(void) const { return mTimerFd; }
+    // Fills in pfd for the timerfd, false if there is none yet
+    bool iSCSIGetTimerPollFd(struct pollfd &pfd);
+    void iSCSIServiceTimers(void);
+    const iSCSITimeoutStats &GetTimeoutStats(void) const
+        { return mTimeoutStats; }
+    std::string TimeoutStatsString(void) const;
+
+    /*
+     * Busy polling, for latencies so short that the wakeup from a blocking
+     * poll is a large part of them. Instead of sleeping in poll, the event
+     * loop spins on a poll that does not wait, until the socket or timerfd
+     * is ready. The socket also gets SO_BUSY_POLL, for socketUsecs, so the
+     * kernel spins on the NIC queue for our reads rather than waiting for
+     * an interrupt. Raising that above net.core.busy_read needs
+     * CAP_NET_ADMIN; IsBusyPollSocket says if the kernel took it, the
+     * spinning is done either way. This burns the whole CPU while waiting,
+     * so pin the driving thread to a core of its own first, see
+     * SetCPUAffinity and BindCurrentThread. The spin is bounded by the
+     * session timeout, or BUSY_POLL_MAX_SPIN without one, after which it
+     * sleeps in poll. Only this session's own loop spins; loops driving
+     * several sessions, and the background thread's keepalives, poll as
+     * before.
+     */
+    void SetBusyPoll(bool enable, unsigned int socketUsecs = 50);
+    bool GetBusyPoll(void) const { return mBusyPoll; }
+    bool IsBusyPollSocket(void) const { return mBusyPollSocket; }
+
+    // We do not own observers, remove them before they go away
+    void AddObserver(iSCSIObserver &observer);
+    void RemoveObserver(iSCSIObserver &observer);
+
+    /*
+     * Put a logged in session back the way a new one would be, so someone
+     * else can use it: clears the error, redirect, observers, recovery
+     * settings and stats, command timeouts, pings and latencies, busy
+     * polling and NUMA placement, and empties the device cache. Metrics are
+     * left alone as an exporter may be watching them. Nothing may be
+     * outstanding.
+     */
+    void ResetSessionState(void);
+
     // Task Management functions
     void iSCSITaskAbort(SCSIRequest &request);
     void iSCSITaskSetAbort(void);
@@ -211,6 +544,60 @@ protected:
 
     void ServiceISCSIEvents(bool oneShot = false);
 
+    void connectTransport(const std::string &address);
+    void startConnect(const std::string &address);
+    void normalLoginTransport(void);
+    void startNormalLogin(void);
+    void checkStep(const char *func);
+    void recoverSession(void);
+    void sendPing(void);
+    void timerAdd(struct wrapper_command *cmd, SCSIRequest &request);
+    void timerRemove(struct wrapper_command *cmd);
+    void timerComplete(struct wrapper_command *cmd);
+    void timerSwap(unsigned int a, unsigned int b);
+    void timerSiftUp(unsigned int index);
+    void timerSiftDown(unsigned int index);
+    void timerArm(void);
+    void clearTimers(void);
+    void checkDeadlines(void);
+    int pollEvents(struct pollfd *pfds, unsigned int count, bool spin);
+    void setBusyPollSocket(int fd);
+    void expireCommand(struct wrapper_command *cmd);
+    void sendTaskMgmt(struct wrapper_command *cmd, bool lunReset);
+    void sendLunReset(unsigned int lun);
+    void escalate(unsigned int lun, bool lunReset);
+    void dropSession(void);
+    void cancelTimedOut(uint64_t serial, unsigned int lun, bool wholeLun);
+    void makeZombie(struct wrapper_command *cmd);
+    void deleteZombies(void);
+    static void taskMgmtCallback(struct iscsi_context *iscsi,
+                                 int status,
+                                 void *command_data,
+                                 void *private_data);
+    static void pingCallback(struct iscsi_context *iscsi,
+                             int status,
+                             void *command_data,
+                             void *private_data);
+    void reconnectSession(const unsigned char *isid);
+
+    void checkSCSIRequest(SCSIRequest &request, const char *func);
+    void submitSCSIRequest(SCSIRequest &request,
+                           unsigned int lun,
+                           struct iscsi_data *data,
+                           iscsi_command_cb cb,
+                           void *privateData);
+    void completeSCSIRequest(SCSIRequest &request,
+                             unsigned int lun,
+                             uint64_t started);
+    static void asyncExecCallback(struct iscsi_context *iscsi,
+                                  int status,
+                                  void *command_data,
+                                  void *private_data);
+    static void syncExecCallback(struct iscsi_context *iscsi,
+                                 int status,
+                                 void *command_data,
+                                 void *private_data);
+
     int mTimeout;
     bool mError;
     bool mRedirected;
@@ -224,6 +611,70 @@ protected:
     std::string mTarget;
     std::vector<WrapperDiscoveryPair> mDiscoveryPairs;
     boost::system_time mBGTimeout;
+    uint16_t mSessionQualifier;
+    iSCSILoginParams mLoginParams;
+
+    // Asynchronous command state
+    bool mAsyncActive;  // Taken from the background thread for async work
+    unsigned int mOutstanding;
+    unsigned int mWaitFor;
+    std::vector<SCSIRequest *> mCompleted;
+    std::list<struct wrapper_command *> mInFlight;
+
+    // The synchronous request libiscsi has, if any
+    struct wrapper_command *mSyncCommand;
+
+    // Session recovery
+    bool mRecovery;
+    bool mRecovering;
+    bool mRecoveryPending;      // Lost in the background, see above
+    bool mInBackground;         // Serviced by the background thread
+    unsigned int mRecoveryAttempts;
+    unsigned int mRecoveryDelay;
+    bool mPausePending;
+    boost::system_time mPauseStart;
+    boost::system_time mLastCompletion;
+    iSCSIRecoveryStats mRecoveryStats;
+
+    // Command deadlines
+    unsigned int mCommandTimeout;
+    TimeoutAction mTimeoutAction;
+    int mTimerFd;
+    uint64_t mTimerArmed;       // When the timerfd fires, 0 if disarmed
+    uint64_t mNextSerial;
+    std::vector<struct wrapper_command *> mTimers;  // Min-heap on deadline
+    std::set<unsigned int> mResettingLuns;
+    bool mDropSession;          // A LUN reset failed, see escalate
+    // Given up on, but libiscsi may still call back with them
+    std::list<struct wrapper_command *> mZombies;
+    iSCSITimeoutStats mTimeoutStats;
+
+    // Busy polling
+    bool mBusyPoll;
+    unsigned int mBusyPollUsecs;
+    int mBusyPollFd;            // The socket SO_BUSY_POLL was tried on
+    bool mBusyPollSocket;
+
+    // NUMA placement
+    int mNUMANode;
+    std::vector<int> mCPUs;
+
+    // NOP-OUT pings and latencies, in iSCSIMetrics::Now microseconds
+    bool mLatency;
+    unsigned int mPingInterval;
+    bool mPingOutstanding;
+    bool mPingWait;             // iSCSIPing is waiting for it
+    int mPingStatus;
+    uint64_t mPingSent;
+    uint64_t mNextPing;
+    uint64_t mLastPing;         // Nanoseconds
+    uint64_t mPingFailures;
+    LatencyHistogram mPingLatency;
+    LatencyHistogram mCommandLatency;
+
+    iSCSIMetrics *mMetrics;
+    iSCSIDeviceCache *mDeviceCache;
+    std::vector<iSCSIObserver *> mObservers;
 };
 
 #endif
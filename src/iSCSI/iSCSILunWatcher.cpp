@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * Watching for LUNs being added and removed.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <algorithm>
+
+#include "iSCSILunWatcher.h"
+#include "SCSIReportLuns.h"
+#include "EString.h"
+#include "CException.h"
+
+#define SCSI_SENSE_ASCQ_REPORTED_LUNS_DATA_CHANGED  0x3F0E
+
+iSCSILunWatcher::iSCSILunWatcher() :
+    mPending(false),
+    mUnitAttentions(0),
+    mReports(0),
+    mChanges(0)
+{
+}
+
+iSCSILunWatcher::~iSCSILunWatcher()
+{
+    for (unsigned int i = 0; i < mSessions.size(); i++)
+        mSessions[i]->RemoveObserver(*this);
+}
+
+void iSCSILunWatcher::AddSession(iSCSILibWrapper &iscsi)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    if (std::find(mSessions.begin(), mSessions.end(), &iscsi) !=
+        mSessions.end())
+        return;
+
+    mSessions.push_back(&iscsi);
+    iscsi.AddObserver(*this);
+}
+
+void iSCSILunWatcher::RemoveSession(iSCSILibWrapper &iscsi)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    std::vector<iSCSILibWrapper *>::iterator it;
+
+    it = std::find(mSessions.begin(), mSessions.end(), &iscsi);
+    if (it == mSessions.end())
+        return;
+
+    iscsi.RemoveObserver(*this);
+    mSessions.erase(it);
+}
+
+/*
+ * Always against LUN 0, which must be there even if it is not a device
+ */
+void iSCSILunWatcher::reportLuns(iSCSILibWrapper &iscsi,
+                                 std::vector<uint64_t> &luns)
+{
+    SCSIReportLuns report;
+
+    iscsi.iSCSIExecSCSISyncSized(report, 0, mRetryPolicy);
+    mReports++;
+    if (report.GetStatus() != SCSI_STATUS_GOOD)
+    {
+        EString estr;
+        estr.Format("%s: REPORT LUNS failed: Status: %s, SenseKey: %s, "
+                    "ASCQ: %s",
+                    __func__,
+                    report.StatusString().c_str(),
+                    report.SenseKeyString().c_str(),
+                    report.ASCQString().c_str());
+        throw CException(estr);
+    }
+
+    luns.clear();
+    // It may still have grown since we sized the request
+    for (unsigned int i = 0;
+         i < report.GetLunCount() &&
+         8 * (i + 2) <= report.GetInBufferTransferSize();
+         i++)
+        luns.push_back(report.GetLunId(i));
+
+    std::sort(luns.begin(), luns.end());
+}
+
+void iSCSILunWatcher::Start(iSCSILibWrapper &iscsi)
+{
+    boost::mutex::scoped_lock checkLock(mCheckMutex);
+
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mPending = false;
+    }
+
+    reportLuns(iscsi, mLuns);
+}
+
+void iSCSILunWatcher::Notify(void)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    mPending = true;
+}
+
+bool iSCSILunWatcher::IsPending(void)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    return mPending;
+}
+
+std::vector<uint64_t> iSCSILunWatcher::GetLuns(void)
+{
+    boost::mutex::scoped_lock checkLock(mCheckMutex);
+
+    return mLuns;
+}
+
+/*
+ * A change noticed while another thread is checking is picked up by the
+ * next Check, once that one is done.
+ */
+bool iSCSILunWatcher::Check(iSCSILibWrapper &iscsi)
+{
+    boost::mutex::scoped_lock checkLock(mCheckMutex);
+    std::vector<uint64_t> luns, added, removed;
+
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+
+        if (!mPending)
+            return false;
+        mPending = false;
+    }
+
+    try
+    {
+        reportLuns(iscsi, luns);
+    }
+    catch (...)
+    {
+        // Leave it for the next Check
+        Notify();
+        throw;
+    }
+
+    Diff(mLuns, luns, added, removed);
+    mLuns.swap(luns);
+
+    if (added.size() || removed.size())
+    {
+        mChanges++;
+        LunsChanged(added, removed);
+    }
+
+    return true;
+}
+
+/*
+ * A single pass over both sorted lists
+ */
+void iSCSILunWatcher::Diff(const std::vector<uint64_t> &before,
+                           const std::vector<uint64_t> &after,
+                           std::vector<uint64_t> &added,
+                           std::vector<uint64_t> &removed)
+{
+    unsigned int i = 0, j = 0;
+
+    while (i < before.size() || j < after.size())
+    {
+        if (j == after.size() ||
+            (i < before.size() && before[i] < after[j]))
+            removed.push_back(before[i++]);
+        else if (i == before.size() || after[j] < before[i])
+            added.push_back(after[j++]);
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+}
+
+void iSCSILunWatcher::Observe(iSCSILibWrapper & /* iscsi */,
+                              unsigned int /* lun */,
+                              SCSIRequest &request)
+{
+    if (request.GetStatus() != SCSI_STATUS_CHECK_CONDITION ||
+        request.GetSCSISenseKey() != SCSI_SENSE_UNIT_ATTENTION ||
+        request.GetSCSIASCQ() != SCSI_SENSE_ASCQ_REPORTED_LUNS_DATA_CHANGED)
+        return;
+
+    boost::mutex::scoped_lock lock(mMutex);
+
+    mUnitAttentions++;
+    mPending = true;
+}
+
+std::string iSCSILunWatcher::StatsString(void) const
+{
+    EString str;
+
+    str.Format("LUNs %u, unit attentions %llu, reports %llu, changes %llu",
+               (unsigned int)mLuns.size(),
+               (unsigned long long)mUnitAttentions,
+               (unsigned long long)mReports,
+               (unsigned long long)mChanges);
+    return str;
+}
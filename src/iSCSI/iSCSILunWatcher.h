@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __iSCSILunWatcher_h__
+#define __iSCSILunWatcher_h__
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+#include "iSCSILibWrapper.h"
+#include "SCSIRetryPolicy.h"
+
+/**
+ * \class iSCSILunWatcher
+ *
+ * Tells the application when LUNs come and go, without polling REPORT
+ * LUNS. It watches its sessions for the REPORTED LUNS DATA HAS CHANGED
+ * Unit Attention and only then sends REPORT LUNS again. The new list is
+ * sorted and merged against the old one, and LunsChanged is called with
+ * what was added and removed.
+ *
+ * The Unit Attention turns up on whichever command next goes to the
+ * target on each session, so the watcher only notes it. Call Check from
+ * the thread driving a session when it is idle; it does the REPORT LUNS
+ * on that session. However many sessions saw the change, one Check
+ * handles it. Checks from different threads take turns, so LunsChanged
+ * must not call Check or Start itself.
+ *
+ * libiscsi does not hand Asynchronous Messages to us, so if the
+ * application hears of a change some other way, it can say so with
+ * Notify.
+ *
+ * LUNs are the whole 8 byte LUN from REPORT LUNS.
+ */
+class iSCSILunWatcher : public iSCSIObserver
+{
+public:
+    iSCSILunWatcher();
+    virtual ~iSCSILunWatcher();
+
+    // Sessions must outlive the watcher, or be removed first
+    void AddSession(iSCSILibWrapper &iscsi);
+    void RemoveSession(iSCSILibWrapper &iscsi);
+
+    // Get the list to compare against. Does not call LunsChanged.
+    void Start(iSCSILibWrapper &iscsi);
+
+    void Notify(void);
+    bool IsPending(void);
+    /*
+     * If a change was seen, send REPORT LUNS on this session and call
+     * LunsChanged if the list is different. Returns true if it sent one.
+     */
+    bool Check(iSCSILibWrapper &iscsi);
+
+    std::vector<uint64_t> GetLuns(void);
+
+    uint64_t GetUnitAttentions(void) const { return mUnitAttentions; }
+    uint64_t GetReports(void) const { return mReports; }
+    uint64_t GetChanges(void) const { return mChanges; }
+    std::string StatsString(void) const;
+
+    // Both sorted. Appends to added and removed.
+    static void Diff(const std::vector<uint64_t> &before,
+                     const std::vector<uint64_t> &after,
+                     std::vector<uint64_t> &added,
+                     std::vector<uint64_t> &removed);
+
+    virtual void Observe(iSCSILibWrapper &iscsi,
+                         unsigned int lun,
+                         SCSIRequest &request);
+
+protected:
+    /*
+     * Subclass to hear about changes. Called from Check, so sending
+     * commands from here is fine.
+     */
+    virtual void LunsChanged(const std::vector<uint64_t> & /* added */,
+                             const std::vector<uint64_t> & /* removed */) {}
+
+    void reportLuns(iSCSILibWrapper &iscsi, std::vector<uint64_t> &luns);
+
+    boost::mutex mMutex;    // Sessions may be driven from several threads
+    boost::mutex mCheckMutex;   // Held by Start and Check, for mLuns
+    bool mPending;
+    uint64_t mUnitAttentions;
+    uint64_t mReports;
+    uint64_t mChanges;
+    std::vector<uint64_t> mLuns;
+    std::vector<iSCSILibWrapper *> mSessions;
+    SCSIRetryPolicy mRetryPolicy;
+};
+
+#endif
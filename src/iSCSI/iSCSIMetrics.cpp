@@ -0,0 +1,489 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * Per-session metrics and the exporter that writes them out over time.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "iSCSIMetrics.h"
+#include "iSCSILibWrapper.h"
+#include "SCSIRequest.h"
+#include "EString.h"
+#include "CException.h"
+
+iSCSIMetrics::iSCSIMetrics() :
+    mLunCount(0)
+{
+    memset(&mSession, 0, sizeof(mSession));
+    memset(mOpcodes, 0, sizeof(mOpcodes));
+    memset(mLuns, 0, sizeof(mLuns));
+    memset(mLunIds, 0, sizeof(mLunIds));
+}
+
+uint64_t iSCSIMetrics::Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * A new LUN's id is filled in before the count says it is there, so a
+ * snapshot never sees a slot that is not set up.
+ */
+iSCSIMetricsCounters *iSCSIMetrics::lunCounters(unsigned int lun)
+{
+    unsigned int count = mLunCount;
+
+    for (unsigned int i = 0; i < count; i++)
+        if (mLunIds[i] == lun)
+            return &mLuns[i];
+
+    if (count == MAX_LUNS)
+        return NULL;
+
+    mLunIds[count] = lun;
+    __sync_synchronize();
+    mLunCount = count + 1;
+
+    return &mLuns[count];
+}
+
+void iSCSIMetrics::Submitted(unsigned int lun, uint8_t opcode)
+{
+    iSCSIMetricsCounters *lunCount = lunCounters(lun);
+
+    mSession.submitted++;
+    mOpcodes[opcode].submitted++;
+    if (lunCount)
+        lunCount->submitted++;
+}
+
+void iSCSIMetrics::Retried(unsigned int lun, uint8_t opcode)
+{
+    iSCSIMetricsCounters *lunCount = lunCounters(lun);
+
+    mSession.retries++;
+    mOpcodes[opcode].retries++;
+    if (lunCount)
+        lunCount->retries++;
+}
+
+void iSCSIMetrics::Completed(unsigned int lun,
+                             SCSIRequest &request,
+                             uint64_t started)
+{
+    struct scsi_task *task = request.GetTask();
+    iSCSIMetricsCounters *counters[3];
+    uint64_t bytes = 0;
+    uint64_t latency = Now() - started;
+    bool error = task->status != SCSI_STATUS_GOOD;
+    int sense = -1;
+
+    if (task->xfer_dir == SCSI_XFER_READ)
+        bytes = request.GetInBufferTransferSize();
+    else if (task->xfer_dir == SCSI_XFER_WRITE)
+        bytes = request.GetOutBufferSize();
+
+    if (task->status == SCSI_STATUS_CHECK_CONDITION)
+        sense = request.GetSCSISenseKey() & (iSCSIMetricsCounters::SENSE_KEYS - 1);
+
+    counters[0] = &mSession;
+    counters[1] = &mOpcodes[task->cdb[0]];
+    counters[2] = lunCounters(lun);
+
+    for (unsigned int i = 0; i < 3 && counters[i]; i++)
+    {
+        counters[i]->commands++;
+        counters[i]->bytes += bytes;
+        counters[i]->latencyUsecs += latency;
+        if (error)
+            counters[i]->errors++;
+        if (sense >= 0)
+            counters[i]->senseKeys[sense]++;
+    }
+}
+
+/*
+ * Read through volatile so the compiler really does load each counter
+ */
+static void copyCounters(iSCSIMetricsCounters &to,
+                         const iSCSIMetricsCounters &from)
+{
+    const volatile uint64_t *src = (const volatile uint64_t *)&from;
+    uint64_t *dst = (uint64_t *)&to;
+
+    for (unsigned int i = 0; i < sizeof(from) / sizeof(uint64_t); i++)
+        dst[i] = src[i];
+}
+
+void iSCSIMetrics::Snapshot(iSCSIMetricsSnapshot &snapshot) const
+{
+    unsigned int count = mLunCount;
+
+    __sync_synchronize();
+
+    snapshot.usecs = Now();
+    copyCounters(snapshot.session, mSession);
+
+    snapshot.luns.resize(count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        snapshot.luns[i].first = mLunIds[i];
+        copyCounters(snapshot.luns[i].second, mLuns[i]);
+    }
+
+    snapshot.opcodes.clear();
+    for (unsigned int i = 0; i < OPCODES; i++)
+    {
+        const volatile uint64_t &submitted = mOpcodes[i].submitted;
+
+        if (!submitted)
+            continue;
+
+        snapshot.opcodes.push_back(
+            std::make_pair(i, iSCSIMetricsCounters()));
+        copyCounters(snapshot.opcodes.back().second, mOpcodes[i]);
+    }
+}
+
+iSCSIMetricsExporter::iSCSIMetricsExporter(unsigned int intervalMs,
+                                           Format format) :
+    mIntervalMs(intervalMs),
+    mFormat(format),
+    mFile(NULL),
+    mIntervals(0),
+    mStop(false)
+{
+    if (!intervalMs)
+        throw CException("iSCSIMetricsExporter: Interval must not be zero");
+}
+
+iSCSIMetricsExporter::~iSCSIMetricsExporter()
+{
+    Stop();
+}
+
+void iSCSIMetricsExporter::AddSession(const std::string &name,
+                                      iSCSILibWrapper &session)
+{
+    if (!session.GetMetrics())
+    {
+        EString estr;
+        estr.Format("%s: Metrics are not enabled on session %s",
+                    __func__, name.c_str());
+        throw CException(estr);
+    }
+
+    AddSession(name, *session.GetMetrics());
+}
+
+void iSCSIMetricsExporter::AddSession(const std::string &name,
+                                      const iSCSIMetrics &metrics)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    Source source;
+
+    source.name = name;
+    source.metrics = &metrics;
+    metrics.Snapshot(source.last);
+    mSources.push_back(source);
+}
+
+void iSCSIMetricsExporter::Start(const std::string &path)
+{
+    if (mFile)
+        throw CException("iSCSIMetricsExporter::Start: Already started");
+
+    if (!(mFile = fopen(path.c_str(), "a")))
+    {
+        EString estr;
+        estr.Format("%s: Cannot open %s: %s",
+                    __func__, path.c_str(), strerror(errno));
+        throw CException(estr);
+    }
+
+    if (mFormat == CSV && ftell(mFile) == 0)
+        fprintf(mFile, "time_ms,session,scope,id,commands,iops,mbps,errors,"
+                       "retries,outstanding,lat_usec,sense\n");
+
+    // Intervals start now, not when the sessions were added
+    for (unsigned int i = 0; i < mSources.size(); i++)
+        mSources[i].metrics->Snapshot(mSources[i].last);
+
+    mStop = false;
+    mThread = boost::thread(&iSCSIMetricsExporter::exportThread, this);
+}
+
+/*
+ * Stopping writes out the partial interval so the tail is not lost
+ */
+void iSCSIMetricsExporter::Stop(void)
+{
+    if (!mFile)
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mStop = true;
+        mCond.notify_one();
+    }
+
+    mThread.join();
+    fclose(mFile);
+    mFile = NULL;
+}
+
+void iSCSIMetricsExporter::exportThread(void)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    boost::system_time next = boost::get_system_time() +
+                              boost::posix_time::milliseconds(mIntervalMs);
+
+    while (!mStop)
+    {
+        // Keep to the schedule however long the writing takes
+        if (!mCond.timed_wait(lock, next))
+        {
+            exportInterval();
+            next += boost::posix_time::milliseconds(mIntervalMs);
+        }
+    }
+
+    exportInterval();
+}
+
+static std::string jsonString(const std::string &str)
+{
+    std::string out = "\"";
+
+    for (unsigned int i = 0; i < str.size(); i++)
+    {
+        if (str[i] == '"' || str[i] == '\\')
+            out += '\\';
+        out += str[i];
+    }
+
+    return out + "\"";
+}
+
+/*
+ * Find what used to be in a LUN or opcode list. They only ever grow.
+ */
+static const iSCSIMetricsCounters *findLast(
+    const std::vector<std::pair<unsigned int, iSCSIMetricsCounters> > &list,
+    unsigned int id)
+{
+    for (unsigned int i = 0; i < list.size(); i++)
+        if (list[i].first == id)
+            return &list[i].second;
+
+    return NULL;
+}
+
+static iSCSIMetricsCounters difference(const iSCSIMetricsCounters &now,
+                                       const iSCSIMetricsCounters *last)
+{
+    iSCSIMetricsCounters diff = now;
+
+    if (!last)
+        return diff;
+
+    diff.submitted -= last->submitted;
+    diff.commands -= last->commands;
+    diff.bytes -= last->bytes;
+    diff.errors -= last->errors;
+    diff.retries -= last->retries;
+    diff.latencyUsecs -= last->latencyUsecs;
+    for (unsigned int i = 0; i < iSCSIMetricsCounters::SENSE_KEYS; i++)
+        diff.senseKeys[i] -= last->senseKeys[i];
+
+    return diff;
+}
+
+static bool idle(const iSCSIMetricsCounters &diff,
+                 const iSCSIMetricsCounters &now)
+{
+    return !diff.submitted && !diff.commands && !diff.retries &&
+           !now.GetOutstanding();
+}
+
+void iSCSIMetricsExporter::writeCSV(uint64_t timeMs,
+                                    double secs,
+                                    const std::string &name,
+                                    const char *scope,
+                                    unsigned int id,
+                                    const iSCSIMetricsCounters &now,
+                                    const iSCSIMetricsCounters *last)
+{
+    iSCSIMetricsCounters diff = difference(now, last);
+    std::string sense;
+
+    if (idle(diff, now))
+        return;
+
+    for (unsigned int i = 0; i < iSCSIMetricsCounters::SENSE_KEYS; i++)
+    {
+        EString entry;
+
+        if (!diff.senseKeys[i])
+            continue;
+        entry.Format("%s%u:%llu", sense.size() ? " " : "", i,
+                     (unsigned long long)diff.senseKeys[i]);
+        sense.append(entry);
+    }
+
+    fprintf(mFile, "%llu,%s,%s,%u,%llu,%.1f,%.3f,%llu,%llu,%llu,%.1f,%s\n",
+            (unsigned long long)timeMs,
+            name.c_str(),
+            scope,
+            id,
+            (unsigned long long)diff.commands,
+            diff.commands / secs,
+            diff.bytes / secs / 1000000.0,
+            (unsigned long long)diff.errors,
+            (unsigned long long)diff.retries,
+            (unsigned long long)now.GetOutstanding(),
+            diff.commands ? (double)diff.latencyUsecs / diff.commands : 0.0,
+            sense.c_str());
+}
+
+std::string iSCSIMetricsExporter::jsonCounters(double secs,
+                                               const iSCSIMetricsCounters &now,
+                                               const iSCSIMetricsCounters *last)
+{
+    iSCSIMetricsCounters diff = difference(now, last);
+    std::string sense;
+    EString str;
+
+    for (unsigned int i = 0; i < iSCSIMetricsCounters::SENSE_KEYS; i++)
+    {
+        EString entry;
+
+        if (!diff.senseKeys[i])
+            continue;
+        entry.Format("%s\"%u\":%llu", sense.size() ? "," : "", i,
+                     (unsigned long long)diff.senseKeys[i]);
+        sense.append(entry);
+    }
+
+    str.Format("{\"commands\":%llu,\"iops\":%.1f,\"mbps\":%.3f,"
+               "\"errors\":%llu,\"retries\":%llu,\"outstanding\":%llu,"
+               "\"lat_usec\":%.1f,\"sense\":{%s}}",
+               (unsigned long long)diff.commands,
+               diff.commands / secs,
+               diff.bytes / secs / 1000000.0,
+               (unsigned long long)diff.errors,
+               (unsigned long long)diff.retries,
+               (unsigned long long)now.GetOutstanding(),
+               diff.commands ? (double)diff.latencyUsecs / diff.commands : 0.0,
+               sense.c_str());
+    return str;
+}
+
+/*
+ * Called with mMutex held
+ */
+void iSCSIMetricsExporter::exportInterval(void)
+{
+    struct timeval tv;
+    uint64_t timeMs;
+
+    gettimeofday(&tv, NULL);
+    timeMs = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+    for (unsigned int i = 0; i < mSources.size(); i++)
+    {
+        Source &source = mSources[i];
+        iSCSIMetricsSnapshot now;
+        double secs;
+
+        source.metrics->Snapshot(now);
+        secs = (now.usecs - source.last.usecs) / 1000000.0;
+        if (secs <= 0)
+            continue;
+
+        if (mFormat == CSV)
+        {
+            writeCSV(timeMs, secs, source.name, "session", 0,
+                     now.session, &source.last.session);
+            for (unsigned int j = 0; j < now.luns.size(); j++)
+                writeCSV(timeMs, secs, source.name, "lun", now.luns[j].first,
+                         now.luns[j].second,
+                         findLast(source.last.luns, now.luns[j].first));
+            for (unsigned int j = 0; j < now.opcodes.size(); j++)
+                writeCSV(timeMs, secs, source.name, "opcode",
+                         now.opcodes[j].first, now.opcodes[j].second,
+                         findLast(source.last.opcodes, now.opcodes[j].first));
+        }
+        else
+        {
+            std::string line;
+            EString head;
+
+            head.Format("{\"time_ms\":%llu,\"session\":%s,\"secs\":%.3f,"
+                        "\"total\":",
+                        (unsigned long long)timeMs,
+                        jsonString(source.name).c_str(),
+                        secs);
+            line = head;
+            line += jsonCounters(secs, now.session, &source.last.session);
+
+            line += ",\"luns\":{";
+            for (unsigned int j = 0; j < now.luns.size(); j++)
+            {
+                EString key;
+
+                key.Format("%s\"%u\":", j ? "," : "", now.luns[j].first);
+                line += key;
+                line += jsonCounters(secs, now.luns[j].second,
+                                     findLast(source.last.luns,
+                                              now.luns[j].first));
+            }
+
+            line += "},\"opcodes\":{";
+            for (unsigned int j = 0; j < now.opcodes.size(); j++)
+            {
+                EString key;
+
+                key.Format("%s\"0x%02x\":", j ? "," : "",
+                           now.opcodes[j].first);
+                line += key;
+                line += jsonCounters(secs, now.opcodes[j].second,
+                                     findLast(source.last.opcodes,
+                                              now.opcodes[j].first));
+            }
+
+            fprintf(mFile, "%s}}\n", line.c_str());
+        }
+
+        source.last = now;
+    }
+
+    fflush(mFile);
+    mIntervals++;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __iSCSIMetrics_h__
+#define __iSCSIMetrics_h__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+class SCSIRequest;
+class iSCSILibWrapper;
+
+/**
+ * \struct iSCSIMetricsCounters
+ *
+ * What is counted for a session, a LUN or an opcode. All but outstanding
+ * only ever go up; the exporter works out the rates from the differences.
+ */
+struct iSCSIMetricsCounters {
+    enum { SENSE_KEYS = 16 };
+
+    uint64_t submitted;
+    uint64_t commands;          // Completed
+    uint64_t bytes;
+    uint64_t errors;            // Anything but GOOD, including cancelled
+    uint64_t retries;
+    uint64_t latencyUsecs;      // Summed over completed commands
+    uint64_t senseKeys[SENSE_KEYS];
+
+    uint64_t GetOutstanding(void) const { return submitted - commands; }
+};
+
+/**
+ * \struct iSCSIMetricsSnapshot
+ *
+ * A copy of one session's counters at one time. Only the LUNs and opcodes
+ * that have been used are included.
+ */
+struct iSCSIMetricsSnapshot {
+    uint64_t usecs;             // CLOCK_MONOTONIC, see iSCSIMetrics::Now
+    iSCSIMetricsCounters session;
+    std::vector<std::pair<unsigned int, iSCSIMetricsCounters> > luns;
+    std::vector<std::pair<unsigned int, iSCSIMetricsCounters> > opcodes;
+};
+
+/**
+ * \class iSCSIMetrics
+ *
+ * Counters for one session, kept by iSCSILibWrapper once EnableMetrics is
+ * called. There is no locking on the I/O path: only the thread driving the
+ * session writes them, and a Snapshot from another thread just reads them.
+ * Counters are 64 bit aligned so the reads are not torn, but a snapshot may
+ * see one counter updated and its neighbour not yet. That evens out in the
+ * next interval.
+ *
+ * The first MAX_LUNS LUNs seen get their own counters, later ones are only
+ * in the session totals.
+ */
+class iSCSIMetrics
+{
+public:
+    enum { MAX_LUNS = 64, OPCODES = 256 };
+
+    iSCSIMetrics();
+
+    // The I/O path. Only the thread driving the session calls these.
+    void Submitted(unsigned int lun, uint8_t opcode);
+    void Completed(unsigned int lun, SCSIRequest &request, uint64_t started);
+    void Retried(unsigned int lun, uint8_t opcode);
+
+    // Any thread
+    void Snapshot(iSCSIMetricsSnapshot &snapshot) const;
+
+    // Microseconds, CLOCK_MONOTONIC
+    static uint64_t Now(void);
+
+private:
+    iSCSIMetricsCounters *lunCounters(unsigned int lun);
+
+    iSCSIMetricsCounters mSession;
+    iSCSIMetricsCounters mOpcodes[OPCODES];
+    iSCSIMetricsCounters mLuns[MAX_LUNS];
+    unsigned int mLunIds[MAX_LUNS];
+    volatile unsigned int mLunCount;
+};
+
+/**
+ * \class iSCSIMetricsExporter
+ *
+ * Snapshots the metrics of a set of sessions every interval on a thread of
+ * its own and appends what changed to a file, for plotting soak tests.
+ *
+ * CSV has one row per session, LUN and opcode per interval:
+ *   time_ms,session,scope,id,commands,iops,mbps,errors,retries,
+ *   outstanding,lat_usec,sense
+ * where time_ms is wall clock, scope is session, lun or opcode, lat_usec is
+ * the mean over the interval and sense lists key:count pairs. Rows with no
+ * activity are left out. JSON lines has one object per session per
+ * interval with the same fields, and the LUNs and opcodes nested.
+ *
+ * The sessions must have metrics enabled, and must outlive the exporter or
+ * at least Stop.
+ */
+class iSCSIMetricsExporter
+{
+public:
+    enum Format {
+        CSV,
+        JSON_LINES,
+    };
+
+    iSCSIMetricsExporter(unsigned int intervalMs = 1000, Format format = CSV);
+    ~iSCSIMetricsExporter();
+
+    void AddSession(const std::string &name, iSCSILibWrapper &session);
+    void AddSession(const std::string &name, const iSCSIMetrics &metrics);
+
+    // Appends to the file
+    void Start(const std::string &path);
+    void Stop(void);
+
+    unsigned int GetIntervals(void) const { return mIntervals; }
+
+private:
+    struct Source {
+        std::string name;
+        const iSCSIMetrics *metrics;
+        iSCSIMetricsSnapshot last;
+    };
+
+    void exportThread(void);
+    void exportInterval(void);
+    void writeCSV(uint64_t timeMs, double secs, const std::string &name,
+                  const char *scope, unsigned int id,
+                  const iSCSIMetricsCounters &now,
+                  const iSCSIMetricsCounters *last);
+    std::string jsonCounters(double secs,
+                             const iSCSIMetricsCounters &now,
+                             const iSCSIMetricsCounters *last);
+
+    unsigned int mIntervalMs;
+    Format mFormat;
+    std::vector<Source> mSources;
+    FILE *mFile;
+    unsigned int mIntervals;
+
+    boost::mutex mMutex;
+    boost::condition mCond;
+    boost::thread mThread;
+    bool mStop;
+};
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * Striping commands for one target across several sessions.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <stdio.h>
+
+#include "iSCSIMultiSession.h"
+#include "SCSIRequest.h"
+#include "EString.h"
+#include "CException.h"
+
+iSCSIMultiSession::iSCSIMultiSession(unsigned int sessions,
+                                     Policy policy,
+                                     int timeout) :
+    mPolicy(policy),
+    mTimeout(timeout),
+    mCount(sessions),
+    mNext(0)
+{
+    if (sessions == 0)
+        throw CException("iSCSIMultiSession: Need at least one session");
+
+    ResetStats();
+}
+
+iSCSIMultiSession::~iSCSIMultiSession()
+{
+    // The wrappers shut their sessions down ungracefully if still connected
+    for (unsigned int i = 0; i < mSessions.size(); i++)
+        delete mSessions[i];
+}
+
+void iSCSIMultiSession::SetInitiator(const std::string &initiator)
+{
+    mInitiator = initiator;
+}
+
+void iSCSIMultiSession::SetTarget(const std::string &target)
+{
+    mTarget = target;
+}
+
+void iSCSIMultiSession::AddAddress(const std::string &address)
+{
+    mAddresses.push_back(address);
+}
+
+/*
+ * Subclasses can hand out their own wrappers, eg, to override the login
+ * tests.
+ */
+iSCSILibWrapper *iSCSIMultiSession::createSession(void)
+{
+    return new iSCSILibWrapper(mTimeout);
+}
+
+/*
+ * Log in all the sessions. Each gets its own ISID qualifier so the target
+ * sees separate sessions rather than a reinstatement of the previous one.
+ */
+void iSCSIMultiSession::Connect(void)
+{
+    if (mSessions.size())
+        throw CException("iSCSIMultiSession::Connect: Already connected");
+
+    if (!mAddresses.size())
+        throw CException("iSCSIMultiSession::Connect: No target address");
+
+    for (unsigned int i = 0; i < mCount; i++)
+    {
+        iSCSILibWrapper *session = createSession();
+
+        mSessions.push_back(session);
+
+        if (mInitiator.size())
+            session->SetInitiator(mInitiator);
+        session->SetTarget(mTarget);
+        session->SetAddress(mAddresses[i % mAddresses.size()]);
+        session->SetSessionQualifier(i + 1);
+        if (mNodes.size())
+            session->SetNUMANode(mNodes[i % mNodes.size()]);
+
+        session->iSCSIConnect();
+        session->iSCSINormalLoginWithRedirect();
+    }
+
+    mStats.resize(mSessions.size());
+    ResetStats();
+}
+
+void iSCSIMultiSession::Disconnect(void)
+{
+    for (unsigned int i = 0; i < mSessions.size(); i++)
+    {
+        mSessions[i]->iSCSINormalLogout();
+        mSessions[i]->iSCSIDisconnect();
+        delete mSessions[i];
+    }
+
+    mSessions.clear();
+}
+
+unsigned int iSCSIMultiSession::pickSession(void)
+{
+    unsigned int best = mNext;
+
+    if (mPolicy == LEAST_OUTSTANDING)
+    {
+        // Start the search where round robin would, so ties get spread out
+        for (unsigned int i = 1; i < mSessions.size(); i++)
+        {
+            unsigned int candidate = (mNext + i) % mSessions.size();
+
+            if (mSessions[candidate]->GetOutstanding() <
+                mSessions[best]->GetOutstanding())
+                best = candidate;
+        }
+    }
+
+    mNext = (mNext + 1) % mSessions.size();
+    return best;
+}
+
+void iSCSIMultiSession::ExecAsync(SCSIRequest &request, unsigned int lun)
+{
+    unsigned int session;
+
+    if (!mSessions.size())
+        throw CException("iSCSIMultiSession::ExecAsync: Not connected");
+
+    session = pickSession();
+
+    mSessions[session]->iSCSIExecSCSIAsync(request, lun);
+
+    if (mSessions[session]->GetOutstanding() > mStats[session].maxOutstanding)
+        mStats[session].maxOutstanding = mSessions[session]->GetOutstanding();
+}
+
+/*
+ * Pick up whatever a session has completed and account for it
+ */
+unsigned int iSCSIMultiSession::collect(unsigned int session,
+                                        std::vector<SCSIRequest *> &completed)
+{
+    unsigned int first = completed.size();
+
+    mSessions[session]->iSCSIWaitSCSIAsync(completed, 0);
+
+    for (unsigned int i = first; i < completed.size(); i++)
+    {
+        SCSIRequest *request = completed[i];
+
+        mStats[session].commands++;
+        if (request->GetTask()->xfer_dir == SCSI_XFER_READ)
+            mStats[session].bytes += request->GetInBufferTransferSize();
+        else if (request->GetTask()->xfer_dir == SCSI_XFER_WRITE)
+            mStats[session].bytes += request->GetOutBufferSize();
+    }
+
+    return completed.size() - first;
+}
+
+/*
+ * Wait for at least minCompletions requests, from any session, polling
+ * the busy ones together.
+ */
+void iSCSIMultiSession::Wait(std::vector<SCSIRequest *> &completed,
+                             unsigned int minCompletions)
+{
+    unsigned int got = 0;
+
+    for (unsigned int i = 0; i < mSessions.size(); i++)
+        got += collect(i, completed);
+
+    while (got < minCompletions && GetOutstanding())
+    {
+        mPoller.Clear();
+        for (unsigned int i = 0; i < mSessions.size(); i++)
+            if (mSessions[i]->GetOutstanding())
+                mPoller.Add(*mSessions[i], i);
+
+        if (!mPoller.Poll(mTimeout))
+        {
+            EString estr;
+
+            estr.Format("%s: poll timed out: %d mSec", __func__, mTimeout);
+            throw CException(estr);
+        }
+
+        mReady.clear();
+        mPoller.Service(mReady);
+        for (unsigned int i = 0; i < mReady.size(); i++)
+            got += collect(mReady[i], completed);
+    }
+}
+
+unsigned int iSCSIMultiSession::GetOutstanding(void) const
+{
+    unsigned int outstanding = 0;
+
+    for (unsigned int i = 0; i < mSessions.size(); i++)
+        outstanding += mSessions[i]->GetOutstanding();
+
+    return outstanding;
+}
+
+void iSCSIMultiSession::ResetStats(void)
+{
+    for (unsigned int i = 0; i < mStats.size(); i++)
+        memset(&mStats[i], 0, sizeof(mStats[i]));
+
+    mStatsStart = boost::get_system_time();
+}
+
+double iSCSIMultiSession::GetBandwidth(unsigned int session) const
+{
+    double secs = (boost::get_system_time() - mStatsStart).total_microseconds()
+                      / 1000000.0;
+
+    if (secs <= 0)
+        return 0;
+
+    return mStats.at(session).bytes / secs;
+}
+
+double iSCSIMultiSession::GetNodeBandwidth(int node) const
+{
+    double bandwidth = 0;
+
+    if (!mNodes.size())
+        return 0;
+
+    // Stats outlive the sessions, so go by how they were assigned
+    for (unsigned int i = 0; i < mStats.size(); i++)
+        if (mNodes[i % mNodes.size()] == node)
+            bandwidth += GetBandwidth(i);
+
+    return bandwidth;
+}
+
+double iSCSIMultiSession::GetImbalance(void) const
+{
+    uint64_t total = 0;
+    uint64_t busiest = 0;
+    double mean;
+
+    for (unsigned int i = 0; i < mStats.size(); i++)
+    {
+        total += mStats[i].bytes;
+        if (mStats[i].bytes > busiest)
+            busiest = mStats[i].bytes;
+    }
+
+    if (!total)
+        return 0;
+
+    mean = (double)total / mStats.size();
+    return (busiest - mean) * 100.0 / mean;
+}
+
+std::string iSCSIMultiSession::StatsString(void) const
+{
+    std::string str;
+
+    for (unsigned int i = 0; i < mStats.size(); i++)
+    {
+        EString line;
+
+        line.Format("session %u (%s): commands %llu, bytes %llu, "
+                    "%.1f MB/s, max outstanding %u\n",
+                    i,
+                    mAddresses[i % mAddresses.size()].c_str(),
+                    (unsigned long long)mStats[i].commands,
+                    (unsigned long long)mStats[i].bytes,
+                    GetBandwidth(i) / 1000000.0,
+                    mStats[i].maxOutstanding);
+        str.append(line);
+    }
+
+    // Sessions are only on nodes if they were told to be
+    for (unsigned int i = 0; i < mNodes.size(); i++)
+    {
+        bool seen = false;
+        EString line;
+
+        for (unsigned int j = 0; j < i; j++)
+            if (mNodes[j] == mNodes[i])
+                seen = true;
+        if (seen)
+            continue;
+
+        line.Format("node %d: %.1f MB/s\n",
+                    mNodes[i], GetNodeBandwidth(mNodes[i]) / 1000000.0);
+        str.append(line);
+    }
+
+    EString total;
+    total.Format("imbalance %.1f%%\n", GetImbalance());
+    str.append(total);
+
+    return str;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __iSCSIMultiSession_h__
+#define __iSCSIMultiSession_h__
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+#include "iSCSILibWrapper.h"
+#include "iSCSISessionPoller.h"
+
+/**
+ * \struct iSCSISessionStats
+ *
+ * Per-session counters kept by iSCSIMultiSession
+ */
+struct iSCSISessionStats {
+    uint64_t commands;
+    uint64_t bytes;
+    unsigned int maxOutstanding;
+};
+
+/**
+ * \class iSCSIMultiSession
+ *
+ * Stripes the commands for a target across several sessions, so one LUN is
+ * not limited to what a single TCP connection can carry. libiscsi does not
+ * do multiple connections per session, so these are separate sessions from
+ * the same initiator, told apart by the ISID qualifier. Give it several
+ * portals and the sessions are spread across them.
+ *
+ * Sessions can also be spread across NUMA nodes. Each session only records
+ * its node; the threads that drive them should call BindCurrentThread on
+ * their session so the thread and its buffers are on that node.
+ *
+ * Commands go to the session with the fewest outstanding, or round robin.
+ * Note that commands on different sessions are not ordered with respect to
+ * each other.
+ */
+class iSCSIMultiSession
+{
+public:
+    enum Policy {
+        ROUND_ROBIN,
+        LEAST_OUTSTANDING,
+    };
+
+    iSCSIMultiSession(unsigned int sessions,
+                      Policy policy = LEAST_OUTSTANDING,
+                      int timeout = -1);
+    virtual ~iSCSIMultiSession();
+
+    void SetInitiator(const std::string &initiator);
+    void SetTarget(const std::string &target);
+    // Sessions are assigned to portals in turn
+    void AddAddress(const std::string &address);
+    void SetPolicy(Policy policy) { mPolicy = policy; }
+    // Sessions are assigned to nodes in turn
+    void SetNUMANodes(const std::vector<int> &nodes) { mNodes = nodes; }
+
+    void Connect(void);
+    void Disconnect(void);
+
+    void ExecAsync(SCSIRequest &request, unsigned int lun);
+    void Wait(std::vector<SCSIRequest *> &completed,
+              unsigned int minCompletions = 1);
+    unsigned int GetOutstanding(void) const;
+
+    unsigned int GetSessionCount(void) const { return mSessions.size(); }
+    iSCSILibWrapper &GetSession(unsigned int session)
+        { return *mSessions.at(session); }
+
+    const iSCSISessionStats &GetStats(unsigned int session) const
+        { return mStats.at(session); }
+    void ResetStats(void);
+    // Bytes per second for one session since the last ResetStats
+    double GetBandwidth(unsigned int session) const;
+    // The same, summed over the sessions on a node
+    double GetNodeBandwidth(int node) const;
+    // How far the busiest session is above the mean, in percent
+    double GetImbalance(void) const;
+    std::string StatsString(void) const;
+
+protected:
+    virtual iSCSILibWrapper *createSession(void);
+    unsigned int pickSession(void);
+    unsigned int collect(unsigned int session,
+                         std::vector<SCSIRequest *> &completed);
+
+    Policy mPolicy;
+    int mTimeout;
+    unsigned int mCount;
+    unsigned int mNext;
+    std::string mInitiator;
+    std::string mTarget;
+    std::vector<std::string> mAddresses;
+    std::vector<int> mNodes;
+    std::vector<iSCSILibWrapper *> mSessions;
+    std::vector<iSCSISessionStats> mStats;
+    iSCSISessionPoller mPoller;
+    std::vector<unsigned int> mReady;   // Sessions the poller serviced
+    boost::system_time mStatsStart;
+};
+
+#endif
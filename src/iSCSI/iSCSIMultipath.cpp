@@ -0,0 +1,703 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * ALUA aware multipathing for one LUN.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "iSCSIMultipath.h"
+#include "SCSIRequest.h"
+#include "SCSIInquiry.h"
+#include "SCSITestUnitReady.h"
+#include "EString.h"
+#include "CException.h"
+
+// NOT READY ASC/ASCQs for a target port group that cannot take the command
+#define SCSI_SENSE_ASCQ_ALUA_TRANSITION             0x040A
+#define SCSI_SENSE_ASCQ_ALUA_STANDBY                0x040B
+#define SCSI_SENSE_ASCQ_ALUA_UNAVAILABLE            0x040C
+// Unit Attentions that say the states have changed
+#define SCSI_SENSE_ASCQ_ASYMMETRIC_STATE_CHANGED    0x2A06
+#define SCSI_SENSE_ASCQ_IMPLICIT_TRANSITION_FAILED  0x2A07
+
+static uint64_t nowUsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Lower is better, and only the usable states have one
+static int stateRank(SCSIReportTargetPortGroups::AccessState state)
+{
+    switch (state)
+    {
+    case SCSIReportTargetPortGroups::ACTIVE_OPTIMIZED:
+        return 0;
+    case SCSIReportTargetPortGroups::ACTIVE_NON_OPTIMIZED:
+    case SCSIReportTargetPortGroups::LBA_DEPENDENT:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+iSCSIMultipath::iSCSIMultipath(unsigned int lun,
+                               Selector selector,
+                               int timeout) :
+    mLun(lun),
+    mSelector(selector),
+    mTimeout(timeout),
+    mMaxRedrives(10),
+    mRetryDelay(100),
+    mNext(0),
+    mRefresh(false),
+    mNextRetry(0),
+    mALUA(true),
+    mSwitching(false),
+    mSwitchStart(0)
+{
+    memset(&mFailover, 0, sizeof(mFailover));
+}
+
+iSCSIMultipath::~iSCSIMultipath()
+{
+    // Without Disconnect the paths are dropped without logging out
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+        delete mPaths[i].session;
+}
+
+void iSCSIMultipath::SetInitiator(const std::string &initiator)
+{
+    mInitiator = initiator;
+}
+
+void iSCSIMultipath::AddPath(const std::string &target,
+                             const std::string &address)
+{
+    Path path;
+
+    if (mPaths.size() && mPaths[0].session)
+        throw CException("iSCSIMultipath::AddPath: Already connected");
+
+    path.session = NULL;
+    path.target = target;
+    path.address = address;
+    path.hasGroup = false;
+    path.group = 0;
+    path.state = SCSIReportTargetPortGroups::ACTIVE_OPTIMIZED;
+    path.serviceUsecs = 0;
+    memset(&path.stats, 0, sizeof(path.stats));
+
+    mPaths.push_back(path);
+}
+
+void iSCSIMultipath::SetRedrive(unsigned int maxRedrives,
+                                unsigned int retryDelay)
+{
+    mMaxRedrives = maxRedrives;
+    mRetryDelay = retryDelay;
+}
+
+/*
+ * Subclasses can hand out their own wrappers, eg, to override the login
+ * tests.
+ */
+iSCSILibWrapper *iSCSIMultipath::createSession(void)
+{
+    return new iSCSILibWrapper(mTimeout);
+}
+
+/*
+ * Log in every path, clear the Unit Attentions from the login, and find
+ * which group each is in. INQUIRY works whatever state the path is in.
+ */
+void iSCSIMultipath::Connect(void)
+{
+    if (!mPaths.size())
+        throw CException("iSCSIMultipath::Connect: No paths");
+
+    if (mPaths[0].session)
+        throw CException("iSCSIMultipath::Connect: Already connected");
+
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+    {
+        Path &path = mPaths[i];
+        SCSITestUnitReady tur;
+        SCSIInquiryDeviceIdVPDPage deviceId;
+
+        path.session = createSession();
+        if (mInitiator.size())
+            path.session->SetInitiator(mInitiator);
+        path.session->SetTarget(path.target);
+        path.session->SetAddress(path.address);
+        path.session->SetSessionQualifier(i + 1);
+
+        path.session->iSCSIConnect();
+        path.session->iSCSINormalLoginWithRedirect();
+
+        // Standby paths may fail this, we only want the Unit Attention gone
+        path.session->iSCSIExecSCSISyncRetry(tur, mLun, mRetryPolicy);
+
+        path.session->iSCSIExecSCSISyncRetry(deviceId, mLun, mRetryPolicy);
+        if (deviceId.GetStatus() == SCSI_STATUS_GOOD)
+            path.hasGroup = deviceId.GetTargetPortGroup(path.group);
+    }
+
+    mALUA = true;
+    RefreshStates();
+}
+
+void iSCSIMultipath::Disconnect(void)
+{
+    if (GetOutstanding())
+        throw CException("iSCSIMultipath::Disconnect: Commands outstanding");
+
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+    {
+        if (!mPaths[i].session)
+            continue;
+
+        mPaths[i].session->iSCSINormalLogout();
+        mPaths[i].session->iSCSIDisconnect();
+        delete mPaths[i].session;
+        mPaths[i].session = NULL;
+    }
+}
+
+bool iSCSIMultipath::GetPathGroup(unsigned int path, uint16_t &group) const
+{
+    if (!mPaths.at(path).hasGroup)
+        return false;
+
+    group = mPaths[path].group;
+    return true;
+}
+
+/*
+ * Ask on an idle path if there is one, so we are not waiting behind I/O.
+ * Targets without ALUA have every path active/optimized.
+ */
+void iSCSIMultipath::RefreshStates(void)
+{
+    std::vector<unsigned int> order;
+    EString error;
+
+    mRefresh = false;
+    if (!mALUA)
+        return;
+
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+        if (!mPaths[i].session->GetOutstanding())
+            order.push_back(i);
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+        if (mPaths[i].session->GetOutstanding())
+            order.push_back(i);
+
+    for (unsigned int i = 0; i < order.size(); i++)
+    {
+        SCSIReportTargetPortGroups report;
+
+        mPaths[order[i]].session->iSCSIExecSCSISyncSized(report, mLun,
+                                                         mRetryPolicy);
+        mFailover.refreshes++;
+
+        if (report.GetStatus() == SCSI_STATUS_CHECK_CONDITION &&
+            report.GetSCSISenseKey() == SCSI_SENSE_ILLEGAL_REQUEST)
+        {
+            mALUA = false;
+            for (unsigned int p = 0; p < mPaths.size(); p++)
+                mPaths[p].state = SCSIReportTargetPortGroups::ACTIVE_OPTIMIZED;
+            return;
+        }
+
+        if (report.GetStatus() != SCSI_STATUS_GOOD)
+        {
+            error.Format("%s: REPORT TARGET PORT GROUPS failed on %s: "
+                         "Status: %s, SenseKey: %s, ASCQ: %s",
+                         __func__,
+                         mPaths[order[i]].address.c_str(),
+                         report.StatusString().c_str(),
+                         report.SenseKeyString().c_str(),
+                         report.ASCQString().c_str());
+            continue;
+        }
+
+        for (unsigned int p = 0; p < mPaths.size(); p++)
+        {
+            if (!mPaths[p].hasGroup)
+                continue;
+
+            for (unsigned int g = 0; g < report.GetGroupCount(); g++)
+                if (report.GetGroupId(g) == mPaths[p].group)
+                    mPaths[p].state = report.GetAccessState(g);
+        }
+
+        return;
+    }
+
+    // Try again next time round
+    mRefresh = true;
+    throw CException(error);
+}
+
+void iSCSIMultipath::startSwitch(void)
+{
+    if (mSwitching)
+        return;
+
+    mSwitching = true;
+    mSwitchStart = nowUsecs();
+}
+
+void iSCSIMultipath::SetGroupState(uint16_t group,
+                                   SCSIReportTargetPortGroups::AccessState state)
+{
+    SCSISetTargetPortGroups set(group, state);
+    int path = pickPath();
+
+    if (path < 0)
+        path = 0;
+
+    startSwitch();
+    mPaths[path].session->iSCSIExecSCSISyncRetry(set, mLun, mRetryPolicy);
+    if (set.GetStatus() != SCSI_STATUS_GOOD)
+    {
+        EString estr;
+        estr.Format("%s: SET TARGET PORT GROUPS %u to %s failed: "
+                    "Status: %s, SenseKey: %s, ASCQ: %s",
+                    __func__, group,
+                    SCSIReportTargetPortGroups::AccessStateString(state).c_str(),
+                    set.StatusString().c_str(),
+                    set.SenseKeyString().c_str(),
+                    set.ASCQString().c_str());
+        mSwitching = false;
+        throw CException(estr);
+    }
+
+    RefreshStates();
+}
+
+/*
+ * Only the paths in the best state count. -1 if none are usable.
+ */
+int iSCSIMultipath::pickPath(void)
+{
+    int bestRank = -1;
+    int best = -1;
+    double bestCost = 0;
+
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+    {
+        int rank = stateRank(mPaths[i].state);
+
+        if (rank >= 0 && (bestRank < 0 || rank < bestRank))
+            bestRank = rank;
+    }
+
+    if (bestRank < 0)
+        return -1;
+
+    // Start where round robin would, so ties get spread out
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+    {
+        unsigned int candidate = (mNext + i) % mPaths.size();
+        Path &path = mPaths[candidate];
+        double cost;
+
+        if (stateRank(path.state) != bestRank)
+            continue;
+
+        if (mSelector == ROUND_ROBIN)
+        {
+            best = candidate;
+            break;
+        }
+
+        cost = path.session->GetOutstanding();
+        if (mSelector == SERVICE_TIME)
+            cost = (cost + 1) * path.serviceUsecs;
+
+        if (best < 0 || cost < bestCost)
+        {
+            best = candidate;
+            bestCost = cost;
+        }
+    }
+
+    mNext = (best + 1) % mPaths.size();
+    return best;
+}
+
+void iSCSIMultipath::submit(unsigned int path,
+                            SCSIRequest &request,
+                            unsigned int redrives)
+{
+    Command command;
+    iSCSILibWrapper &session = *mPaths[path].session;
+
+    command.path = path;
+    command.submitted = nowUsecs();
+    command.redrives = redrives;
+
+    session.iSCSIExecSCSIAsync(request, mLun);
+    mInFlight[&request] = command;
+
+    if (session.GetOutstanding() > mPaths[path].stats.maxOutstanding)
+        mPaths[path].stats.maxOutstanding = session.GetOutstanding();
+}
+
+void iSCSIMultipath::ExecAsync(SCSIRequest &request)
+{
+    int path;
+
+    if (!mPaths.size() || !mPaths[0].session)
+        throw CException("iSCSIMultipath::ExecAsync: Not connected");
+
+    if (mRefresh)
+        RefreshStates();
+
+    if ((path = pickPath()) < 0)
+    {
+        // Wait in line with any others for a path to become usable
+        mParked.push_back(std::make_pair(&request, 0U));
+        mRefresh = true;
+        return;
+    }
+
+    submit(path, request, 0);
+}
+
+/*
+ * The target did not execute these, so they are safe to send again
+ */
+bool iSCSIMultipath::needsRedrive(SCSIRequest &request, bool &stateChange)
+{
+    unsigned int ascq = request.GetSCSIASCQ();
+
+    stateChange = false;
+
+    if (request.GetStatus() != SCSI_STATUS_CHECK_CONDITION)
+        return false;
+
+    switch (request.GetSCSISenseKey())
+    {
+    case SCSI_SENSE_NOT_READY:
+        stateChange = ascq == SCSI_SENSE_ASCQ_ALUA_TRANSITION ||
+                      ascq == SCSI_SENSE_ASCQ_ALUA_STANDBY ||
+                      ascq == SCSI_SENSE_ASCQ_ALUA_UNAVAILABLE;
+        return stateChange;
+    case SCSI_SENSE_UNIT_ATTENTION:
+        stateChange = ascq == SCSI_SENSE_ASCQ_ASYMMETRIC_STATE_CHANGED ||
+                      ascq == SCSI_SENSE_ASCQ_IMPLICIT_TRANSITION_FAILED;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Pick up whatever a path has completed. Those that need sending again
+ * are parked rather than handed back.
+ */
+unsigned int iSCSIMultipath::collect(unsigned int path,
+                                     std::vector<SCSIRequest *> &completed)
+{
+    std::vector<SCSIRequest *> done;
+    unsigned int got = 0;
+    uint64_t now;
+
+    mPaths[path].session->iSCSIWaitSCSIAsync(done, 0);
+    if (!done.size())
+        return 0;
+
+    now = nowUsecs();
+
+    for (unsigned int i = 0; i < done.size(); i++)
+    {
+        SCSIRequest *request = done[i];
+        std::map<SCSIRequest *, Command>::iterator it = mInFlight.find(request);
+        Command command = it->second;
+        Path &p = mPaths[path];
+        bool stateChange;
+
+        mInFlight.erase(it);
+
+        if (needsRedrive(*request, stateChange))
+        {
+            mFailover.stateChanges++;
+            if (stateChange)
+            {
+                p.stats.aluaErrors++;
+                // Keep away from it until we know better, if RefreshStates
+                // can tell us
+                if (mALUA && p.hasGroup)
+                    p.state = SCSIReportTargetPortGroups::TRANSITIONING;
+                mRefresh = true;
+                startSwitch();
+            }
+
+            mParked.push_back(std::make_pair(request, command.redrives));
+            continue;
+        }
+
+        p.stats.commands++;
+        if (request->GetTask()->xfer_dir == SCSI_XFER_READ)
+            p.stats.bytes += request->GetInBufferTransferSize();
+        else if (request->GetTask()->xfer_dir == SCSI_XFER_WRITE)
+            p.stats.bytes += request->GetOutBufferSize();
+
+        if (request->GetStatus() == SCSI_STATUS_GOOD)
+        {
+            double sample = now - command.submitted;
+
+            p.serviceUsecs = p.serviceUsecs ?
+                                 (p.serviceUsecs * 7 + sample) / 8 : sample;
+
+            // I/O is flowing again
+            if (mSwitching && command.submitted >= mSwitchStart)
+            {
+                uint64_t pause = now - mSwitchStart;
+
+                mFailover.switches++;
+                mFailover.lastSwitchUsecs = pause;
+                mFailover.totalSwitchUsecs += pause;
+                if (pause > mFailover.maxSwitchUsecs)
+                    mFailover.maxSwitchUsecs = pause;
+                mSwitching = false;
+            }
+        }
+
+        completed.push_back(request);
+        got++;
+    }
+
+    return got;
+}
+
+/*
+ * Send the parked commands on again, or give them back once they have
+ * been tried too often. Returns how many were given back.
+ */
+unsigned int iSCSIMultipath::redrive(std::vector<SCSIRequest *> &completed)
+{
+    unsigned int got = 0;
+    bool refreshed = false;
+    uint64_t now = nowUsecs();
+
+    // Straight away after a change, then no more than every retryDelay
+    if (mRefresh && now >= mNextRetry)
+    {
+        refreshed = true;
+        try
+        {
+            RefreshStates();
+        }
+        catch (CException &)
+        {
+            // Every path failed it, the redrive count limits how long for
+        }
+    }
+
+    while (mParked.size())
+    {
+        SCSIRequest *request = mParked.front().first;
+        unsigned int redrives = mParked.front().second;
+        int path;
+
+        if (redrives >= mMaxRedrives)
+        {
+            // Never sent at all, so there is no status to go by
+            if (!request->IsExecuted())
+            {
+                request->GetTask()->status = SCSI_STATUS_CANCELLED;
+                request->SetExecuted();
+            }
+
+            mParked.pop_front();
+            mFailover.failedBack++;
+            completed.push_back(request);
+            got++;
+            continue;
+        }
+
+        if ((path = pickPath()) < 0)
+        {
+            // Wait for a transition to finish, counting each try
+            if (refreshed)
+            {
+                for (unsigned int i = 0; i < mParked.size(); i++)
+                    mParked[i].second++;
+                mNextRetry = now + mRetryDelay * 1000ULL;
+            }
+            mRefresh = true;
+            break;
+        }
+
+        mParked.pop_front();
+        request->Reset();
+        submit(path, *request, redrives + 1);
+        mFailover.redriven++;
+    }
+
+    return got;
+}
+
+/*
+ * Wait for at least minCompletions requests, from any path. Parked
+ * commands are sent on again as paths become usable.
+ */
+void iSCSIMultipath::Wait(std::vector<SCSIRequest *> &completed,
+                          unsigned int minCompletions)
+{
+    unsigned int got = 0;
+
+    for (;;)
+    {
+        for (unsigned int i = 0; i < mPaths.size(); i++)
+            got += collect(i, completed);
+
+        if (mParked.size())
+            got += redrive(completed);
+
+        if (got >= minCompletions || !GetOutstanding())
+            break;
+
+        // Only parked commands, waiting for a path to become usable
+        if (!sessionsOutstanding())
+        {
+            boost::this_thread::sleep(
+                boost::posix_time::milliseconds(mRetryDelay));
+            continue;
+        }
+
+        mPoller.Clear();
+        for (unsigned int i = 0; i < mPaths.size(); i++)
+            if (mPaths[i].session->GetOutstanding())
+                mPoller.Add(*mPaths[i].session, i);
+
+        // Come back for the parked ones even if nothing else happens
+        if (!mPoller.Poll(mParked.size() ? (int)mRetryDelay : mTimeout) &&
+            !mParked.size())
+        {
+            EString estr;
+
+            estr.Format("%s: poll timed out: %d mSec", __func__, mTimeout);
+            throw CException(estr);
+        }
+
+        // Picked up by collect next time round
+        mReady.clear();
+        mPoller.Service(mReady);
+    }
+}
+
+unsigned int iSCSIMultipath::sessionsOutstanding(void) const
+{
+    unsigned int outstanding = 0;
+
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+        if (mPaths[i].session)
+            outstanding += mPaths[i].session->GetOutstanding();
+
+    return outstanding;
+}
+
+unsigned int iSCSIMultipath::GetOutstanding(void) const
+{
+    return sessionsOutstanding() + mParked.size();
+}
+
+void iSCSIMultipath::ResetStats(void)
+{
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+        memset(&mPaths[i].stats, 0, sizeof(mPaths[i].stats));
+
+    memset(&mFailover, 0, sizeof(mFailover));
+}
+
+std::string iSCSIMultipath::SelectorString(Selector selector)
+{
+    switch (selector)
+    {
+    case ROUND_ROBIN:
+        return "round-robin";
+    case QUEUE_LENGTH:
+        return "queue-length";
+    case SERVICE_TIME:
+        return "service-time";
+    default:
+        return "unknown";
+    }
+}
+
+std::string iSCSIMultipath::StatsString(void) const
+{
+    std::string str;
+    EString total;
+
+    for (unsigned int i = 0; i < mPaths.size(); i++)
+    {
+        const Path &path = mPaths[i];
+        EString line;
+        EString group;
+
+        if (path.hasGroup)
+            group.Format("%u", path.group);
+        else
+            group.append("none");
+
+        line.Format("path %u (%s, group %s, %s): commands %llu, bytes %llu, "
+                    "ALUA errors %llu, max outstanding %u, "
+                    "service time %.0f uS\n",
+                    i,
+                    path.address.c_str(),
+                    group.c_str(),
+                    SCSIReportTargetPortGroups::AccessStateString(
+                        path.state).c_str(),
+                    (unsigned long long)path.stats.commands,
+                    (unsigned long long)path.stats.bytes,
+                    (unsigned long long)path.stats.aluaErrors,
+                    path.stats.maxOutstanding,
+                    path.serviceUsecs);
+        str.append(line);
+    }
+
+    total.Format("%s: switches %u (last %llu uS, max %llu uS, total %llu uS), "
+                 "state changes %llu, refreshes %u, redriven %llu, "
+                 "failed back %llu\n",
+                 SelectorString(mSelector).c_str(),
+                 mFailover.switches,
+                 (unsigned long long)mFailover.lastSwitchUsecs,
+                 (unsigned long long)mFailover.maxSwitchUsecs,
+                 (unsigned long long)mFailover.totalSwitchUsecs,
+                 (unsigned long long)mFailover.stateChanges,
+                 mFailover.refreshes,
+                 (unsigned long long)mFailover.redriven,
+                 (unsigned long long)mFailover.failedBack);
+    str.append(total);
+
+    return str;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __iSCSIMultipath_h__
+#define __iSCSIMultipath_h__
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+
+#include "iSCSILibWrapper.h"
+#include "iSCSISessionPoller.h"
+#include "SCSIRetryPolicy.h"
+#include "SCSITargetPortGroups.h"
+
+/**
+ * \struct iSCSIPathStats
+ *
+ * Per-path counters kept by iSCSIMultipath
+ */
+struct iSCSIPathStats {
+    uint64_t commands;
+    uint64_t bytes;
+    uint64_t aluaErrors;        // Sent elsewhere because of the path's state
+    unsigned int maxOutstanding;
+};
+
+/**
+ * \struct iSCSIFailoverStats
+ *
+ * What iSCSIMultipath has done about ALUA state changes. A switch runs from
+ * the first sign of a change, or from asking for one with SetGroupState,
+ * to the first command sent after that completing, ie, how long I/O
+ * stalled from the application's view.
+ */
+struct iSCSIFailoverStats {
+    unsigned int switches;
+    unsigned int refreshes;         // REPORT TARGET PORT GROUPS sent
+    uint64_t stateChanges;          // ALUA sense and Unit Attentions seen
+    uint64_t redriven;              // Commands sent again on another path
+    uint64_t failedBack;            // Out of redrives, returned as they were
+    uint64_t lastSwitchUsecs;
+    uint64_t maxSwitchUsecs;
+    uint64_t totalSwitchUsecs;
+};
+
+/**
+ * \class iSCSIMultipath
+ *
+ * One LUN over several paths, each its own session, for targets that use
+ * ALUA. Each path's target port group comes from its Device ID VPD page,
+ * and the groups' states from REPORT TARGET PORT GROUPS.
+ *
+ * Commands only go to paths in the best state there is: active/optimized
+ * if any are, otherwise active/non-optimized. Among those the selector
+ * picks by turn, by fewest outstanding, or by the shortest expected
+ * service time (outstanding plus one, times the path's average latency).
+ *
+ * A command that comes back with an ALUA NOT READY (standby, unavailable,
+ * in transition) or a Unit Attention was not executed. It is held while
+ * the states are read again and sent on a usable path, up to maxRedrives
+ * times, retryDelay mSec apart if no path is usable. After that it is
+ * returned with its status for the application to deal with, or with
+ * SCSI_STATUS_CANCELLED if it never got sent.
+ *
+ * Like iSCSIMultiSession, commands on different paths are not ordered with
+ * respect to each other.
+ */
+class iSCSIMultipath
+{
+public:
+    enum Selector {
+        ROUND_ROBIN,
+        QUEUE_LENGTH,
+        SERVICE_TIME,
+    };
+
+    iSCSIMultipath(unsigned int lun,
+                   Selector selector = SERVICE_TIME,
+                   int timeout = -1);
+    virtual ~iSCSIMultipath();
+
+    void SetInitiator(const std::string &initiator);
+    // Each path gets its own session. The portals may be on one target or
+    // on several that front the same LU.
+    void AddPath(const std::string &target, const std::string &address);
+    void SetSelector(Selector selector) { mSelector = selector; }
+    void SetRedrive(unsigned int maxRedrives, unsigned int retryDelay);
+
+    // Logs in every path and finds out where they stand
+    void Connect(void);
+    void Disconnect(void);
+
+    // Send REPORT TARGET PORT GROUPS and update every path's state
+    void RefreshStates(void);
+    // Explicit ALUA, eg, to fail over on purpose
+    void SetGroupState(uint16_t group,
+                       SCSIReportTargetPortGroups::AccessState state);
+
+    // With no usable path, the command waits for one as a redrive would
+    void ExecAsync(SCSIRequest &request);
+    void Wait(std::vector<SCSIRequest *> &completed,
+              unsigned int minCompletions = 1);
+    // Includes commands held for a redrive
+    unsigned int GetOutstanding(void) const;
+
+    unsigned int GetPathCount(void) const { return mPaths.size(); }
+    iSCSILibWrapper &GetSession(unsigned int path)
+        { return *mPaths.at(path).session; }
+    // False if the target did not give the path a group
+    bool GetPathGroup(unsigned int path, uint16_t &group) const;
+    SCSIReportTargetPortGroups::AccessState GetPathState(unsigned int path) const
+        { return mPaths.at(path).state; }
+    const iSCSIPathStats &GetStats(unsigned int path) const
+        { return mPaths.at(path).stats; }
+    const iSCSIFailoverStats &GetFailoverStats(void) const
+        { return mFailover; }
+    void ResetStats(void);
+    std::string StatsString(void) const;
+
+    static std::string SelectorString(Selector selector);
+
+protected:
+    struct Path {
+        iSCSILibWrapper *session;
+        std::string target;
+        std::string address;
+        bool hasGroup;
+        uint16_t group;
+        SCSIReportTargetPortGroups::AccessState state;
+        double serviceUsecs;        // Moving average latency
+        iSCSIPathStats stats;
+    };
+
+    struct Command {
+        unsigned int path;
+        uint64_t submitted;
+        unsigned int redrives;
+    };
+
+    virtual iSCSILibWrapper *createSession(void);
+    int pickPath(void);
+    void submit(unsigned int path, SCSIRequest &request, unsigned int redrives);
+    unsigned int collect(unsigned int path,
+                         std::vector<SCSIRequest *> &completed);
+    unsigned int redrive(std::vector<SCSIRequest *> &completed);
+    bool needsRedrive(SCSIRequest &request, bool &stateChange);
+    void startSwitch(void);
+    unsigned int sessionsOutstanding(void) const;
+
+    unsigned int mLun;
+    Selector mSelector;
+    int mTimeout;
+    unsigned int mMaxRedrives;
+    unsigned int mRetryDelay;
+    unsigned int mNext;
+    std::string mInitiator;
+    std::vector<Path> mPaths;
+    SCSIRetryPolicy mRetryPolicy;
+
+    std::map<SCSIRequest *, Command> mInFlight;
+    std::deque<std::pair<SCSIRequest *, unsigned int> > mParked;
+    bool mRefresh;              // States need reading again
+    uint64_t mNextRetry;        // No refresh before this, in uS
+    bool mALUA;                 // Does the target do REPORT TARGET PORT GROUPS
+    bool mSwitching;
+    uint64_t mSwitchStart;
+    iSCSIFailoverStats mFailover;
+
+    iSCSISessionPoller mPoller;
+    std::vector<unsigned int> mReady;   // Paths the poller serviced
+};
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+
+/**
+ * Polling several sessions at once.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "iSCSISessionPoller.h"
+#include "EString.h"
+#include "CException.h"
+
+// The vectors keep their capacity, so this does not allocate once warm
+void iSCSISessionPoller::Clear(void)
+{
+    mPfds.clear();
+    mSessions.clear();
+    mIds.clear();
+}
+
+void iSCSISessionPoller::Add(iSCSILibWrapper &session, unsigned int id)
+{
+    struct pollfd pfd;
+
+    session.iSCSIGetPollFd(pfd);
+    mPfds.push_back(pfd);
+    mSessions.push_back(&session);
+    mIds.push_back(id);
+
+    if (session.iSCSIGetTimerPollFd(pfd))
+    {
+        mPfds.push_back(pfd);
+        mSessions.push_back(&session);
+        mIds.push_back(id);
+    }
+}
+
+int iSCSISessionPoller::Poll(int timeout)
+{
+    int res;
+
+    if ((res = poll(mPfds.size() ? &mPfds[0] : NULL, mPfds.size(),
+                    timeout)) < 0)
+    {
+        EString estr;
+
+        estr.Format("%s: poll failed: %s", __func__, strerror(errno));
+        throw CException(estr);
+    }
+
+    return res;
+}
+
+void iSCSISessionPoller::Service(std::vector<unsigned int> &ready)
+{
+    for (unsigned int i = 0; i < mPfds.size(); i++)
+    {
+        iSCSILibWrapper *session = mSessions[i];
+
+        if (!mPfds[i].revents)
+            continue;
+
+        if (mPfds[i].fd == session->iSCSIGetTimerFd())
+            session->iSCSIServiceTimers();
+        else
+            session->iSCSIServiceEvents(mPfds[i].revents);
+
+        // A session's socket and timer are next to each other
+        if (!ready.size() || ready.back() != mIds[i])
+            ready.push_back(mIds[i]);
+    }
+}
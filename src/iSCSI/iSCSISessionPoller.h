@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+
+#ifndef __iSCSISessionPoller_h__
+#define __iSCSISessionPoller_h__
+
+#include <vector>
+#include <poll.h>
+
+#include "iSCSILibWrapper.h"
+
+/**
+ * \class iSCSISessionPoller
+ *
+ * The poll loop for callers driving several sessions themselves, eg,
+ * iSCSIMultiSession and iSCSIMultipath. Add the busy sessions, each with
+ * the caller's id for it, Poll, then Service, which says which sessions
+ * had anything. Idle sessions belong to the background thread, so leave
+ * them out.
+ */
+class iSCSISessionPoller
+{
+public:
+    void Clear(void);
+    // Its socket and, if it has one, its deadline timer
+    void Add(iSCSILibWrapper &session, unsigned int id);
+    unsigned int GetCount(void) const { return mPfds.size(); }
+
+    // As poll, but throws on errors. Returns 0 if it timed out.
+    int Poll(int timeout);
+    // Appends the id of each session that had events, once
+    void Service(std::vector<unsigned int> &ready);
+
+protected:
+    std::vector<struct pollfd> mPfds;
+    std::vector<iSCSILibWrapper *> mSessions;
+    std::vector<unsigned int> mIds;
+};
+
+#endif
@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+
+/**
+ * A pool of logged in sessions for tests to borrow.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "iSCSISessionPool.h"
+#include "SCSITestUnitReady.h"
+#include "EString.h"
+#include "CException.h"
+
+bool iSCSISessionKey::operator<(const iSCSISessionKey &other) const
+{
+    if (initiator != other.initiator)
+        return initiator < other.initiator;
+    if (target != other.target)
+        return target < other.target;
+    return address < other.address;
+}
+
+bool iSCSISessionKey::operator==(const iSCSISessionKey &other) const
+{
+    return initiator == other.initiator &&
+           target == other.target &&
+           address == other.address;
+}
+
+iSCSISessionPool::iSCSISessionPool(unsigned int maxSessions, int timeout) :
+    mTimeout(timeout),
+    mWaitTimeout(-1),
+    mMaxSessions(maxSessions),
+    mSessions(0),
+    mHealthCheck(CHECK_NOP_OUT),
+    mCheckLun(0),
+    mCheckIdleMs(0)
+{
+    if (maxSessions == 0)
+        throw CException("iSCSISessionPool: Need at least one session");
+
+    ResetStats();
+}
+
+iSCSISessionPool::~iSCSISessionPool()
+{
+    Clear();
+}
+
+void iSCSISessionPool::SetLoginParams(const iSCSILoginParams &params)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    mLoginParams = params;
+}
+
+void iSCSISessionPool::SetHealthCheck(HealthCheck check,
+                                      unsigned int lun,
+                                      unsigned int idleMs)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    mHealthCheck = check;
+    mCheckLun = lun;
+    mCheckIdleMs = idleMs;
+}
+
+iSCSILibWrapper *iSCSISessionPool::createSession(
+    const iSCSISessionKey & /* key */)
+{
+    return new iSCSILibWrapper(mTimeout);
+}
+
+/*
+ * Any response means the session is alive. A TEST UNIT READY that gets a
+ * Unit Attention has used it up, so the borrower will not see it.
+ */
+bool iSCSISessionPool::checkHealth(iSCSILibWrapper &session)
+{
+    SCSITestUnitReady tur;
+
+    if (!session.GetClientState()->connected)
+        return false;
+
+    try
+    {
+        if (mHealthCheck == CHECK_NOP_OUT)
+        {
+            session.iSCSIPing();
+            // Leave no trace for the borrower
+            session.ResetSessionState();
+            return true;
+        }
+
+        session.iSCSIExecSCSISync(tur, mCheckLun);
+    }
+    catch (CException &)
+    {
+        return false;
+    }
+
+    return tur.GetStatus() != SCSI_STATUS_ERROR &&
+           tur.GetStatus() != SCSI_STATUS_CANCELLED;
+}
+
+iSCSILibWrapper *iSCSISessionPool::login(const iSCSISessionKey &key,
+                                         uint16_t qualifier)
+{
+    iSCSILibWrapper *session = createSession(key);
+
+    if (key.initiator.size())
+        session->SetInitiator(key.initiator);
+    session->SetTarget(key.target);
+    session->SetAddress(key.address);
+    session->SetSessionQualifier(qualifier);
+    session->SetLoginParams(mLoginParams);
+
+    try
+    {
+        session->iSCSIConnect();
+        session->iSCSINormalLoginWithRedirect();
+    }
+    catch (CException &)
+    {
+        destroy(session);
+        throw;
+    }
+
+    return session;
+}
+
+/*
+ * Log out if we can, but always disconnect so the background thread lets
+ * go of the session before it is deleted.
+ */
+void iSCSISessionPool::destroy(iSCSILibWrapper *session)
+{
+    try
+    {
+        session->iSCSINormalLogout();
+    }
+    catch (CException &)
+    {
+    }
+
+    try
+    {
+        session->iSCSIDisconnect();
+    }
+    catch (CException &)
+    {
+    }
+
+    delete session;
+}
+
+// The lowest qualifier not in use for the initiator and target. Called
+// with the lock held.
+uint16_t iSCSISessionPool::allocQualifier(const iSCSISessionKey &key)
+{
+    std::set<uint16_t> &used =
+        mQualifiers[std::make_pair(key.initiator, key.target)];
+    uint16_t qualifier = 1;
+
+    while (used.count(qualifier))
+        qualifier++;
+    used.insert(qualifier);
+
+    return qualifier;
+}
+
+void iSCSISessionPool::freeQualifier(const iSCSISessionKey &key,
+                                     uint16_t qualifier)
+{
+    std::map<std::pair<std::string, std::string>,
+             std::set<uint16_t> >::iterator it;
+
+    it = mQualifiers.find(std::make_pair(key.initiator, key.target));
+    if (it == mQualifiers.end())
+        return;
+
+    it->second.erase(qualifier);
+    if (!it->second.size())
+        mQualifiers.erase(it);
+}
+
+bool iSCSISessionPool::needsCheck(const entry &idle) const
+{
+    if (mHealthCheck == CHECK_NONE)
+        return false;
+
+    return boost::get_system_time() - idle.lastUsed >=
+           boost::posix_time::milliseconds(mCheckIdleMs);
+}
+
+iSCSILibWrapper &iSCSISessionPool::Borrow(const std::string &initiator,
+                                          const std::string &target,
+                                          const std::string &address)
+{
+    return Borrow(iSCSISessionKey(initiator, target, address));
+}
+
+/*
+ * Logins, health checks and logouts are done without the lock. The session
+ * is out of the idle list by then, and still counted, so nobody else can
+ * take it or its place.
+ */
+iSCSILibWrapper &iSCSISessionPool::Borrow(const iSCSISessionKey &key)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    boost::system_time deadline;
+    bool waited = false;
+    iSCSILibWrapper *session;
+    uint16_t qualifier;
+
+    if (mWaitTimeout >= 0)
+        deadline = boost::get_system_time() +
+                   boost::posix_time::milliseconds(mWaitTimeout);
+
+    mStats.borrows++;
+
+    for (;;)
+    {
+        std::list<entry>::iterator it;
+
+        for (it = mIdle.begin(); it != mIdle.end(); ++it)
+            if (it->key == key)
+                break;
+
+        if (it != mIdle.end())
+        {
+            entry idle = *it;
+            bool healthy = true;
+
+            mIdle.erase(it);
+
+            if (needsCheck(idle))
+            {
+                mStats.healthChecks++;
+                lock.unlock();
+                healthy = checkHealth(*idle.session);
+                lock.lock();
+            }
+
+            if (healthy)
+            {
+                mBorrowed.insert(std::make_pair(idle.session, idle));
+                mStats.reused++;
+                return *idle.session;
+            }
+
+            mStats.unhealthy++;
+            freeQualifier(idle.key, idle.qualifier);
+            mSessions--;
+            lock.unlock();
+            destroy(idle.session);
+            lock.lock();
+            mReturned.notify_all();
+            continue;
+        }
+
+        if (mSessions < mMaxSessions)
+            break;
+
+        if (mIdle.size())
+        {
+            entry idle = mIdle.back();
+
+            mIdle.pop_back();
+            mStats.evicted++;
+            freeQualifier(idle.key, idle.qualifier);
+            mSessions--;
+            lock.unlock();
+            destroy(idle.session);
+            lock.lock();
+            continue;
+        }
+
+        if (!waited)
+        {
+            mStats.waits++;
+            waited = true;
+        }
+
+        if (mWaitTimeout < 0)
+            mReturned.wait(lock);
+        else if (!mReturned.timed_wait(lock, deadline))
+        {
+            EString estr;
+            estr.Format("%s: No session for %s at %s after %d mSec, "
+                        "%u borrowed",
+                        __func__, key.target.c_str(), key.address.c_str(),
+                        mWaitTimeout, (unsigned int)mBorrowed.size());
+            throw CException(estr);
+        }
+    }
+
+    mSessions++;
+    qualifier = allocQualifier(key);
+    lock.unlock();
+
+    try
+    {
+        session = login(key, qualifier);
+    }
+    catch (CException &)
+    {
+        lock.lock();
+        mStats.loginFailures++;
+        freeQualifier(key, qualifier);
+        mSessions--;
+        mReturned.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    mStats.logins++;
+    mBorrowed.insert(std::make_pair(session, entry(session, key, qualifier)));
+
+    return *session;
+}
+
+void iSCSISessionPool::Return(iSCSILibWrapper &session, bool discard)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    std::map<iSCSILibWrapper *, entry>::iterator it;
+
+    it = mBorrowed.find(&session);
+    if (it == mBorrowed.end())
+        throw CException("iSCSISessionPool::Return: Not borrowed from this "
+                         "pool");
+
+    entry returned = it->second;
+    mBorrowed.erase(it);
+
+    if (!discard)
+    {
+        try
+        {
+            session.ResetSessionState();
+        }
+        catch (CException &)
+        {
+            discard = true;
+        }
+    }
+
+    if (discard)
+    {
+        mStats.discarded++;
+        freeQualifier(returned.key, returned.qualifier);
+        mSessions--;
+        lock.unlock();
+        destroy(returned.session);
+    }
+    else
+    {
+        returned.lastUsed = boost::get_system_time();
+        mIdle.push_front(returned);
+        lock.unlock();
+    }
+
+    mReturned.notify_all();
+}
+
+void iSCSISessionPool::Clear(void)
+{
+    std::list<entry> idle;
+
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+
+        idle.swap(mIdle);
+        for (std::list<entry>::iterator it = idle.begin();
+             it != idle.end(); ++it)
+        {
+            freeQualifier(it->key, it->qualifier);
+            mSessions--;
+        }
+    }
+
+    for (std::list<entry>::iterator it = idle.begin(); it != idle.end(); ++it)
+        destroy(it->session);
+
+    mReturned.notify_all();
+}
+
+unsigned int iSCSISessionPool::GetIdleCount(void)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    return mIdle.size();
+}
+
+unsigned int iSCSISessionPool::GetBorrowedCount(void)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    return mBorrowed.size();
+}
+
+iSCSISessionPoolStats iSCSISessionPool::GetStats(void)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    return mStats;
+}
+
+void iSCSISessionPool::ResetStats(void)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+std::string iSCSISessionPool::StatsString(void)
+{
+    iSCSISessionPoolStats stats = GetStats();
+    EString str;
+
+    str.Format("borrows %llu, reused %llu, logins %llu (%llu failed), "
+               "health checks %llu (%llu failed), evicted %llu, "
+               "discarded %llu, waits %llu",
+               (unsigned long long)stats.borrows,
+               (unsigned long long)stats.reused,
+               (unsigned long long)stats.logins,
+               (unsigned long long)stats.loginFailures,
+               (unsigned long long)stats.healthChecks,
+               (unsigned long long)stats.unhealthy,
+               (unsigned long long)stats.evicted,
+               (unsigned long long)stats.discarded,
+               (unsigned long long)stats.waits);
+    return str;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+
+#ifndef __iSCSISessionPool_h__
+#define __iSCSISessionPool_h__
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+#include "iSCSILibWrapper.h"
+
+/**
+ * \struct iSCSISessionKey
+ *
+ * What a pooled session is logged in as, and to. Only sessions with the
+ * same key are handed out in place of each other.
+ */
+struct iSCSISessionKey {
+    iSCSISessionKey(const std::string &initiator,
+                    const std::string &target,
+                    const std::string &address) :
+        initiator(initiator), target(target), address(address)
+        {}
+
+    bool operator<(const iSCSISessionKey &other) const;
+    bool operator==(const iSCSISessionKey &other) const;
+
+    std::string initiator;      // Empty for libiscsi's default
+    std::string target;
+    std::string address;
+};
+
+/**
+ * \struct iSCSISessionPoolStats
+ */
+struct iSCSISessionPoolStats {
+    uint64_t borrows;
+    uint64_t reused;            // Borrows handed an idle session
+    uint64_t logins;
+    uint64_t loginFailures;
+    uint64_t healthChecks;
+    uint64_t unhealthy;         // Idle sessions that failed the check
+    uint64_t evicted;           // Idle sessions logged out to make room
+    uint64_t discarded;         // Returned sessions that were not kept
+    uint64_t waits;             // Borrows that waited for a session
+};
+
+/**
+ * \class iSCSISessionPool
+ *
+ * Hands out logged in sessions and takes them back for the next borrower,
+ * so a suite of short tests does not log in and out for every one.
+ *
+ * A returned session is reset with ResetSessionState and kept idle. Before
+ * an idle session is handed out again it can be checked with a NOP-OUT
+ * ping, the default, which leaves the LUN alone, or with TEST UNIT READY,
+ * where any response at all means it is alive, including a CHECK
+ * CONDITION. TEST UNIT READY consumes any pending Unit Attention, so the
+ * borrower never sees it. Sessions that fail the check are logged out and
+ * replaced.
+ *
+ * The pool holds at most maxSessions, borrowed and idle together. When it
+ * is full, a borrow for a key with nothing idle logs out the least
+ * recently used idle session of another key, or waits for one to be
+ * returned if everything is borrowed.
+ *
+ * Sessions from the same initiator to the same target get different ISID
+ * qualifiers, whatever portal they use, so they do not reinstate each
+ * other. They are logged in with the pool's login
+ * parameters.
+ *
+ * Borrowers must not log out or disconnect, and must return the session
+ * with nothing outstanding or it is thrown away. Return everything before
+ * the pool goes away; only idle sessions are logged out then.
+ */
+class iSCSISessionPool
+{
+public:
+    enum HealthCheck {
+        CHECK_NONE,
+        CHECK_TEST_UNIT_READY,
+        CHECK_NOP_OUT,
+    };
+
+    iSCSISessionPool(unsigned int maxSessions = 16, int timeout = -1);
+    virtual ~iSCSISessionPool();
+
+    void SetLoginParams(const iSCSILoginParams &params);
+    // Only sessions idle for at least idleMs are checked
+    void SetHealthCheck(HealthCheck check,
+                        unsigned int lun = 0,
+                        unsigned int idleMs = 0);
+    // How long a borrow waits when the pool is full, -1 for forever
+    void SetWaitTimeout(int ms) { mWaitTimeout = ms; }
+
+    iSCSILibWrapper &Borrow(const iSCSISessionKey &key);
+    iSCSILibWrapper &Borrow(const std::string &initiator,
+                            const std::string &target,
+                            const std::string &address);
+    // Discard if the session should not be used again
+    void Return(iSCSILibWrapper &session, bool discard = false);
+
+    // Log out all the idle sessions
+    void Clear(void);
+
+    unsigned int GetIdleCount(void);
+    unsigned int GetBorrowedCount(void);
+
+    iSCSISessionPoolStats GetStats(void);
+    void ResetStats(void);
+    std::string StatsString(void);
+
+protected:
+    struct entry {
+        entry(iSCSILibWrapper *session,
+              const iSCSISessionKey &key,
+              uint16_t qualifier) :
+            session(session), key(key), qualifier(qualifier)
+            {}
+
+        iSCSILibWrapper *session;
+        iSCSISessionKey key;
+        uint16_t qualifier;
+        boost::system_time lastUsed;
+    };
+
+    // Subclasses can hand out their own wrappers, eg, to override tests
+    virtual iSCSILibWrapper *createSession(const iSCSISessionKey &key);
+    virtual bool checkHealth(iSCSILibWrapper &session);
+
+    iSCSILibWrapper *login(const iSCSISessionKey &key, uint16_t qualifier);
+    void destroy(iSCSILibWrapper *session);
+    uint16_t allocQualifier(const iSCSISessionKey &key);
+    void freeQualifier(const iSCSISessionKey &key, uint16_t qualifier);
+    bool needsCheck(const entry &idle) const;
+
+    int mTimeout;
+    int mWaitTimeout;
+    unsigned int mMaxSessions;
+    unsigned int mSessions;     // Idle, borrowed and logging in
+    iSCSILoginParams mLoginParams;
+    HealthCheck mHealthCheck;
+    unsigned int mCheckLun;
+    unsigned int mCheckIdleMs;
+
+    boost::mutex mMutex;
+    boost::condition mReturned;
+    std::list<entry> mIdle;     // Most recently returned first
+    std::map<iSCSILibWrapper *, entry> mBorrowed;
+    // By initiator and target, the portal does not matter to the target
+    std::map<std::pair<std::string, std::string>,
+             std::set<uint16_t> > mQualifiers;
+    iSCSISessionPoolStats mStats;
+};
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/**
+ * Sharing one session between threads.
+ *
+ * Author: Richard Sharpe
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "iSCSISharedSession.h"
+#include "SCSIRequest.h"
+#include "EString.h"
+#include "CException.h"
+
+static int createEventFd(const char *func)
+{
+    int fd = eventfd(0, EFD_NONBLOCK);
+
+    if (fd < 0)
+    {
+        EString estr;
+        estr.Format("%s: eventfd failed: %s", func, strerror(errno));
+        throw CException(estr);
+    }
+
+    return fd;
+}
+
+static void signalEventFd(int fd)
+{
+    uint64_t one = 1;
+
+    // It can only fail if the count is about to overflow, which still wakes
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+static void clearEventFd(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+}
+
+iSCSICompletionQueue::iSCSICompletionQueue(unsigned int size) :
+    mRing(size),
+    mSize(size),
+    mOutstanding(0),
+    mWaiting(0)
+{
+    mEventFd = createEventFd(__func__);
+}
+
+iSCSICompletionQueue::~iSCSICompletionQueue()
+{
+    close(mEventFd);
+}
+
+SCSIRequest *iSCSICompletionQueue::TryGet(void)
+{
+    SCSIRequest *request;
+
+    if (!mRing.Pop(request))
+        return NULL;
+
+    mOutstanding--;
+    return request;
+}
+
+/*
+ * Say we are waiting, then look once more. Either the event loop sees the
+ * flag after posting and signals us, or we see what it posted.
+ */
+SCSIRequest *iSCSICompletionQueue::Wait(void)
+{
+    SCSIRequest *request;
+
+    if (!mOutstanding)
+        return NULL;
+
+    while (!(request = TryGet()))
+    {
+        struct pollfd pfd;
+
+        mWaiting = 1;
+        __sync_synchronize();
+
+        if ((request = TryGet()))
+        {
+            mWaiting = 0;
+            break;
+        }
+
+        pfd.fd = mEventFd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        {
+            EString estr;
+            mWaiting = 0;
+            estr.Format("%s: poll failed: %s", __func__, strerror(errno));
+            throw CException(estr);
+        }
+
+        mWaiting = 0;
+        clearEventFd(mEventFd);
+    }
+
+    return request;
+}
+
+void iSCSICompletionQueue::complete(SCSIRequest *request)
+{
+    // Cannot be full, submitting stops at mSize outstanding
+    mRing.Push(request);
+
+    __sync_synchronize();
+    if (mWaiting)
+        signalEventFd(mEventFd);
+}
+
+iSCSISharedSession::iSCSISharedSession(iSCSILibWrapper &session,
+                                       unsigned int ringSize) :
+    mSession(session),
+    mRing(ringSize),
+    mSleeping(0),
+    mStop(false),
+    mFailed(false),
+    mSubmitted(0),
+    mRingFull(0),
+    mCompletedCount(0),
+    mWakeups(0),
+    mMaxDrained(0)
+{
+    mEventFd = createEventFd(__func__);
+}
+
+iSCSISharedSession::~iSCSISharedSession()
+{
+    Stop();
+    close(mEventFd);
+}
+
+void iSCSISharedSession::Start(void)
+{
+    if (mThread.joinable())
+        throw CException("iSCSISharedSession::Start: Already started");
+
+    mStop = false;
+    mThread = boost::thread(&iSCSISharedSession::eventLoop, this);
+}
+
+void iSCSISharedSession::Stop(void)
+{
+    if (!mThread.joinable())
+        return;
+
+    mStop = true;
+    wakeLoop();
+    mThread.join();
+}
+
+void iSCSISharedSession::wakeLoop(void)
+{
+    signalEventFd(mEventFd);
+}
+
+bool iSCSISharedSession::TrySubmit(SCSIRequest &request,
+                                   unsigned int lun,
+                                   iSCSICompletionQueue &queue)
+{
+    struct submission sub;
+
+    if (mFailed)
+        throw CException(mErrorString);
+
+    if (!mThread.joinable() || mStop)
+        throw CException("iSCSISharedSession::TrySubmit: Not running");
+
+    if (queue.mOutstanding >= queue.mSize)
+        throw CException("iSCSISharedSession::TrySubmit: Completion queue full");
+
+    sub.request = &request;
+    sub.lun = lun;
+    sub.queue = &queue;
+
+    queue.mOutstanding++;
+    if (!mRing.Push(sub))
+    {
+        queue.mOutstanding--;
+        __sync_fetch_and_add(&mRingFull, 1);
+        return false;
+    }
+
+    __sync_fetch_and_add(&mSubmitted, 1);
+
+    // Same dance as the completion queue, the other way round
+    __sync_synchronize();
+    if (mSleeping)
+        wakeLoop();
+
+    return true;
+}
+
+void iSCSISharedSession::Submit(SCSIRequest &request,
+                                unsigned int lun,
+                                iSCSICompletionQueue &queue)
+{
+    while (!TrySubmit(request, lun, queue))
+        boost::this_thread::yield();
+}
+
+/*
+ * Send everything waiting in the ring
+ */
+unsigned int iSCSISharedSession::drain(void)
+{
+    struct submission sub;
+    unsigned int count = 0;
+
+    while (mRing.Pop(sub))
+    {
+        count++;
+
+        try
+        {
+            mSession.iSCSIExecSCSIAsync(*sub.request, sub.lun);
+            mOwners[sub.request] = sub.queue;
+        }
+        catch (CException &e)
+        {
+            // Something wrong with the request. A dead session will show up
+            // at the next poll.
+            sub.request->GetTask()->status = SCSI_STATUS_ERROR;
+            sub.queue->complete(sub.request);
+            mCompletedCount++;
+        }
+    }
+
+    // One corked write for the lot rather than one per wakeup
+    if (count)
+        mSession.iSCSIFlushAsync();
+
+    if (count > mMaxDrained)
+        mMaxDrained = count;
+
+    return count;
+}
+
+void iSCSISharedSession::harvest(void)
+{
+    mCompleted.clear();
+    mSession.iSCSIWaitSCSIAsync(mCompleted, 0);
+
+    for (unsigned int i = 0; i < mCompleted.size(); i++)
+    {
+        std::map<SCSIRequest *, iSCSICompletionQueue *>::iterator it;
+
+        it = mOwners.find(mCompleted[i]);
+        if (it == mOwners.end())
+            continue;   // Cannot happen, we submitted everything
+
+        it->second->complete(mCompleted[i]);
+        mOwners.erase(it);
+        mCompletedCount++;
+    }
+}
+
+void iSCSISharedSession::failAll(const std::string &error)
+{
+    struct submission sub;
+    std::map<SCSIRequest *, iSCSICompletionQueue *>::iterator it;
+
+    if (!mFailed)
+    {
+        mErrorString = error;
+        __sync_synchronize();
+        mFailed = true;
+    }
+
+    for (it = mOwners.begin(); it != mOwners.end(); it++)
+    {
+        it->first->GetTask()->status = SCSI_STATUS_ERROR;
+        it->second->complete(it->first);
+        mCompletedCount++;
+    }
+    mOwners.clear();
+
+    while (mRing.Pop(sub))
+    {
+        sub.request->GetTask()->status = SCSI_STATUS_ERROR;
+        sub.queue->complete(sub.request);
+        mCompletedCount++;
+    }
+}
+
+void iSCSISharedSession::eventLoop(void)
+{
+    try
+    {
+        mSession.BindCurrentThread();
+
+        for (;;)
+        {
+            struct pollfd pfds[3];
+            unsigned int count = 1;
+            bool timer = false;
+            int res;
+
+            // Failed submissions and recovery complete requests without
+            // the socket having anything to say
+            drain();
+            harvest();
+
+            if (mStop && mRing.Empty() && !mSession.GetOutstanding())
+                break;
+
+            pfds[0].fd = mEventFd;
+            pfds[0].events = POLLIN;
+            pfds[0].revents = 0;
+            if (mSession.GetOutstanding())
+            {
+                mSession.iSCSIGetPollFd(pfds[count++]);
+                // Command deadlines, see SetCommandTimeout
+                if ((timer = mSession.iSCSIGetTimerPollFd(pfds[count])))
+                    count++;
+            }
+
+            mSleeping = 1;
+            __sync_synchronize();
+            if (!mRing.Empty())
+            {
+                mSleeping = 0;
+                continue;
+            }
+
+            res = poll(pfds, count, -1);
+            mSleeping = 0;
+
+            if (res < 0)
+            {
+                EString estr;
+
+                if (errno == EINTR)
+                    continue;
+                estr.Format("%s: poll failed: %s", __func__, strerror(errno));
+                throw CException(estr);
+            }
+
+            if (pfds[0].revents)
+            {
+                clearEventFd(mEventFd);
+                mWakeups++;
+            }
+
+            if (count > 1 && pfds[1].revents)
+                mSession.iSCSIServiceEvents(pfds[1].revents);
+            if (timer && pfds[2].revents)
+                mSession.iSCSIServiceTimers();
+            harvest();
+        }
+    }
+    catch (CException &e)
+    {
+        failAll(e.getDesc());
+
+        // Keep failing anything that slipped in until we are told to stop
+        while (!mStop)
+        {
+            struct pollfd pfd;
+
+            pfd.fd = mEventFd;
+            pfd.events = POLLIN;
+            mSleeping = 1;
+            __sync_synchronize();
+            if (mRing.Empty())
+                poll(&pfd, 1, -1);
+            mSleeping = 0;
+            clearEventFd(mEventFd);
+            failAll(mErrorString);
+        }
+        failAll(mErrorString);
+    }
+}
+
+iSCSISharedSessionStats iSCSISharedSession::GetStats(void) const
+{
+    iSCSISharedSessionStats stats;
+
+    stats.submitted = mSubmitted;
+    stats.completed = mCompletedCount;
+    stats.ringFull = mRingFull;
+    stats.wakeups = mWakeups;
+    stats.maxDrained = mMaxDrained;
+
+    return stats;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+#ifndef __iSCSISharedSession_h__
+#define __iSCSISharedSession_h__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <boost/thread/thread.hpp>
+
+#include "iSCSILibWrapper.h"
+#include "MPSCRing.h"
+
+/**
+ * \class iSCSICompletionQueue
+ *
+ * Where an iSCSISharedSession hands back the requests one thread submitted.
+ * Each thread should have its own; only the thread that submits through a
+ * queue may take completions from it. Its size caps how many requests that
+ * thread can have outstanding.
+ */
+class iSCSICompletionQueue
+{
+public:
+    iSCSICompletionQueue(unsigned int size = 1024);
+    ~iSCSICompletionQueue();
+
+    // NULL if nothing has completed
+    SCSIRequest *TryGet(void);
+    // Blocks until something completes. NULL if nothing is outstanding.
+    SCSIRequest *Wait(void);
+
+    unsigned int GetOutstanding(void) const { return mOutstanding; }
+
+private:
+    friend class iSCSISharedSession;
+
+    void complete(SCSIRequest *request);   // From the event loop
+
+    MPSCRing<SCSIRequest *> mRing;
+    unsigned int mSize;
+    unsigned int mOutstanding;  // Only touched by the owning thread
+    int mEventFd;
+    volatile int mWaiting;
+};
+
+/**
+ * \struct iSCSISharedSessionStats
+ */
+struct iSCSISharedSessionStats {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t ringFull;          // Submits that found the ring full
+    uint64_t wakeups;           // Times the event loop was woken
+    unsigned int maxDrained;    // Most submissions picked up in one pass
+};
+
+/**
+ * \class iSCSISharedSession
+ *
+ * Lets any number of threads share one logged in session. Threads push
+ * requests into a lock free ring and the session's own event loop thread
+ * takes them off, sends them and posts each completion to the queue it was
+ * submitted with. Nothing on that path takes a lock; the event loop is only
+ * woken through an eventfd when it is asleep.
+ *
+ * Between Start and Stop the event loop owns the wrapper, so do not call it
+ * directly. The event loop thread calls BindCurrentThread on the wrapper,
+ * so give the wrapper a NUMA node or CPUs first if it should be pinned.
+ *
+ * If the session fails, everything outstanding completes with
+ * SCSI_STATUS_ERROR and further submits throw.
+ */
+class iSCSISharedSession
+{
+public:
+    iSCSISharedSession(iSCSILibWrapper &session, unsigned int ringSize = 1024);
+    ~iSCSISharedSession();
+
+    void Start(void);
+    // Waits for everything submitted to complete
+    void Stop(void);
+
+    // Any thread. Returns false if the ring is full.
+    bool TrySubmit(SCSIRequest &request,
+                   unsigned int lun,
+                   iSCSICompletionQueue &queue);
+    // Any thread. Spins while the ring is full.
+    void Submit(SCSIRequest &request,
+                unsigned int lun,
+                iSCSICompletionQueue &queue);
+
+    bool IsFailed(void) const { return mFailed; }
+    const std::string &GetError(void) const { return mErrorString; }
+    iSCSISharedSessionStats GetStats(void) const;
+
+private:
+    struct submission {
+        SCSIRequest *request;
+        unsigned int lun;
+        iSCSICompletionQueue *queue;
+    };
+
+    void eventLoop(void);
+    unsigned int drain(void);
+    void harvest(void);
+    void failAll(const std::string &error);
+    void wakeLoop(void);
+
+    iSCSILibWrapper &mSession;
+    MPSCRing<submission> mRing;
+    boost::thread mThread;
+    int mEventFd;
+    volatile int mSleeping;
+    volatile bool mStop;
+    volatile bool mFailed;
+    std::string mErrorString;
+
+    // Only touched by the event loop
+    std::map<SCSIRequest *, iSCSICompletionQueue *> mOwners;
+    std::vector<SCSIRequest *> mCompleted;
+
+    // Bumped with atomics from any thread
+    volatile uint64_t mSubmitted;
+    volatile uint64_t mRingFull;
+    uint64_t mCompletedCount;
+    uint64_t mWakeups;
+    unsigned int mMaxDrained;
+};
+
+#endif
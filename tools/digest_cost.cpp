@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * What do digests cost us per GB moved?
+ * 1. Times CRC32C over transfer sized buffers, with the SSE4.2 and the table
+ *    implementations,
+ * 2. If given a target, reads and then writes for a fixed time with no
+ *    digests, and again with the header digest on (computed by libiscsi)
+ *    and a CRC32C of every data buffer. libiscsi cannot do data digests,
+ *    so the latter stands in for the work one would add,
+ * 3. Reports throughput and CPU seconds per GB for each, and the difference.
+ *
+ * THE WRITE PASSES OVERWRITE DATA ON THE LUN.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <vector>
+#include <string>
+
+#include "iSCSILibWrapper.h"
+#include "SCSITestUnitReady.h"
+#include "SCSIRead.h"
+#include "SCSIWrite.h"
+#include "SCSIRetryPolicy.h"
+#include "CRC32C.h"
+
+#include "EString.h"
+#include "CException.h"
+
+#define GB 1000000000.0
+
+struct Options {
+    std::string initiator;
+    std::string target;
+    std::string address;
+    unsigned int lun;
+    unsigned int blockSize;
+    unsigned int transferSize;
+    unsigned int queueDepth;
+    unsigned int seconds;
+    unsigned int regionMB;
+    unsigned int crcGB;
+};
+
+struct Result {
+    uint64_t bytes;
+    double secs;
+    double cpuSecs;
+};
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s [-x <transfer size>] [-n <GB to digest>]\n"
+           "          [-a <address> -t <target> [-i <initiator>] [-l <lun>]\n"
+           "           [-b <block size>] [-q <queue depth>] [-s <seconds>]\n"
+           "           [-r <region MB>]]\n"
+           "\n"
+           "Without a target only the CRC32C implementations are timed.\n"
+           "Writes to the LUN! Defaults: transfer 262144, 4 GB, lun 0,\n"
+           "block size 512, queue depth 8, 10 seconds, 1024 MB region.\n",
+           prog);
+    exit(1);
+}
+
+static double CPUSeconds(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+static void TimeCRC(const Options &opts, bool hardware)
+{
+    std::vector<uint8_t> buffer(opts.transferSize);
+    uint64_t total = (uint64_t)opts.crcGB * 1000000000ULL;
+    uint64_t done = 0;
+    uint32_t crc = 0;
+    double start, secs;
+
+    for (unsigned int i = 0; i < buffer.size(); i++)
+        buffer[i] = rand();
+
+    start = CPUSeconds();
+    while (done < total)
+    {
+        if (hardware)
+            crc ^= CRC32C(&buffer[0], buffer.size());
+        else
+            crc ^= CRC32CSoftware(&buffer[0], buffer.size());
+        done += buffer.size();
+    }
+    secs = CPUSeconds() - start;
+
+    printf("%-8s %10.2f GB/s %10.1f mS CPU per GB (%08x)\n",
+           hardware ? "SSE4.2" : "table",
+           done / GB / secs,
+           secs * 1000 / (done / GB),
+           crc);
+}
+
+/*
+ * Keep queueDepth reads or writes going for the configured time. With
+ * digests on libiscsi adds the header digest, and we CRC every buffer on
+ * its way out or in as the data digest would.
+ */
+static Result RunLoad(const Options &opts, bool write, bool digests)
+{
+    iSCSILibWrapper iscsi;
+    iSCSILoginParams params;
+    SCSITestUnitReady tur;
+    SCSIRetryPolicy retryPolicy;
+    std::vector<SCSIRequest *> requests;
+    std::vector<SCSIRequest *> completed;
+    unsigned int blocks = opts.transferSize / opts.blockSize;
+    uint32_t regionBlocks = (uint64_t)opts.regionMB * 1048576 / opts.blockSize;
+    uint32_t lba = 0;
+    uint32_t crc = 0;
+    boost::system_time start, deadline;
+    double cpuStart;
+    Result result;
+
+    params.headerDigest = digests ? ISCSI_HEADER_DIGEST_CRC32C :
+                                    ISCSI_HEADER_DIGEST_NONE;
+
+    if (opts.initiator.size())
+        iscsi.SetInitiator(opts.initiator);
+    iscsi.SetTarget(opts.target);
+    iscsi.SetAddress(opts.address);
+    iscsi.SetLoginParams(params);
+
+    iscsi.iSCSIConnect();
+    iscsi.iSCSINormalLoginWithRedirect();
+
+    if (iscsi.GetNegotiatedHeaderDigest() != params.headerDigest)
+        throw CException("Target would not agree to the header digest");
+
+    // Get the bus reset out of the way
+    iscsi.iSCSIExecSCSISyncRetry(tur, opts.lun, retryPolicy);
+    if (tur.GetStatus() != SCSI_STATUS_GOOD)
+        throw CException("Test Unit Ready failed");
+
+    for (unsigned int i = 0; i < opts.queueDepth; i++)
+    {
+        if (write)
+        {
+            SCSIWrite10 *req = new SCSIWrite10(blocks, opts.blockSize);
+
+            for (unsigned int j = 0; j < req->GetOutBufferSize(); j++)
+                req->SetOutBufferByte(j, j & 0xFF);
+            requests.push_back(req);
+        }
+        else
+            requests.push_back(new SCSIRead10(blocks, opts.blockSize));
+    }
+
+    result.bytes = 0;
+    cpuStart = CPUSeconds();
+    start = boost::get_system_time();
+    deadline = start + boost::posix_time::seconds(opts.seconds);
+
+    for (unsigned int i = 0; i < requests.size(); i++)
+    {
+        if (write)
+            static_cast<SCSIWrite10 *>(requests[i])->SetLBA(lba);
+        else
+            static_cast<SCSIRead10 *>(requests[i])->SetLBA(lba);
+        lba = (lba + blocks) % (regionBlocks - blocks);
+        if (write && digests)
+            crc ^= requests[i]->GetOutBufferDigest();
+        iscsi.iSCSIExecSCSIAsync(*requests[i], opts.lun);
+    }
+
+    while (iscsi.GetOutstanding())
+    {
+        completed.clear();
+        iscsi.iSCSIWaitSCSIAsync(completed, 1);
+
+        for (unsigned int i = 0; i < completed.size(); i++)
+        {
+            SCSIRequest *req = completed[i];
+
+            if (req->GetStatus() != SCSI_STATUS_GOOD)
+            {
+                EString estr;
+                estr.Format("%s failed: Status: %s, SenseKey: %s, ASCQ: %s",
+                            write ? "Write" : "Read",
+                            req->StatusString().c_str(),
+                            req->SenseKeyString().c_str(),
+                            req->ASCQString().c_str());
+                throw CException(estr);
+            }
+
+            if (write)
+                result.bytes += req->GetOutBufferSize();
+            else
+            {
+                result.bytes += req->GetInBufferTransferSize();
+                if (digests)
+                    crc ^= req->GetInBufferDigest();
+            }
+
+            if (boost::get_system_time() < deadline)
+            {
+                req->Reset();
+                if (write)
+                    static_cast<SCSIWrite10 *>(req)->SetLBA(lba);
+                else
+                    static_cast<SCSIRead10 *>(req)->SetLBA(lba);
+                lba = (lba + blocks) % (regionBlocks - blocks);
+                if (write && digests)
+                    crc ^= req->GetOutBufferDigest();
+                iscsi.iSCSIExecSCSIAsync(*req, opts.lun);
+            }
+        }
+    }
+
+    result.secs = (boost::get_system_time() - start).total_microseconds()
+                      / 1000000.0;
+    result.cpuSecs = CPUSeconds() - cpuStart;
+
+    for (unsigned int i = 0; i < requests.size(); i++)
+        delete requests[i];
+
+    iscsi.iSCSINormalLogout();
+    iscsi.iSCSIDisconnect();
+
+    // Keep the compiler from deciding the digests are not needed
+    if (crc == 0xffffffff)
+        printf(" ");
+
+    return result;
+}
+
+static double CPUPerGB(const Result &result)
+{
+    return result.bytes ? result.cpuSecs / (result.bytes / GB) : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    int opt;
+
+    opts.lun = 0;
+    opts.blockSize = 512;
+    opts.transferSize = 262144;
+    opts.queueDepth = 8;
+    opts.seconds = 10;
+    opts.regionMB = 1024;
+    opts.crcGB = 4;
+
+    while ((opt = getopt(argc, argv, "a:t:i:l:b:x:q:s:r:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a': opts.address = optarg; break;
+        case 't': opts.target = optarg; break;
+        case 'i': opts.initiator = optarg; break;
+        case 'l': opts.lun = strtoul(optarg, NULL, 0); break;
+        case 'b': opts.blockSize = strtoul(optarg, NULL, 0); break;
+        case 'x': opts.transferSize = strtoul(optarg, NULL, 0); break;
+        case 'q': opts.queueDepth = strtoul(optarg, NULL, 0); break;
+        case 's': opts.seconds = strtoul(optarg, NULL, 0); break;
+        case 'r': opts.regionMB = strtoul(optarg, NULL, 0); break;
+        case 'n': opts.crcGB = strtoul(optarg, NULL, 0); break;
+        default: Usage(argv[0]);
+        }
+    }
+
+    if (!opts.transferSize || !opts.crcGB ||
+        (opts.address.size() != opts.target.size() &&
+         (!opts.address.size() || !opts.target.size())))
+        Usage(argv[0]);
+
+    printf("CRC32C over %u byte buffers:\n", opts.transferSize);
+    if (CRC32CHardware())
+        TimeCRC(opts, true);
+    TimeCRC(opts, false);
+
+    if (!opts.address.size())
+        return 0;
+
+    if (!opts.blockSize || opts.transferSize < opts.blockSize ||
+        !opts.queueDepth ||
+        (uint64_t)opts.regionMB * 1048576 < 2ULL * opts.transferSize)
+        Usage(argv[0]);
+
+    printf("\n%-6s %-8s %10s %14s %14s\n",
+           "", "Digests", "MB/s", "CPU S per GB", "Digest cost");
+
+    for (int write = 0; write < 2; write++)
+    {
+        Result plain, digested;
+
+        try
+        {
+            plain = RunLoad(opts, write, false);
+            digested = RunLoad(opts, write, true);
+        }
+        catch (CException &e)
+        {
+            printf("%-6s failed: %s\n",
+                   write ? "write" : "read", e.getDesc().c_str());
+            continue;
+        }
+
+        printf("%-6s %-8s %10.1f %14.3f\n",
+               write ? "write" : "read", "None",
+               plain.bytes / plain.secs / 1000000.0,
+               CPUPerGB(plain));
+        printf("%-6s %-8s %10.1f %14.3f %14.3f\n",
+               write ? "write" : "read", "CRC32C",
+               digested.bytes / digested.secs / 1000000.0,
+               CPUPerGB(digested),
+               CPUPerGB(digested) - CPUPerGB(plain));
+    }
+
+    return 0;
+}
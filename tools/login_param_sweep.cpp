@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * Sweep the iSCSI login parameters that matter for writes and measure
+ * write throughput for each combination:
+ * 1. Logs in with one combination of ImmediateData and InitialR2T. Those
+ *    are the ones libiscsi lets us set, and only with make LOGIN_PARAMS=1;
+ *    without it only libiscsi's defaults are run,
+ * 2. Prints what was offered,
+ * 3. Writes sequentially across a region of the LUN at a fixed queue depth
+ *    for a fixed time,
+ * 4. Logs out and moves to the next combination.
+ *
+ * THIS OVERWRITES DATA ON THE LUN.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+
+#include "iSCSILibWrapper.h"
+#include "SCSITestUnitReady.h"
+#include "SCSIWrite.h"
+#include "SCSIRetryPolicy.h"
+#include "IOBufferPool.h"
+
+#include "EString.h"
+#include "CException.h"
+
+struct Options {
+    std::string initiator;
+    std::string target;
+    std::string address;
+    unsigned int lun;
+    unsigned int blockSize;
+    unsigned int transferSize;
+    unsigned int queueDepth;
+    unsigned int seconds;
+    unsigned int regionMB;
+};
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s -a <address> -t <target> [-i <initiator>] [-l <lun>]\n"
+           "          [-b <block size>] [-x <transfer size>] [-q <queue depth>]\n"
+           "          [-s <seconds per combination>] [-r <region MB>]\n"
+           "\n"
+           "Writes to the LUN! Defaults: lun 0, block size 512, transfer\n"
+           "262144, queue depth 8, 10 seconds, 1024 MB region.\n",
+           prog);
+    exit(1);
+}
+
+/*
+ * Log in with the parameters given and write for the configured time.
+ * Returns bytes per second.
+ */
+static double RunCombination(const Options &opts,
+                             const iSCSILoginParams &params)
+{
+    iSCSILibWrapper iscsi;
+    SCSITestUnitReady tur;
+    SCSIRetryPolicy retryPolicy;
+    std::vector<SCSIWrite10 *> writes;
+    std::vector<SCSIRequest *> completed;
+    unsigned int blocks = opts.transferSize / opts.blockSize;
+    uint32_t regionBlocks = (uint64_t)opts.regionMB * 1048576 / opts.blockSize;
+    uint32_t lba = 0;
+    uint64_t bytes = 0;
+    boost::system_time start, deadline;
+    double secs;
+
+    if (opts.initiator.size())
+        iscsi.SetInitiator(opts.initiator);
+    iscsi.SetTarget(opts.target);
+    iscsi.SetAddress(opts.address);
+    iscsi.SetLoginParams(params);
+
+    iscsi.iSCSIConnect();
+    iscsi.iSCSINormalLoginWithRedirect();
+
+    // Get the bus reset out of the way
+    iscsi.iSCSIExecSCSISyncRetry(tur, opts.lun, retryPolicy);
+    if (tur.GetStatus() != SCSI_STATUS_GOOD)
+        throw CException("Test Unit Ready failed");
+
+    // They can all write the same data
+    boost::shared_array<uint8_t> buffer =
+        IOBufferAllocator::GetDefault().Allocate(blocks * opts.blockSize);
+    for (unsigned int i = 0; i < blocks * opts.blockSize; i++)
+        buffer[i] = i & 0xFF;
+
+    for (unsigned int i = 0; i < opts.queueDepth; i++)
+        writes.push_back(new SCSIWrite10(blocks, opts.blockSize, buffer));
+
+    start = boost::get_system_time();
+    deadline = start + boost::posix_time::seconds(opts.seconds);
+
+    for (unsigned int i = 0; i < writes.size(); i++)
+    {
+        writes[i]->SetLBA(lba);
+        lba = (lba + blocks) % (regionBlocks - blocks);
+        iscsi.iSCSIExecSCSIAsync(*writes[i], opts.lun);
+    }
+
+    while (iscsi.GetOutstanding())
+    {
+        completed.clear();
+        iscsi.iSCSIWaitSCSIAsync(completed, 1);
+
+        for (unsigned int i = 0; i < completed.size(); i++)
+        {
+            SCSIRequest *write = completed[i];
+
+            if (write->GetStatus() != SCSI_STATUS_GOOD)
+            {
+                EString estr;
+                estr.Format("Write failed: Status: %s, SenseKey: %s, ASCQ: %s",
+                            write->StatusString().c_str(),
+                            write->SenseKeyString().c_str(),
+                            write->ASCQString().c_str());
+                throw CException(estr);
+            }
+
+            bytes += write->GetOutBufferSize();
+
+            if (boost::get_system_time() < deadline)
+            {
+                write->Reset();
+                static_cast<SCSIWrite10 *>(write)->SetLBA(lba);
+                lba = (lba + blocks) % (regionBlocks - blocks);
+                iscsi.iSCSIExecSCSIAsync(*write, opts.lun);
+            }
+        }
+    }
+
+    secs = (boost::get_system_time() - start).total_microseconds() / 1000000.0;
+
+    for (unsigned int i = 0; i < writes.size(); i++)
+        delete writes[i];
+
+    iscsi.iSCSINormalLogout();
+    iscsi.iSCSIDisconnect();
+
+    return bytes / secs;
+}
+
+int main(int argc, char *argv[])
+{
+    static const bool immediateData[] = { true, false };
+    static const bool initialR2T[] = { false, true };
+    Options opts;
+    int opt;
+
+    opts.lun = 0;
+    opts.blockSize = 512;
+    opts.transferSize = 262144;
+    opts.queueDepth = 8;
+    opts.seconds = 10;
+    opts.regionMB = 1024;
+
+    while ((opt = getopt(argc, argv, "a:t:i:l:b:x:q:s:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a': opts.address = optarg; break;
+        case 't': opts.target = optarg; break;
+        case 'i': opts.initiator = optarg; break;
+        case 'l': opts.lun = strtoul(optarg, NULL, 0); break;
+        case 'b': opts.blockSize = strtoul(optarg, NULL, 0); break;
+        case 'x': opts.transferSize = strtoul(optarg, NULL, 0); break;
+        case 'q': opts.queueDepth = strtoul(optarg, NULL, 0); break;
+        case 's': opts.seconds = strtoul(optarg, NULL, 0); break;
+        case 'r': opts.regionMB = strtoul(optarg, NULL, 0); break;
+        default: Usage(argv[0]);
+        }
+    }
+
+    if (!opts.address.size() || !opts.target.size() ||
+        !opts.blockSize || opts.transferSize < opts.blockSize ||
+        !opts.queueDepth ||
+        (uint64_t)opts.regionMB * 1048576 < 2ULL * opts.transferSize)
+        Usage(argv[0]);
+
+#ifndef SCSITEST_LOGIN_PARAMS
+    printf("Built without LOGIN_PARAMS=1, so only libiscsi's defaults are "
+           "run, see INSTALL\n");
+#endif
+    printf("%-4s %-4s | %10s %10s\n", "Imm", "R2T", "MB/s", "IOPS");
+
+    for (unsigned int a = 0; a < 2; a++)
+    for (unsigned int b = 0; b < 2; b++)
+    {
+        iSCSILoginParams params;
+        double rate;
+
+        params.immediateData = immediateData[a];
+        params.initialR2T = initialR2T[b];
+
+#ifndef SCSITEST_LOGIN_PARAMS
+        if (a || b)
+            continue;
+#endif
+
+        printf("%-4s %-4s | ",
+               params.immediateData ? "Yes" : "No",
+               params.initialR2T ? "Yes" : "No");
+        fflush(stdout);
+
+        try
+        {
+            rate = RunCombination(opts, params);
+        }
+        catch (CException &e)
+        {
+            printf("failed: %s\n", e.getDesc().c_str());
+            continue;
+        }
+
+        printf("%10.1f %10.0f\n", rate / 1000000.0, rate / opts.transferSize);
+    }
+
+    return 0;
+}
@@ -0,0 +1,611 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * A boot storm: many sessions logging in at once, as when hundreds of VDI
+ * clients start together.
+ * 1. Optionally logs in some background sessions that do 4K random reads
+ *    throughout, for a baseline of their latency,
+ * 2. Drives the storm sessions through connect, login and a first INQUIRY
+ *    from a few threads, each with many in flight, without waiting on any
+ *    one of them,
+ * 3. Reports login and first INQUIRY latency percentiles, sessions per
+ *    second, and the background sessions' read latency before, during and
+ *    after the storm,
+ * 4. Logs everything out.
+ *
+ * Only reads, so it is safe on LUNs with data.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <vector>
+#include <string>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "iSCSILibWrapper.h"
+#include "SCSITestUnitReady.h"
+#include "SCSIInquiry.h"
+#include "SCSIReadCapacity.h"
+#include "SCSIRead.h"
+#include "SCSIRetryPolicy.h"
+#include "LatencyHistogram.h"
+
+#include "EString.h"
+#include "CException.h"
+
+struct Options {
+    std::string initiator;
+    std::string target;
+    std::string address;
+    unsigned int lun;
+    unsigned int sessions;
+    unsigned int concurrency;
+    unsigned int threads;
+    unsigned int background;
+    unsigned int iodepth;
+    unsigned int settle;
+    int timeout;
+};
+
+// Where the background sessions' latencies go
+enum Phase {
+    PHASE_BEFORE,
+    PHASE_DURING,
+    PHASE_AFTER,
+    PHASE_STOP,
+};
+
+struct StormResult {
+    StormResult() : loggedIn(0), failed(0) {}
+
+    LatencyHistogram login;         // Connect through login
+    LatencyHistogram firstIO;       // Connect through the INQUIRY
+    unsigned int loggedIn;
+    unsigned int failed;
+    std::string error;
+    std::vector<iSCSILibWrapper *> sessions;
+};
+
+struct BackgroundResult {
+    LatencyHistogram latency[PHASE_STOP];
+    std::string error;
+};
+
+enum State {
+    CONNECTING,
+    LOGGING_IN,
+    INQUIRING,
+};
+
+struct Attempt {
+    iSCSILibWrapper *session;
+    SCSIInquiry *inquiry;
+    State state;
+    uint64_t start;
+};
+
+static volatile int phase = PHASE_BEFORE;
+
+static uint64_t NowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s -a <address> -t <target> [-i <initiator>] [-l <lun>]\n"
+           "          [-n <sessions>] [-c <logins in flight>] [-T <threads>]\n"
+           "          [-b <background sessions>] [-q <background iodepth>]\n"
+           "          [-s <settle seconds>] [-w <timeout mS>]\n"
+           "\n"
+           "Defaults: lun 0, 100 sessions, all in flight, 4 threads, no\n"
+           "background sessions, iodepth 1, 5 seconds either side of the\n"
+           "storm, 30000 mS timeout.\n",
+           prog);
+    exit(1);
+}
+
+static iSCSILibWrapper *NewSession(const Options &opts, unsigned int index)
+{
+    iSCSILibWrapper *session = new iSCSILibWrapper(opts.timeout);
+
+    if (opts.initiator.size())
+        session->SetInitiator(opts.initiator);
+    session->SetTarget(opts.target);
+    session->SetAddress(opts.address);
+    // Every session needs its own ISID
+    session->SetSessionQualifier(index + 1);
+
+    return session;
+}
+
+/*
+ * Keep iodepth random 4K reads going and record their latency in whatever
+ * phase we are in when they complete
+ */
+static void BackgroundThread(const Options &opts,
+                             unsigned int index,
+                             boost::barrier &ready,
+                             BackgroundResult &result)
+{
+    iSCSILibWrapper *session = NewSession(opts, index);
+    std::vector<SCSIRead10 *> reads;
+    std::vector<uint64_t> started;
+    unsigned int seed = index;
+    bool waited = false;
+
+    try
+    {
+        SCSIRetryPolicy retryPolicy;
+        SCSITestUnitReady tur;
+        SCSIReadCapacity10 capacity;
+        std::vector<SCSIRequest *> completed;
+        unsigned int blockSize, blocks;
+        uint64_t lbas;
+
+        session->iSCSIConnect();
+        session->iSCSINormalLoginWithRedirect();
+
+        // Get the bus reset out of the way
+        session->iSCSIExecSCSISyncRetry(tur, opts.lun, retryPolicy);
+        session->iSCSIExecSCSISyncRetry(capacity, opts.lun, retryPolicy);
+        if (capacity.GetStatus() != SCSI_STATUS_GOOD)
+            throw CException("READ CAPACITY failed");
+
+        blockSize = capacity.GetLogicalBlockLen();
+        blocks = blockSize < 4096 ? 4096 / blockSize : 1;
+        // Stay in the first GB, so as not to depend on the LUN's size
+        lbas = (uint64_t)capacity.GetCapacity() + 1;
+        if (lbas > 1073741824ULL / blockSize)
+            lbas = 1073741824ULL / blockSize;
+        if (lbas < blocks)
+            throw CException("LUN too small");
+        lbas = lbas / blocks;
+
+        ready.wait();
+        waited = true;
+
+        for (unsigned int i = 0; i < opts.iodepth; i++)
+        {
+            reads.push_back(new SCSIRead10(blocks, blockSize));
+            started.push_back(0);
+        }
+
+        for (unsigned int i = 0; i < reads.size(); i++)
+        {
+            reads[i]->SetLBA((uint32_t)(rand_r(&seed) % lbas) * blocks);
+            started[i] = NowNs();
+            session->iSCSIExecSCSIAsync(*reads[i], opts.lun);
+        }
+
+        while (session->GetOutstanding())
+        {
+            completed.clear();
+            session->iSCSIWaitSCSIAsync(completed, 1);
+
+            for (unsigned int i = 0; i < completed.size(); i++)
+            {
+                unsigned int slot;
+                int now = phase;
+
+                for (slot = 0; reads[slot] != completed[i]; slot++)
+                    ;
+
+                if (reads[slot]->GetStatus() != SCSI_STATUS_GOOD)
+                {
+                    EString estr;
+                    estr.Format("Read failed: Status: %s, SenseKey: %s, "
+                                "ASCQ: %s",
+                                reads[slot]->StatusString().c_str(),
+                                reads[slot]->SenseKeyString().c_str(),
+                                reads[slot]->ASCQString().c_str());
+                    throw CException(estr);
+                }
+
+                if (now == PHASE_STOP)
+                    continue;
+
+                result.latency[now].Record(NowNs() - started[slot]);
+
+                reads[slot]->Reset();
+                reads[slot]->SetLBA((uint32_t)(rand_r(&seed) % lbas) * blocks);
+                started[slot] = NowNs();
+                session->iSCSIExecSCSIAsync(*reads[slot], opts.lun);
+            }
+        }
+
+        session->iSCSINormalLogout();
+        session->iSCSIDisconnect();
+    }
+    catch (CException &e)
+    {
+        result.error = e.getDesc();
+        if (!waited)
+            ready.wait();
+
+        // Idle sessions belong to the background thread until disconnected
+        if (!session->GetOutstanding())
+        {
+            try
+            {
+                session->iSCSIDisconnect();
+            }
+            catch (CException &)
+            {
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < reads.size(); i++)
+        delete reads[i];
+    delete session;
+}
+
+/*
+ * Move a session on to its next step if the current one is done. Returns
+ * true once it has finished the INQUIRY.
+ */
+static bool Advance(const Options &opts, Attempt &attempt, StormResult &result)
+{
+    std::vector<SCSIRequest *> completed;
+
+    switch (attempt.state)
+    {
+    case CONNECTING:
+        if (!attempt.session->iSCSIStepDone())
+            return false;
+        attempt.session->iSCSIFinishConnect();
+        attempt.session->iSCSIStartNormalLogin();
+        attempt.state = LOGGING_IN;
+        return false;
+
+    case LOGGING_IN:
+        if (!attempt.session->iSCSIStepDone())
+            return false;
+        attempt.session->iSCSIFinishNormalLogin();
+        result.login.Record(NowNs() - attempt.start);
+        attempt.state = INQUIRING;
+        attempt.session->iSCSIExecSCSIAsync(*attempt.inquiry, opts.lun);
+        return false;
+
+    case INQUIRING:
+        attempt.session->iSCSIWaitSCSIAsync(completed, 0);
+        if (!completed.size())
+            return false;
+        if (attempt.inquiry->GetStatus() != SCSI_STATUS_GOOD &&
+            attempt.inquiry->GetSCSISenseKey() != SCSI_SENSE_UNIT_ATTENTION)
+        {
+            EString estr;
+            estr.Format("INQUIRY failed: Status: %s, SenseKey: %s, ASCQ: %s",
+                        attempt.inquiry->StatusString().c_str(),
+                        attempt.inquiry->SenseKeyString().c_str(),
+                        attempt.inquiry->ASCQString().c_str());
+            throw CException(estr);
+        }
+        // The first command, so a Unit Attention still shows the LUN is up
+        result.firstIO.Record(NowNs() - attempt.start);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Only a logged in session is known to the background thread, and only
+ * when it has nothing outstanding. Otherwise just deleting it is enough.
+ */
+static void Fail(Attempt &attempt, StormResult &result, const std::string &error)
+{
+    if (!result.failed++)
+        result.error = error;
+
+    if (attempt.state == INQUIRING && !attempt.session->GetOutstanding())
+    {
+        try
+        {
+            attempt.session->iSCSIDisconnect();
+        }
+        catch (CException &)
+        {
+        }
+    }
+
+    delete attempt.inquiry;
+    delete attempt.session;
+}
+
+/*
+ * Keep up to concurrency sessions on their way in at once, polling them
+ * all together
+ */
+static void StormThread(const Options &opts,
+                        unsigned int first,
+                        unsigned int count,
+                        unsigned int concurrency,
+                        boost::barrier &go,
+                        StormResult &result)
+{
+    std::vector<Attempt> active;
+    std::vector<struct pollfd> pfds;
+    unsigned int next = 0;
+
+    go.wait();
+
+    while (next < count || active.size())
+    {
+        int res;
+
+        while (next < count && active.size() < concurrency)
+        {
+            Attempt attempt;
+
+            attempt.session = NewSession(opts, first + next++);
+            attempt.inquiry = new SCSIInquiry();
+            attempt.state = CONNECTING;
+            attempt.start = NowNs();
+
+            try
+            {
+                attempt.session->iSCSIStartConnect();
+                active.push_back(attempt);
+            }
+            catch (CException &e)
+            {
+                Fail(attempt, result, e.getDesc());
+            }
+        }
+
+        if (!active.size())
+            continue;
+
+        pfds.resize(active.size());
+        for (unsigned int i = 0; i < active.size(); i++)
+            active[i].session->iSCSIGetPollFd(pfds[i]);
+
+        if ((res = poll(&pfds[0], pfds.size(), opts.timeout)) <= 0)
+        {
+            EString estr;
+
+            if (res)
+                estr.Format("poll failed: %s", strerror(errno));
+            else
+                estr.Format("poll timed out: %d mSec", opts.timeout);
+
+            for (unsigned int i = 0; i < active.size(); i++)
+                Fail(active[i], result, estr);
+            active.clear();
+            continue;
+        }
+
+        // Walk backwards so finished ones can be dropped as we go
+        for (unsigned int i = active.size(); i-- > 0; )
+        {
+            if (!pfds[i].revents)
+                continue;
+
+            try
+            {
+                active[i].session->iSCSIServiceEvents(pfds[i].revents);
+                if (!Advance(opts, active[i], result))
+                    continue;
+
+                result.loggedIn++;
+                result.sessions.push_back(active[i].session);
+                delete active[i].inquiry;
+            }
+            catch (CException &e)
+            {
+                Fail(active[i], result, e.getDesc());
+            }
+
+            active.erase(active.begin() + i);
+        }
+    }
+}
+
+static void PrintPhase(const char *name, const LatencyHistogram &latency)
+{
+    printf("  %-7s %s\n", name, latency.SummaryString().c_str());
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<BackgroundResult> background;
+    std::vector<StormResult> storm;
+    boost::thread_group backgroundThreads, stormThreads;
+    StormResult total;
+    Options opts;
+    uint64_t start;
+    double secs;
+    int opt;
+
+    opts.lun = 0;
+    opts.sessions = 100;
+    opts.concurrency = 0;
+    opts.threads = 4;
+    opts.background = 0;
+    opts.iodepth = 1;
+    opts.settle = 5;
+    opts.timeout = 30000;
+
+    while ((opt = getopt(argc, argv, "a:t:i:l:n:c:T:b:q:s:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a': opts.address = optarg; break;
+        case 't': opts.target = optarg; break;
+        case 'i': opts.initiator = optarg; break;
+        case 'l': opts.lun = strtoul(optarg, NULL, 0); break;
+        case 'n': opts.sessions = strtoul(optarg, NULL, 0); break;
+        case 'c': opts.concurrency = strtoul(optarg, NULL, 0); break;
+        case 'T': opts.threads = strtoul(optarg, NULL, 0); break;
+        case 'b': opts.background = strtoul(optarg, NULL, 0); break;
+        case 'q': opts.iodepth = strtoul(optarg, NULL, 0); break;
+        case 's': opts.settle = strtoul(optarg, NULL, 0); break;
+        case 'w': opts.timeout = strtol(optarg, NULL, 0); break;
+        default: Usage(argv[0]);
+        }
+    }
+
+    if (!opts.concurrency || opts.concurrency > opts.sessions)
+        opts.concurrency = opts.sessions;
+    if (opts.threads > opts.concurrency)
+        opts.threads = opts.concurrency;
+
+    // ISID qualifiers are 16 bits
+    if (!opts.address.size() || !opts.target.size() || !opts.sessions ||
+        !opts.threads || !opts.iodepth ||
+        opts.sessions + opts.background > 65535)
+        Usage(argv[0]);
+
+    background.resize(opts.background);
+    storm.resize(opts.threads);
+
+    if (opts.background)
+    {
+        boost::barrier ready(opts.background + 1);
+
+        printf("Logging in %u background sessions\n", opts.background);
+        for (unsigned int i = 0; i < opts.background; i++)
+            backgroundThreads.create_thread(
+                boost::bind(BackgroundThread, boost::cref(opts), i,
+                            boost::ref(ready), boost::ref(background[i])));
+        ready.wait();
+
+        sleep(opts.settle);
+    }
+
+    printf("Storming with %u sessions, %u in flight, from %u threads\n",
+           opts.sessions, opts.concurrency, opts.threads);
+    fflush(stdout);
+
+    {
+        boost::barrier go(opts.threads + 1);
+        unsigned int first = opts.background;
+
+        for (unsigned int i = 0; i < opts.threads; i++)
+        {
+            // Spread any remainder over the first few threads
+            unsigned int count = opts.sessions / opts.threads +
+                                 (i < opts.sessions % opts.threads);
+            unsigned int concurrency = opts.concurrency / opts.threads +
+                                       (i < opts.concurrency % opts.threads);
+
+            stormThreads.create_thread(
+                boost::bind(StormThread, boost::cref(opts), first, count,
+                            concurrency, boost::ref(go),
+                            boost::ref(storm[i])));
+            first += count;
+        }
+
+        phase = PHASE_DURING;
+        go.wait();
+        start = NowNs();
+        stormThreads.join_all();
+        secs = (NowNs() - start) / 1000000000.0;
+        phase = PHASE_AFTER;
+    }
+
+    if (opts.background)
+    {
+        sleep(opts.settle);
+        phase = PHASE_STOP;
+        backgroundThreads.join_all();
+    }
+
+    for (unsigned int i = 0; i < storm.size(); i++)
+    {
+        total.login.Merge(storm[i].login);
+        total.firstIO.Merge(storm[i].firstIO);
+        total.loggedIn += storm[i].loggedIn;
+        total.failed += storm[i].failed;
+        if (!total.error.size())
+            total.error = storm[i].error;
+        total.sessions.insert(total.sessions.end(),
+                              storm[i].sessions.begin(),
+                              storm[i].sessions.end());
+    }
+
+    printf("Logged in %u, failed %u, in %.2f s: %.1f sessions/s\n",
+           total.loggedIn, total.failed, secs,
+           secs > 0 ? total.loggedIn / secs : 0);
+    if (total.error.size())
+        printf("First failure: %s\n", total.error.c_str());
+    printf("Login (mS):         %s\n",
+           total.login.SummaryString(1000000.0).c_str());
+    printf("First INQUIRY (mS): %s\n",
+           total.firstIO.SummaryString(1000000.0).c_str());
+
+    if (opts.background)
+    {
+        BackgroundResult merged;
+
+        for (unsigned int i = 0; i < background.size(); i++)
+        {
+            for (unsigned int p = 0; p < PHASE_STOP; p++)
+                merged.latency[p].Merge(background[i].latency[p]);
+            if (background[i].error.size())
+                printf("Background session %u failed: %s\n",
+                       i, background[i].error.c_str());
+        }
+
+        printf("Background 4K read latency (uS), iodepth %u:\n",
+               opts.iodepth);
+        PrintPhase("before", merged.latency[PHASE_BEFORE]);
+        PrintPhase("during", merged.latency[PHASE_DURING]);
+        PrintPhase("after", merged.latency[PHASE_AFTER]);
+    }
+
+    printf("Logging out\n");
+    for (unsigned int i = 0; i < total.sessions.size(); i++)
+    {
+        try
+        {
+            total.sessions[i]->iSCSINormalLogout();
+        }
+        catch (CException &e)
+        {
+            printf("Logout failed: %s\n", e.getDesc().c_str());
+        }
+
+        // Always, so the background thread lets go of it
+        try
+        {
+            total.sessions[i]->iSCSIDisconnect();
+        }
+        catch (CException &)
+        {
+        }
+        delete total.sessions[i];
+    }
+
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * How much does sleeping in poll add to a short latency, and how much does
+ * busy polling take away?
+ * 1. Logs in one session and pins this thread to a core, if given one,
+ * 2. Times back to back reads of the same blocks at queue depth one, or
+ *    NOP-OUT pings, with the event loop blocking in poll,
+ * 3. Does the same again busy polling,
+ * 4. Reports the latency percentiles, standard deviation and jitter (p99.9
+ *    less p50) for each, the difference, and the CPU each used.
+ * The reads hit the same blocks so the target should answer from cache
+ * and what is left is mostly the network and the two event loops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <vector>
+#include <string>
+
+#include "iSCSILibWrapper.h"
+#include "SCSITestUnitReady.h"
+#include "SCSIRead.h"
+#include "SCSIRetryPolicy.h"
+#include "LatencyHistogram.h"
+
+#include "EString.h"
+#include "CException.h"
+
+struct Options {
+    std::string initiator;
+    std::string target;
+    std::string address;
+    unsigned int lun;
+    unsigned int blockSize;
+    unsigned int transferSize;
+    unsigned int samples;
+    int cpu;
+    unsigned int busyPollUsecs;
+    bool ping;
+};
+
+struct Result {
+    LatencyHistogram latency;   // Nanoseconds
+    double stddev;              // Nanoseconds
+    double cpuSecs;
+    double secs;
+};
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s -a <address> -t <target> [-i <initiator>] [-l <lun>]\n"
+           "          [-b <block size>] [-x <transfer size>] [-n <samples>]\n"
+           "          [-c <cpu>] [-u <SO_BUSY_POLL uS>] [-p]\n"
+           "\n"
+           "-p pings with NOP-OUT instead of reading. Defaults: lun 0, block\n"
+           "size 512, transfer 4096, 100000 samples, not pinned, 50 uS.\n"
+           "Busy polling uses a whole core, so pin it to one with -c.\n",
+           prog);
+    exit(1);
+}
+
+static double CPUSeconds(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+static uint64_t NowNsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t TimeOne(const Options &opts,
+                        iSCSILibWrapper &iscsi,
+                        SCSIRead10 &read)
+{
+    std::vector<SCSIRequest *> completed;
+    uint64_t start = NowNsecs();
+
+    if (opts.ping)
+    {
+        iscsi.iSCSIPing();
+        return NowNsecs() - start;
+    }
+
+    read.Reset();
+    read.SetLBA(0);
+    iscsi.iSCSIExecSCSIAsync(read, opts.lun);
+    iscsi.iSCSIWaitSCSIAsync(completed, 1);
+
+    if (read.GetStatus() != SCSI_STATUS_GOOD)
+    {
+        EString estr;
+        estr.Format("Read failed: Status: %s, SenseKey: %s, ASCQ: %s",
+                    read.StatusString().c_str(),
+                    read.SenseKeyString().c_str(),
+                    read.ASCQString().c_str());
+        throw CException(estr);
+    }
+
+    return NowNsecs() - start;
+}
+
+static Result RunMode(const Options &opts,
+                      iSCSILibWrapper &iscsi,
+                      SCSIRead10 &read,
+                      bool busyPoll)
+{
+    double sum = 0, squares = 0, mean, variance, cpuStart;
+    uint64_t start;
+    Result result;
+
+    iscsi.SetBusyPoll(busyPoll, opts.busyPollUsecs);
+
+    // Settle the caches, and the socket's busy poll setting, first
+    for (unsigned int i = 0; i < opts.samples / 10 + 1; i++)
+        TimeOne(opts, iscsi, read);
+
+    cpuStart = CPUSeconds();
+    start = NowNsecs();
+
+    for (unsigned int i = 0; i < opts.samples; i++)
+    {
+        uint64_t nsecs = TimeOne(opts, iscsi, read);
+
+        result.latency.Record(nsecs);
+        sum += nsecs;
+        squares += (double)nsecs * nsecs;
+    }
+
+    result.secs = (NowNsecs() - start) / 1000000000.0;
+    result.cpuSecs = CPUSeconds() - cpuStart;
+
+    // Rounding can take it just below zero
+    mean = sum / opts.samples;
+    variance = squares / opts.samples - mean * mean;
+    result.stddev = variance > 0 ? sqrt(variance) : 0;
+
+    return result;
+}
+
+static uint64_t Jitter(const Result &result)
+{
+    return result.latency.GetPercentile(99.9) -
+           result.latency.GetPercentile(50);
+}
+
+static void PrintResult(const char *name, const Result &result)
+{
+    printf("%-8s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %6.0f%%\n",
+           name,
+           result.latency.GetMin() / 1000.0,
+           result.latency.GetPercentile(50) / 1000.0,
+           result.latency.GetPercentile(99) / 1000.0,
+           result.latency.GetPercentile(99.9) / 1000.0,
+           result.latency.GetMax() / 1000.0,
+           result.stddev / 1000.0,
+           Jitter(result) / 1000.0,
+           result.secs > 0 ? result.cpuSecs * 100.0 / result.secs : 0);
+}
+
+static void Run(const Options &opts)
+{
+    iSCSILibWrapper iscsi;
+    SCSITestUnitReady tur;
+    SCSIRetryPolicy retryPolicy;
+    SCSIRead10 read(opts.transferSize / opts.blockSize, opts.blockSize);
+    Result blocking, busy;
+
+    if (opts.initiator.size())
+        iscsi.SetInitiator(opts.initiator);
+    iscsi.SetTarget(opts.target);
+    iscsi.SetAddress(opts.address);
+
+    if (opts.cpu >= 0)
+    {
+        iscsi.SetCPUAffinity(std::vector<int>(1, opts.cpu));
+        iscsi.BindCurrentThread();
+    }
+
+    iscsi.iSCSIConnect();
+    iscsi.iSCSINormalLoginWithRedirect();
+
+    // Get the bus reset out of the way
+    iscsi.iSCSIExecSCSISyncRetry(tur, opts.lun, retryPolicy);
+    if (tur.GetStatus() != SCSI_STATUS_GOOD)
+        throw CException("Test Unit Ready failed");
+
+    blocking = RunMode(opts, iscsi, read, false);
+    busy = RunMode(opts, iscsi, read, true);
+
+    printf("%s, %u samples, %s, SO_BUSY_POLL %s\n",
+           opts.ping ? "NOP-OUT" : "read", opts.samples,
+           opts.cpu >= 0 ? "pinned" : "not pinned",
+           iscsi.IsBusyPollSocket() ? "set" : "not available");
+    printf("%-8s %8s %8s %8s %8s %8s %8s %8s %7s\n",
+           "uS", "min", "p50", "p99", "p99.9", "max", "stddev", "jitter",
+           "CPU");
+    PrintResult("blocking", blocking);
+    PrintResult("busy", busy);
+    printf("%-8s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+           "change",
+           ((double)busy.latency.GetMin() - blocking.latency.GetMin()) / 1000,
+           ((double)busy.latency.GetPercentile(50) -
+            blocking.latency.GetPercentile(50)) / 1000,
+           ((double)busy.latency.GetPercentile(99) -
+            blocking.latency.GetPercentile(99)) / 1000,
+           ((double)busy.latency.GetPercentile(99.9) -
+            blocking.latency.GetPercentile(99.9)) / 1000,
+           ((double)busy.latency.GetMax() - blocking.latency.GetMax()) / 1000,
+           (busy.stddev - blocking.stddev) / 1000,
+           ((double)Jitter(busy) - Jitter(blocking)) / 1000);
+
+    iscsi.SetBusyPoll(false);
+    iscsi.iSCSINormalLogout();
+    iscsi.iSCSIDisconnect();
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    int opt;
+
+    opts.lun = 0;
+    opts.blockSize = 512;
+    opts.transferSize = 4096;
+    opts.samples = 100000;
+    opts.cpu = -1;
+    opts.busyPollUsecs = 50;
+    opts.ping = false;
+
+    while ((opt = getopt(argc, argv, "a:t:i:l:b:x:n:c:u:p")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a': opts.address = optarg; break;
+        case 't': opts.target = optarg; break;
+        case 'i': opts.initiator = optarg; break;
+        case 'l': opts.lun = strtoul(optarg, NULL, 0); break;
+        case 'b': opts.blockSize = strtoul(optarg, NULL, 0); break;
+        case 'x': opts.transferSize = strtoul(optarg, NULL, 0); break;
+        case 'n': opts.samples = strtoul(optarg, NULL, 0); break;
+        case 'c': opts.cpu = strtol(optarg, NULL, 0); break;
+        case 'u': opts.busyPollUsecs = strtoul(optarg, NULL, 0); break;
+        case 'p': opts.ping = true; break;
+        default: Usage(argv[0]);
+        }
+    }
+
+    if (!opts.address.size() || !opts.target.size() ||
+        !opts.blockSize || opts.transferSize < opts.blockSize ||
+        !opts.samples)
+        Usage(argv[0]);
+
+    try
+    {
+        Run(opts);
+    }
+    catch (CException &e)
+    {
+        fprintf(stderr, "%s\n", e.getDesc().c_str());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * What does zero filling read buffers cost us?
+ * 1. Times memset over transfer sized buffers, which is the memory
+ *    bandwidth zero fill spends,
+ * 2. If given a target, does sequential reads for a fixed time with a new
+ *    SCSIRead10 for each, the way most tests do, first with zero fill on and
+ *    then with it off,
+ * 3. Reports throughput, CPU seconds per GB and the bandwidth saved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <vector>
+#include <string>
+
+#include "iSCSILibWrapper.h"
+#include "SCSITestUnitReady.h"
+#include "SCSIRead.h"
+#include "SCSIRetryPolicy.h"
+#include "IOBufferPool.h"
+
+#include "EString.h"
+#include "CException.h"
+
+#define GB 1000000000.0
+
+struct Options {
+    std::string initiator;
+    std::string target;
+    std::string address;
+    unsigned int lun;
+    unsigned int blockSize;
+    unsigned int transferSize;
+    unsigned int queueDepth;
+    unsigned int seconds;
+    unsigned int regionMB;
+};
+
+struct Result {
+    uint64_t bytes;
+    uint64_t zeroed;
+    double secs;
+    double cpuSecs;
+};
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s [-x <transfer size>]\n"
+           "          [-a <address> -t <target> [-i <initiator>] [-l <lun>]\n"
+           "           [-b <block size>] [-q <queue depth>] [-s <seconds>]\n"
+           "           [-r <region MB>]]\n"
+           "\n"
+           "Without a target only memset is timed. Defaults: transfer\n"
+           "1048576, lun 0, block size 512, queue depth 8, 10 seconds,\n"
+           "1024 MB region.\n",
+           prog);
+    exit(1);
+}
+
+static double CPUSeconds(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+static void TimeMemset(const Options &opts)
+{
+    boost::shared_array<uint8_t> buffer =
+        IOBufferAllocator::GetDefault().Allocate(opts.transferSize);
+    uint64_t done = 0;
+    double start, secs;
+
+    start = CPUSeconds();
+    while (done < 4 * GB)
+    {
+        memset(buffer.get(), done & 0xFF, opts.transferSize);
+        done += opts.transferSize;
+    }
+    secs = CPUSeconds() - start;
+
+    printf("memset of %u bytes: %.2f GB/s, %.1f mS CPU per GB\n",
+           opts.transferSize, done / GB / secs, secs * 1000 / (done / GB));
+}
+
+static Result RunReads(const Options &opts, bool zeroFill)
+{
+    iSCSILibWrapper iscsi;
+    SCSITestUnitReady tur;
+    SCSIRetryPolicy retryPolicy;
+    std::vector<SCSIRequest *> completed;
+    unsigned int blocks = opts.transferSize / opts.blockSize;
+    uint32_t regionBlocks = (uint64_t)opts.regionMB * 1048576 / opts.blockSize;
+    uint32_t lba = 0;
+    boost::system_time start, deadline;
+    double cpuStart;
+    Result result;
+
+    SCSIRequest::SetZeroFill(zeroFill);
+
+    if (opts.initiator.size())
+        iscsi.SetInitiator(opts.initiator);
+    iscsi.SetTarget(opts.target);
+    iscsi.SetAddress(opts.address);
+
+    iscsi.iSCSIConnect();
+    iscsi.iSCSINormalLoginWithRedirect();
+
+    // Get the bus reset out of the way
+    iscsi.iSCSIExecSCSISyncRetry(tur, opts.lun, retryPolicy);
+    if (tur.GetStatus() != SCSI_STATUS_GOOD)
+        throw CException("Test Unit Ready failed");
+
+    // Warm the pool so neither run pays for page faults
+    IOBufferPool::GetInstance().Prefault(opts.transferSize, opts.queueDepth);
+
+    result.bytes = 0;
+    result.zeroed = 0;
+    cpuStart = CPUSeconds();
+    start = boost::get_system_time();
+    deadline = start + boost::posix_time::seconds(opts.seconds);
+
+    for (unsigned int i = 0; i < opts.queueDepth; i++)
+    {
+        SCSIRead10 *read = new SCSIRead10(blocks, opts.blockSize);
+
+        read->SetLBA(lba);
+        lba = (lba + blocks) % (regionBlocks - blocks);
+        iscsi.iSCSIExecSCSIAsync(*read, opts.lun);
+    }
+
+    while (iscsi.GetOutstanding())
+    {
+        completed.clear();
+        iscsi.iSCSIWaitSCSIAsync(completed, 1);
+
+        for (unsigned int i = 0; i < completed.size(); i++)
+        {
+            SCSIRequest *read = completed[i];
+
+            if (read->GetStatus() != SCSI_STATUS_GOOD)
+            {
+                EString estr;
+                estr.Format("Read failed: Status: %s, SenseKey: %s, ASCQ: %s",
+                            read->StatusString().c_str(),
+                            read->SenseKeyString().c_str(),
+                            read->ASCQString().c_str());
+                throw CException(estr);
+            }
+
+            result.bytes += read->GetInBufferValidSize();
+            if (zeroFill)
+                result.zeroed += read->GetInBufferSize();
+            delete read;
+
+            if (boost::get_system_time() < deadline)
+            {
+                SCSIRead10 *next = new SCSIRead10(blocks, opts.blockSize);
+
+                next->SetLBA(lba);
+                lba = (lba + blocks) % (regionBlocks - blocks);
+                iscsi.iSCSIExecSCSIAsync(*next, opts.lun);
+            }
+        }
+    }
+
+    result.secs = (boost::get_system_time() - start).total_microseconds()
+                      / 1000000.0;
+    result.cpuSecs = CPUSeconds() - cpuStart;
+
+    iscsi.iSCSINormalLogout();
+    iscsi.iSCSIDisconnect();
+
+    SCSIRequest::SetZeroFill(true);
+
+    return result;
+}
+
+static double CPUPerGB(const Result &result)
+{
+    return result.bytes ? result.cpuSecs / (result.bytes / GB) : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    Result filled, unfilled;
+    int opt;
+
+    opts.lun = 0;
+    opts.blockSize = 512;
+    opts.transferSize = 1048576;
+    opts.queueDepth = 8;
+    opts.seconds = 10;
+    opts.regionMB = 1024;
+
+    while ((opt = getopt(argc, argv, "a:t:i:l:b:x:q:s:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a': opts.address = optarg; break;
+        case 't': opts.target = optarg; break;
+        case 'i': opts.initiator = optarg; break;
+        case 'l': opts.lun = strtoul(optarg, NULL, 0); break;
+        case 'b': opts.blockSize = strtoul(optarg, NULL, 0); break;
+        case 'x': opts.transferSize = strtoul(optarg, NULL, 0); break;
+        case 'q': opts.queueDepth = strtoul(optarg, NULL, 0); break;
+        case 's': opts.seconds = strtoul(optarg, NULL, 0); break;
+        case 'r': opts.regionMB = strtoul(optarg, NULL, 0); break;
+        default: Usage(argv[0]);
+        }
+    }
+
+    if (!opts.transferSize ||
+        (opts.address.size() != opts.target.size() &&
+         (!opts.address.size() || !opts.target.size())))
+        Usage(argv[0]);
+
+    TimeMemset(opts);
+
+    if (!opts.address.size())
+        return 0;
+
+    if (!opts.blockSize || opts.transferSize < opts.blockSize ||
+        !opts.queueDepth ||
+        (uint64_t)opts.regionMB * 1048576 < 2ULL * opts.transferSize)
+        Usage(argv[0]);
+
+    try
+    {
+        filled = RunReads(opts, true);
+        unfilled = RunReads(opts, false);
+    }
+    catch (CException &e)
+    {
+        printf("failed: %s\n", e.getDesc().c_str());
+        return 1;
+    }
+
+    printf("\n%-10s %10s %14s %16s\n",
+           "Zero fill", "MB/s", "CPU S per GB", "Zeroed MB/s");
+    printf("%-10s %10.1f %14.3f %16.1f\n", "On",
+           filled.bytes / filled.secs / 1000000.0,
+           CPUPerGB(filled),
+           filled.zeroed / filled.secs / 1000000.0);
+    printf("%-10s %10.1f %14.3f %16.1f\n", "Off",
+           unfilled.bytes / unfilled.secs / 1000000.0,
+           CPUPerGB(unfilled),
+           0.0);
+
+    return 0;
+}
@@ -0,0 +1,1445 @@
+/*
+ * Copyright (C) 2011 by Scale Computing, Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): Richard Sharpe <realrichardsharpe@gmail.com>
+ */
+
+/*
+ * A small fio for iSCSI targets. Runs the job described in a job file, and
+ * on the command line, and prints the results as JSON:
+ * 1. Each session gets a thread, logs in and finds the size of its LUNs,
+ * 2. Once they are all ready, each keeps iodepth requests outstanding,
+ *    spread across the LUNs, for ramp_time plus runtime seconds,
+ * 3. Only what completes after the ramp counts,
+ * 4. IOPS, bandwidth, latency percentiles and CPU per I/O are reported for
+ *    reads, writes and the total.
+ *
+ * With a rate the load is open loop instead: each session issues commands
+ * at that many per second, evenly spaced or as Poisson arrivals, whether
+ * or not earlier ones have completed. iodepth then only caps how many can
+ * be outstanding. Latency is measured from when a command was due, not
+ * when it got a slot, so queueing is not hidden; arrivals still waiting at
+ * the end count as unsent, with the time they waited. A sweep bound turns
+ * this into a search for the highest rate whose p99 stays under it.
+ *
+ * With buffer set to data or echo, reads and writes are READ BUFFER and
+ * WRITE BUFFER instead, which never touch the media. That gives the
+ * ceiling for what the transport can move, to compare with the same job
+ * on READ 10 and WRITE 10. Echo buffers are usually 4K at most.
+ *
+ * With bs=auto each LUN's transfer size comes from its Block Limits VPD
+ * page: the optimal transfer length, trimmed to the maximum and to whole
+ * granules. An explicit bs over the maximum transfer length is an error.
+ *
+ * With ping set, each session also sends a NOP-OUT that often while it
+ * runs, and the round trips are reported next to the command latency, with
+ * the difference as an estimate of the time spent at the target.
+ *
+ * With timeout set, a command that takes longer than that is aborted, or
+ * its LUN reset or session dropped as timeout_action says, and counts as
+ * an error. Commands that finished after their deadline are reported as
+ * late.
+ *
+ * With busy_poll set, each session spins waiting for completions instead
+ * of sleeping in poll, which takes the wakeup out of short latencies at
+ * the cost of a core per session. Pin the sessions with cpus. Run the job
+ * with and without it to see which a test wants, or see poll_jitter.
+ *
+ * The job file has one key=value per line, # starts a comment. Keys on the
+ * command line override the file. See tools/example.job.
+ *
+ * ANYTHING BUT A READ ONLY JOB OVERWRITES DATA ON THE LUNS.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+#include "iSCSILibWrapper.h"
+#include "SCSITestUnitReady.h"
+#include "SCSIReadCapacity.h"
+#include "SCSIRead.h"
+#include "SCSIWrite.h"
+#include "SCSIReadBuffer.h"
+#include "SCSIWriteBuffer.h"
+#include "SCSIRetryPolicy.h"
+#include "SCSIInquiry.h"
+#include "SCSITransferSplitter.h"
+#include "LatencyHistogram.h"
+#include "iSCSIMetrics.h"
+#include "Trace.h"
+
+#include "EString.h"
+#include "CException.h"
+
+struct Job {
+    std::string address;
+    std::string target;
+    std::string initiator;
+    unsigned int sessions;
+    std::vector<unsigned int> luns;
+    unsigned int iodepth;
+    unsigned int bs;        // 0 with autoBs
+    bool autoBs;            // From each LUN's Block Limits page
+    std::string rw;
+    unsigned int rwmixread;
+    unsigned int runtime;
+    unsigned int rampTime;
+    uint64_t size;          // Bytes of each LUN to use, 0 for all of it
+    bool batch;
+    std::string metrics;    // Per-interval metrics file, if any
+    unsigned int metricsInterval;
+    std::string trace;      // Chrome trace, or folded stacks if .folded
+    unsigned int rate;      // Per session, 0 for closed loop
+    bool poisson;
+    unsigned int sweepP99;  // uS, 0 for no sweep
+    unsigned int sweepSteps;
+    std::string buffer;     // none, data or echo
+    unsigned int bufferID;
+    unsigned int ping;      // NOP-OUT interval in mS, 0 for none
+    unsigned int timeout;   // Per command, mS, 0 for none
+    iSCSILibWrapper::TimeoutAction timeoutAction;
+    unsigned int busyPoll;  // SO_BUSY_POLL uS, 0 to sleep in poll
+    std::vector<int> cpus;  // Sessions are pinned to these in turn
+
+    bool random;
+    bool reads;
+    bool writes;
+};
+
+struct Stats {
+    Stats() : ios(0), bytes(0) {}
+
+    uint64_t ios;
+    uint64_t bytes;
+    LatencyHistogram latency;
+};
+
+struct SessionResult {
+    SessionResult() : errors(0), maxBacklog(0)
+        { memset(&timeouts, 0, sizeof(timeouts)); }
+
+    Stats read;
+    Stats write;
+    Stats unsent;           // Open loop arrivals never issued
+    uint64_t errors;
+    uint64_t maxBacklog;    // Most arrivals waiting for a slot
+    LatencyHistogram ping;  // NOP-OUT round trips
+    iSCSITimeoutStats timeouts;
+    std::string error;
+};
+
+struct Results {
+    Results() : errors(0), maxBacklog(0), secs(0), userSecs(0), sysSecs(0)
+        { memset(&timeouts, 0, sizeof(timeouts)); }
+
+    Stats read;
+    Stats write;
+    Stats unsent;
+    Stats total;            // Latency includes unsent
+    LatencyHistogram ping;
+    iSCSITimeoutStats timeouts;
+    uint64_t errors;
+    uint64_t maxBacklog;
+    double secs;
+    double userSecs;
+    double sysSecs;
+    std::vector<std::pair<unsigned int, std::string> > sessionErrors;
+};
+
+struct LunState {
+    unsigned int lun;
+    unsigned int blockSize;
+    uint32_t blocks;        // In the region we use
+    uint32_t next;          // For sequential jobs
+    uint32_t transferBlocks;
+};
+
+struct Slot {
+    LunState *lun;
+    SCSIRequest *read;      // SCSIRead10 or SCSIReadBuffer
+    SCSIRequest *write;
+    bool isRead;
+    uint64_t due;           // Latency is from here
+};
+
+static uint64_t startNs;
+
+static uint64_t NowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s <job file | -> [key=value ...]\n"
+           "\n"
+           "Keys: address, target, initiator, sessions (1), luns (0),\n"
+           "      iodepth (1), bs (4096, or auto), rw (read, write, randread,\n"
+           "      randwrite, rw, randrw; read), rwmixread (50), runtime (10),\n"
+           "      ramp_time (0), size (whole LUN, K/M/G allowed), batch (0),\n"
+           "      metrics (file, JSON lines if it ends in .json, else CSV),\n"
+           "      metrics_interval (1000 mS), trace (file, folded stacks if\n"
+           "      it ends in .folded, else Chrome JSON; needs make TRACE=1),\n"
+           "      rate (IOPS per session, open loop; 0), arrival (fixed,\n"
+           "      poisson; fixed), sweep_p99 (uS, find the highest rate\n"
+           "      under it, starting from rate; 0), sweep_steps (6),\n"
+           "      buffer (none, data, echo; none), buffer_id (0),\n"
+           "      ping (NOP-OUT interval, mS; 0), timeout (per command, mS;\n"
+           "      0), timeout_action (abort, lun_reset, drop; abort),\n"
+           "      busy_poll (SO_BUSY_POLL uS, spin rather than sleep; 0),\n"
+           "      cpus (pin sessions to these in turn; none)\n",
+           prog);
+    exit(1);
+}
+
+static std::string Trim(const std::string &str)
+{
+    size_t first = str.find_first_not_of(" \t\r\n");
+    size_t last = str.find_last_not_of(" \t\r\n");
+
+    if (first == std::string::npos)
+        return "";
+
+    return str.substr(first, last - first + 1);
+}
+
+static uint64_t ParseSize(const std::string &value)
+{
+    char *end;
+    uint64_t size = strtoull(value.c_str(), &end, 0);
+
+    switch (*end)
+    {
+    case 'k': case 'K': size <<= 10; break;
+    case 'm': case 'M': size <<= 20; break;
+    case 'g': case 'G': size <<= 30; break;
+    case 't': case 'T': size <<= 40; break;
+    default: break;
+    }
+
+    return size;
+}
+
+static void SetKey(Job &job, const std::string &key, const std::string &value)
+{
+    if (key == "address")
+        job.address = value;
+    else if (key == "target")
+        job.target = value;
+    else if (key == "initiator")
+        job.initiator = value;
+    else if (key == "sessions")
+        job.sessions = strtoul(value.c_str(), NULL, 0);
+    else if (key == "luns")
+    {
+        std::string rest = value;
+
+        job.luns.clear();
+        while (rest.size())
+        {
+            size_t comma = rest.find(',');
+
+            job.luns.push_back(strtoul(rest.substr(0, comma).c_str(), NULL, 0));
+            rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+        }
+    }
+    else if (key == "cpus")
+    {
+        std::string rest = value;
+
+        job.cpus.clear();
+        while (rest.size())
+        {
+            size_t comma = rest.find(',');
+
+            job.cpus.push_back(strtol(rest.substr(0, comma).c_str(), NULL, 0));
+            rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+        }
+    }
+    else if (key == "busy_poll")
+        job.busyPoll = strtoul(value.c_str(), NULL, 0);
+    else if (key == "iodepth")
+        job.iodepth = strtoul(value.c_str(), NULL, 0);
+    else if (key == "bs")
+    {
+        job.autoBs = value == "auto";
+        job.bs = job.autoBs ? 0 : ParseSize(value);
+    }
+    else if (key == "rw")
+        job.rw = value;
+    else if (key == "rwmixread")
+        job.rwmixread = strtoul(value.c_str(), NULL, 0);
+    else if (key == "runtime")
+        job.runtime = strtoul(value.c_str(), NULL, 0);
+    else if (key == "ramp_time")
+        job.rampTime = strtoul(value.c_str(), NULL, 0);
+    else if (key == "size")
+        job.size = ParseSize(value);
+    else if (key == "batch")
+        job.batch = strtoul(value.c_str(), NULL, 0) != 0;
+    else if (key == "metrics")
+        job.metrics = value;
+    else if (key == "metrics_interval")
+        job.metricsInterval = strtoul(value.c_str(), NULL, 0);
+    else if (key == "trace")
+        job.trace = value;
+    else if (key == "rate")
+        job.rate = strtoul(value.c_str(), NULL, 0);
+    else if (key == "arrival")
+    {
+        if (value != "fixed" && value != "poisson")
+            throw CException("arrival must be fixed or poisson");
+        job.poisson = value == "poisson";
+    }
+    else if (key == "sweep_p99")
+        job.sweepP99 = strtoul(value.c_str(), NULL, 0);
+    else if (key == "sweep_steps")
+        job.sweepSteps = strtoul(value.c_str(), NULL, 0);
+    else if (key == "buffer")
+    {
+        if (value != "none" && value != "data" && value != "echo")
+            throw CException("buffer must be none, data or echo");
+        job.buffer = value;
+    }
+    else if (key == "buffer_id")
+        job.bufferID = strtoul(value.c_str(), NULL, 0);
+    else if (key == "ping")
+        job.ping = strtoul(value.c_str(), NULL, 0);
+    else if (key == "timeout")
+        job.timeout = strtoul(value.c_str(), NULL, 0);
+    else if (key == "timeout_action")
+    {
+        if (value == "abort")
+            job.timeoutAction = iSCSILibWrapper::TIMEOUT_ABORT_TASK;
+        else if (value == "lun_reset")
+            job.timeoutAction = iSCSILibWrapper::TIMEOUT_LUN_RESET;
+        else if (value == "drop")
+            job.timeoutAction = iSCSILibWrapper::TIMEOUT_DROP_SESSION;
+        else
+            throw CException("timeout_action must be abort, lun_reset or "
+                             "drop");
+    }
+    else
+    {
+        EString estr;
+        estr.Format("Unknown job key: %s", key.c_str());
+        throw CException(estr);
+    }
+}
+
+static void ParseLine(Job &job, const std::string &line)
+{
+    std::string text = Trim(line.substr(0, line.find('#')));
+    size_t equals;
+
+    if (!text.size())
+        return;
+
+    if ((equals = text.find('=')) == std::string::npos)
+    {
+        EString estr;
+        estr.Format("Not key=value: %s", text.c_str());
+        throw CException(estr);
+    }
+
+    SetKey(job, Trim(text.substr(0, equals)), Trim(text.substr(equals + 1)));
+}
+
+static void LoadJob(Job &job, const char *file)
+{
+    char line[1024];
+    FILE *fp;
+
+    if (!strcmp(file, "-"))
+        return;
+
+    if (!(fp = fopen(file, "r")))
+    {
+        EString estr;
+        estr.Format("Cannot open job file %s: %s", file, strerror(errno));
+        throw CException(estr);
+    }
+
+    while (fgets(line, sizeof(line), fp))
+        ParseLine(job, line);
+
+    fclose(fp);
+}
+
+static void CheckJob(Job &job)
+{
+    if (job.rw == "read" || job.rw == "randread")
+        job.reads = true;
+    else if (job.rw == "write" || job.rw == "randwrite")
+        job.writes = true;
+    else if (job.rw == "rw" || job.rw == "randrw")
+        job.reads = job.writes = true;
+    else
+        throw CException("rw must be one of read, write, randread, "
+                         "randwrite, rw or randrw");
+    job.random = job.rw.compare(0, 4, "rand") == 0;
+
+    if (job.sweepP99 && !job.rate)
+        throw CException("A sweep needs a rate to start from");
+
+#ifndef SCSITEST_TRACE
+    if (job.trace.size())
+        throw CException("trace needs a build with make TRACE=1");
+#endif
+
+    if (!job.address.size() || !job.target.size())
+        throw CException("Need an address and a target");
+    if (job.autoBs && job.buffer != "none")
+        throw CException("bs=auto needs blocks, not a buffer");
+
+    if (!job.sessions || !job.iodepth || (!job.bs && !job.autoBs) ||
+        !job.luns.size() ||
+        job.rwmixread > 100 || !job.runtime || !job.metricsInterval)
+        throw CException("sessions, iodepth, bs, luns, runtime and "
+                         "metrics_interval must be set and rwmixread at "
+                         "most 100");
+}
+
+static std::string JSONString(const std::string &str)
+{
+    std::string out = "\"";
+
+    for (unsigned int i = 0; i < str.size(); i++)
+    {
+        char c = str[i];
+
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            EString esc;
+            esc.Format("\\u%04x", c);
+            out += esc;
+        }
+        else
+            out += c;
+    }
+
+    return out + "\"";
+}
+
+class Session
+{
+public:
+    Session(const Job &job,
+            unsigned int index,
+            boost::barrier &ready,
+            boost::barrier &go) :
+        mJob(job), mIndex(index), mReady(ready), mGo(go), mSeed(index + 1),
+        mRamped(false)
+    {
+        mIscsi.EnableMetrics();
+    }
+
+    ~Session()
+    {
+        for (unsigned int i = 0; i < mSlots.size(); i++)
+        {
+            delete mSlots[i].read;
+            delete mSlots[i].write;
+        }
+    }
+
+    void Run(void);
+    const SessionResult &GetResult(void) const { return mResult; }
+    const iSCSIMetrics &GetMetrics(void) const { return *mIscsi.GetMetrics(); }
+
+private:
+    typedef std::map<unsigned int, std::vector<SCSIRequest *> > Batches;
+
+    void setUp(void);
+    void sizeLun(LunState &lun, SCSIRetryPolicy &retryPolicy);
+    void sizeTransfer(LunState &lun, SCSIRetryPolicy &retryPolicy);
+    void sizeBuffer(LunState &lun, SCSIRetryPolicy &retryPolicy);
+    void addSlot(LunState *lun);
+    void issue(Slot &slot, Batches &batches, uint64_t due);
+    void flush(Batches &batches);
+    void complete(Slot &slot, uint64_t now, uint64_t rampEnd);
+    void runClosedLoop(uint64_t rampEnd, uint64_t stop);
+    uint64_t interArrival(void);
+    void waitUntil(uint64_t when, std::vector<SCSIRequest *> &completed);
+    void runOpenLoop(uint64_t rampEnd, uint64_t stop);
+
+    const Job &mJob;
+    unsigned int mIndex;
+    boost::barrier &mReady;
+    boost::barrier &mGo;
+    unsigned int mSeed;
+    bool mRamped;
+    iSCSILibWrapper mIscsi;
+    std::vector<LunState> mLuns;
+    std::vector<Slot> mSlots;
+    std::map<SCSIRequest *, unsigned int> mSlotOf;
+    SessionResult mResult;
+};
+
+/*
+ * How big is the LUN, and how much of it do we use?
+ */
+void Session::sizeLun(LunState &lun, SCSIRetryPolicy &retryPolicy)
+{
+    SCSIReadCapacity10 capacity;
+    uint64_t blocks;
+
+    mIscsi.iSCSIExecSCSISyncRetry(capacity, lun.lun, retryPolicy);
+    if (capacity.GetStatus() != SCSI_STATUS_GOOD)
+    {
+        EString estr;
+        estr.Format("READ CAPACITY failed on LUN %u: %s",
+                    lun.lun, capacity.StatusString().c_str());
+        throw CException(estr);
+    }
+
+    lun.blockSize = capacity.GetLogicalBlockLen();
+    if (!lun.blockSize || mJob.bs % lun.blockSize)
+    {
+        EString estr;
+        estr.Format("bs %u is not a multiple of LUN %u's block size %u",
+                    mJob.bs, lun.lun, lun.blockSize);
+        throw CException(estr);
+    }
+
+    sizeTransfer(lun, retryPolicy);
+
+    blocks = (uint64_t)capacity.GetCapacity() + 1;
+    if (mJob.size && mJob.size / lun.blockSize < blocks)
+        blocks = mJob.size / lun.blockSize;
+    // Whole transfers only
+    blocks -= blocks % lun.transferBlocks;
+    if (blocks < lun.transferBlocks)
+        throw CException("LUN or size smaller than bs");
+
+    lun.blocks = (uint32_t)blocks;
+    // Spread sequential sessions out across the LUN
+    lun.next = (uint32_t)(blocks / mJob.sessions * mIndex);
+    lun.next -= lun.next % lun.transferBlocks;
+}
+
+/*
+ * Check bs against the LUN's Block Limits page, or take it from there with
+ * bs=auto. Targets without the page get no checking, and 64K for auto.
+ */
+void Session::sizeTransfer(LunState &lun, SCSIRetryPolicy &retryPolicy)
+{
+    SCSIInquirySupportedVPDPages pages;
+    SCSITransferSplitter splitter;  // READ 10 and WRITE 10 limit
+    uint32_t max;
+
+    if (!mJob.autoBs)
+        splitter.SetOptimalTransfer(mJob.bs / lun.blockSize);
+    else
+        splitter.SetOptimalTransfer(65536 / lun.blockSize);
+
+    mIscsi.iSCSIExecSCSISyncRetry(pages, lun.lun, retryPolicy);
+    if (pages.GetStatus() == SCSI_STATUS_GOOD && pages.HasPage(0xB0))
+    {
+        SCSIInquiryBlockLimitsVPDPage limits;
+
+        mIscsi.iSCSIExecSCSISyncRetry(limits, lun.lun, retryPolicy);
+        if (limits.GetStatus() == SCSI_STATUS_GOOD)
+        {
+            if (mJob.autoBs)
+                splitter.SetLimits(limits);
+            else
+                splitter.SetMaxTransfer(limits.GetMaxTransferLength());
+        }
+    }
+
+    max = splitter.GetTransferBlocks();
+    if (!mJob.autoBs && mJob.bs / lun.blockSize > max)
+    {
+        EString estr;
+        estr.Format("bs %u is over LUN %u's maximum transfer of %u bytes",
+                    mJob.bs, lun.lun, max * lun.blockSize);
+        throw CException(estr);
+    }
+
+    lun.transferBlocks = max;
+}
+
+/*
+ * Buffer modes have no blocks, but the buffer must hold a whole transfer
+ */
+void Session::sizeBuffer(LunState &lun, SCSIRetryPolicy &retryPolicy)
+{
+    bool echo = mJob.buffer == "echo";
+    SCSIReadBuffer descriptor(echo ? SCSIReadBuffer::MODE_ECHO_DESCRIPTOR :
+                                     SCSIReadBuffer::MODE_DESCRIPTOR);
+
+    descriptor.SetBufferID(mJob.bufferID);
+    mIscsi.iSCSIExecSCSISyncRetry(descriptor, lun.lun, retryPolicy);
+    if (descriptor.GetStatus() != SCSI_STATUS_GOOD)
+    {
+        EString estr;
+        estr.Format("READ BUFFER descriptor failed on LUN %u: %s, %s",
+                    lun.lun, descriptor.StatusString().c_str(),
+                    descriptor.ASCQString().c_str());
+        throw CException(estr);
+    }
+
+    if (descriptor.GetBufferCapacity() < mJob.bs)
+    {
+        EString estr;
+        estr.Format("LUN %u's %s buffer only holds %u bytes, bs is %u",
+                    lun.lun, mJob.buffer.c_str(),
+                    descriptor.GetBufferCapacity(), mJob.bs);
+        throw CException(estr);
+    }
+
+    lun.blockSize = 1;
+    lun.blocks = 0;
+    lun.next = 0;
+    lun.transferBlocks = mJob.bs;
+}
+
+void Session::addSlot(LunState *lun)
+{
+    Slot slot;
+    unsigned int blocks = lun->transferBlocks;
+    unsigned int index = mSlots.size();
+
+    slot.lun = lun;
+    slot.read = NULL;
+    slot.write = NULL;
+    slot.isRead = false;
+    slot.due = 0;
+
+    if (mJob.buffer == "none")
+    {
+        if (mJob.reads)
+            slot.read = new SCSIRead10(blocks, lun->blockSize);
+        if (mJob.writes)
+            slot.write = new SCSIWrite10(blocks, lun->blockSize);
+    }
+    else
+    {
+        bool echo = mJob.buffer == "echo";
+
+        if (mJob.reads)
+        {
+            SCSIReadBuffer *read = new SCSIReadBuffer(
+                echo ? SCSIReadBuffer::MODE_ECHO : SCSIReadBuffer::MODE_DATA,
+                mJob.bs);
+            read->SetBufferID(mJob.bufferID);
+            slot.read = read;
+        }
+        if (mJob.writes)
+        {
+            SCSIWriteBuffer *write = new SCSIWriteBuffer(
+                echo ? SCSIWriteBuffer::MODE_ECHO : SCSIWriteBuffer::MODE_DATA,
+                mJob.bs);
+            write->SetBufferID(mJob.bufferID);
+            slot.write = write;
+        }
+    }
+
+    if (slot.write)
+        for (unsigned int j = 0; j < slot.write->GetOutBufferSize(); j++)
+            slot.write->SetOutBufferByte(j, rand_r(&mSeed));
+
+    mSlots.push_back(slot);
+    if (slot.read)
+        mSlotOf[slot.read] = index;
+    if (slot.write)
+        mSlotOf[slot.write] = index;
+}
+
+/*
+ * Log in and size up the LUNs
+ */
+void Session::setUp(void)
+{
+    SCSIRetryPolicy retryPolicy;
+
+    if (mJob.initiator.size())
+        mIscsi.SetInitiator(mJob.initiator);
+    mIscsi.SetTarget(mJob.target);
+    mIscsi.SetAddress(mJob.address);
+    mIscsi.SetSessionQualifier(mIndex + 1);
+
+    // Busy polling wants a core to itself
+    if (mJob.cpus.size())
+    {
+        mIscsi.SetCPUAffinity(
+            std::vector<int>(1, mJob.cpus[mIndex % mJob.cpus.size()]));
+        mIscsi.BindCurrentThread();
+    }
+
+    mIscsi.iSCSIConnect();
+    mIscsi.iSCSINormalLoginWithRedirect();
+
+    for (unsigned int i = 0; i < mJob.luns.size(); i++)
+    {
+        SCSITestUnitReady tur;
+        LunState lun;
+
+        lun.lun = mJob.luns[i];
+
+        // Get the bus reset out of the way
+        mIscsi.iSCSIExecSCSISyncRetry(tur, lun.lun, retryPolicy);
+
+        if (mJob.buffer == "none")
+            sizeLun(lun, retryPolicy);
+        else
+            sizeBuffer(lun, retryPolicy);
+
+        mLuns.push_back(lun);
+    }
+
+    for (unsigned int i = 0; i < mJob.iodepth; i++)
+        addSlot(&mLuns[i % mLuns.size()]);
+
+    mIscsi.SetPingInterval(mJob.ping);
+    mIscsi.SetCommandTimeout(mJob.timeout, mJob.timeoutAction);
+    mIscsi.SetBusyPoll(mJob.busyPoll != 0, mJob.busyPoll);
+}
+
+void Session::issue(Slot &slot, Batches &batches, uint64_t due)
+{
+    LunState &lun = *slot.lun;
+    unsigned int blocks = lun.transferBlocks;
+    uint32_t lba;
+    SCSIRequest *request;
+
+    slot.isRead = !mJob.writes ||
+                  (mJob.reads &&
+                   (unsigned int)rand_r(&mSeed) % 100 < mJob.rwmixread);
+    request = slot.isRead ? slot.read : slot.write;
+
+    if (request->IsExecuted())
+        request->Reset();
+
+    // Buffers have no LBA
+    if (mJob.buffer == "none")
+    {
+        if (mJob.random)
+            lba = (uint32_t)(((uint64_t)rand_r(&mSeed) * RAND_MAX +
+                              rand_r(&mSeed)) % (lun.blocks / blocks)) * blocks;
+        else
+        {
+            lba = lun.next;
+            lun.next = (lun.next + blocks) % lun.blocks;
+        }
+
+        if (slot.isRead)
+            static_cast<SCSIRead10 *>(request)->SetLBA(lba);
+        else
+            static_cast<SCSIWrite10 *>(request)->SetLBA(lba);
+    }
+
+    slot.due = due;
+    if (mJob.batch)
+        batches[lun.lun].push_back(request);
+    else
+        mIscsi.iSCSIExecSCSIAsync(*request, lun.lun);
+}
+
+void Session::flush(Batches &batches)
+{
+    for (Batches::iterator it = batches.begin(); it != batches.end(); it++)
+        if (it->second.size())
+            mIscsi.iSCSIExecBatch(it->second, it->first);
+    batches.clear();
+}
+
+void Session::complete(Slot &slot, uint64_t now, uint64_t rampEnd)
+{
+    SCSIRequest *request = slot.isRead ? (SCSIRequest *)slot.read :
+                                         (SCSIRequest *)slot.write;
+    Stats &stats = slot.isRead ? mResult.read : mResult.write;
+
+    if (request->GetStatus() != SCSI_STATUS_GOOD)
+    {
+        if (!mResult.errors++)
+        {
+            EString estr;
+            estr.Format("%s failed: Status: %s, SenseKey: %s, ASCQ: %s",
+                        slot.isRead ? "Read" : "Write",
+                        request->StatusString().c_str(),
+                        request->SenseKeyString().c_str(),
+                        request->ASCQString().c_str());
+            mResult.error = estr;
+        }
+        return;
+    }
+
+    if (now < rampEnd)
+        return;
+
+    // Round trips during the ramp do not count either
+    if (!mRamped)
+    {
+        mIscsi.ResetLatency();
+        mRamped = true;
+    }
+
+    stats.ios++;
+    stats.bytes += slot.lun->transferBlocks * slot.lun->blockSize;
+    stats.latency.Record(now - slot.due);
+}
+
+void Session::runClosedLoop(uint64_t rampEnd, uint64_t stop)
+{
+    std::vector<SCSIRequest *> completed;
+    Batches batches;
+
+    for (unsigned int i = 0; i < mSlots.size(); i++)
+        issue(mSlots[i], batches, NowNs());
+
+    while (mIscsi.GetOutstanding() || batches.size())
+    {
+        uint64_t now;
+
+        flush(batches);
+
+        completed.clear();
+        mIscsi.iSCSIWaitSCSIAsync(completed, 1);
+        now = NowNs();
+
+        for (unsigned int i = 0; i < completed.size(); i++)
+        {
+            Slot &slot = mSlots[mSlotOf[completed[i]]];
+
+            complete(slot, now, rampEnd);
+
+            // Stop on the first error, like fio
+            if (now < stop && !mResult.errors)
+                issue(slot, batches, now);
+        }
+    }
+}
+
+uint64_t Session::interArrival(void)
+{
+    double mean = 1000000000.0 / mJob.rate;
+    double uniform;
+
+    if (!mJob.poisson)
+        return (uint64_t)mean;
+
+    // Exponential gaps give Poisson arrivals. Never 0, so never log(0).
+    uniform = (rand_r(&mSeed) + 1.0) / (RAND_MAX + 2.0);
+    return (uint64_t)(-log(uniform) * mean);
+}
+
+/*
+ * Collect completions, waiting for them until when at the latest, or for
+ * ever if when is 0. Between arrivals faster than the poll tick we still
+ * get our chance, we just issue several at once.
+ */
+void Session::waitUntil(uint64_t when, std::vector<SCSIRequest *> &completed)
+{
+    struct pollfd pfds[2];
+    struct timespec ts;
+    uint64_t now = NowNs();
+    uint64_t wait = when > now ? when - now : 0;
+    unsigned int count = 1;
+    int res;
+
+    // Idle, so the background thread has the connection
+    if (!mIscsi.GetOutstanding())
+    {
+        if (wait)
+            boost::this_thread::sleep(
+                boost::posix_time::microseconds(wait / 1000));
+        return;
+    }
+
+    ts.tv_sec = wait / 1000000000;
+    ts.tv_nsec = wait % 1000000000;
+
+    mIscsi.iSCSIGetPollFd(pfds[0]);
+
+    // Command deadlines, so a hung target cannot hold us here forever
+    if (mIscsi.iSCSIGetTimerPollFd(pfds[1]))
+        count++;
+
+    // Spin until the next arrival is due or something comes in
+    if (mJob.busyPoll)
+    {
+        ts.tv_sec = ts.tv_nsec = 0;
+        while ((res = ppoll(pfds, count, &ts, NULL)) == 0 &&
+               (!when || NowNs() < when))
+            ;
+    }
+    else
+        res = ppoll(pfds, count, when ? &ts : NULL, NULL);
+
+    if (res < 0 && errno != EINTR)
+    {
+        EString estr;
+        estr.Format("poll failed: %s", strerror(errno));
+        throw CException(estr);
+    }
+
+    if (res > 0 && pfds[0].revents)
+        mIscsi.iSCSIServiceEvents(pfds[0].revents);
+    if (res > 0 && count > 1 && pfds[1].revents)
+        mIscsi.iSCSIServiceTimers();
+
+    mIscsi.iSCSIWaitSCSIAsync(completed, 0);
+}
+
+/*
+ * Arrivals are queued as they fall due and issued as slots free up. The
+ * latency of each counts from when it was due, so time spent waiting for
+ * a slot, ie, queueing behind a slow target, is not lost.
+ */
+void Session::runOpenLoop(uint64_t rampEnd, uint64_t stop)
+{
+    std::vector<SCSIRequest *> completed;
+    std::vector<unsigned int> idle;
+    std::deque<uint64_t> due;
+    Batches batches;
+    uint64_t next = startNs;
+    uint64_t end;
+
+    for (unsigned int i = mSlots.size(); i > 0; i--)
+        idle.push_back(i - 1);
+
+    // Spread fixed rate sessions out rather than have them arrive together
+    if (!mJob.poisson)
+        next += interArrival() * mIndex / mJob.sessions;
+
+    for (;;)
+    {
+        uint64_t now = NowNs();
+        bool running = now < stop && !mResult.errors;
+
+        if (running)
+        {
+            while (next <= now)
+            {
+                due.push_back(next);
+                next += interArrival();
+            }
+
+            while (due.size() && idle.size())
+            {
+                Slot &slot = mSlots[idle.back()];
+
+                idle.pop_back();
+                issue(slot, batches, due.front());
+                due.pop_front();
+            }
+
+            if (due.size() > mResult.maxBacklog)
+                mResult.maxBacklog = due.size();
+
+            flush(batches);
+        }
+        else if (!mIscsi.GetOutstanding())
+            break;
+
+        completed.clear();
+        waitUntil(running ? std::min(next, stop) : 0, completed);
+        now = NowNs();
+
+        for (unsigned int i = 0; i < completed.size(); i++)
+        {
+            unsigned int index = mSlotOf[completed[i]];
+
+            complete(mSlots[index], now, rampEnd);
+            idle.push_back(index);
+        }
+    }
+
+    // What never got a slot waited at least this long
+    end = NowNs();
+    for (unsigned int i = 0; i < due.size(); i++)
+    {
+        if (end < rampEnd)
+            break;
+
+        mResult.unsent.ios++;
+        mResult.unsent.latency.Record(end - due[i]);
+    }
+}
+
+void Session::Run(void)
+{
+    uint64_t rampEnd, stop;
+    bool ok = true;
+
+    try
+    {
+        setUp();
+    }
+    catch (CException &e)
+    {
+        mResult.error = e.getDesc();
+        mResult.errors++;
+        ok = false;
+    }
+
+    // Everyone waits, even if they failed, or the others would hang
+    mReady.wait();
+    mGo.wait();
+
+    if (!ok)
+        return;
+
+    rampEnd = startNs + mJob.rampTime * 1000000000ULL;
+    stop = rampEnd + mJob.runtime * 1000000000ULL;
+
+    try
+    {
+        if (mJob.rate)
+            runOpenLoop(rampEnd, stop);
+        else
+            runClosedLoop(rampEnd, stop);
+
+        mResult.ping = mIscsi.GetPingLatency();
+        mResult.timeouts = mIscsi.GetTimeoutStats();
+
+        mIscsi.iSCSINormalLogout();
+        mIscsi.iSCSIDisconnect();
+    }
+    catch (CException &e)
+    {
+        if (!mResult.errors++)
+            mResult.error = e.getDesc();
+    }
+}
+
+static void CPUSeconds(double &user, double &sys)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0;
+    sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+static void SleepUntil(uint64_t when)
+{
+    uint64_t now = NowNs();
+
+    if (when > now)
+        boost::this_thread::sleep(
+            boost::posix_time::microseconds((when - now) / 1000));
+}
+
+static std::string LatencyJSON(const LatencyHistogram &lat)
+{
+    EString str;
+
+    str.Format("{\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, "
+               "\"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, "
+               "\"p99.99\": %.1f, \"max\": %.1f}",
+               lat.GetMin() / 1000.0,
+               lat.GetMean() / 1000.0,
+               lat.GetPercentile(50) / 1000.0,
+               lat.GetPercentile(90) / 1000.0,
+               lat.GetPercentile(99) / 1000.0,
+               lat.GetPercentile(99.9) / 1000.0,
+               lat.GetPercentile(99.99) / 1000.0,
+               lat.GetMax() / 1000.0);
+    return str;
+}
+
+static void PrintStats(const char *name, const Stats &stats, double secs,
+                       bool last)
+{
+    printf("  \"%s\": {\n"
+           "    \"ios\": %llu,\n"
+           "    \"bytes\": %llu,\n"
+           "    \"iops\": %.1f,\n"
+           "    \"bw_bytes_per_sec\": %.1f,\n"
+           "    \"lat_usec\": %s\n"
+           "  }%s\n",
+           name,
+           (unsigned long long)stats.ios,
+           (unsigned long long)stats.bytes,
+           stats.ios / secs,
+           stats.bytes / secs,
+           LatencyJSON(stats.latency).c_str(),
+           last ? "" : ",");
+}
+
+/*
+ * The round trip, and the command latency less the round trip at the same
+ * percentile as an estimate of the time spent at the target. That is only
+ * fair for closed loop jobs, open loop latency includes queueing here.
+ */
+static void PrintPing(const Results &results)
+{
+    const LatencyHistogram &total = results.total.latency;
+    const LatencyHistogram &ping = results.ping;
+    double target[3];
+    static const double percentiles[3] = { 50, 90, 99 };
+
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        uint64_t command = total.GetPercentile(percentiles[i]);
+        uint64_t rtt = ping.GetPercentile(percentiles[i]);
+
+        target[i] = command > rtt && rtt ? (command - rtt) / 1000.0 : 0.0;
+    }
+
+    printf("  \"ping\": {\n"
+           "    \"count\": %llu,\n"
+           "    \"rtt_usec\": %s,\n"
+           "    \"target_usec\": {\"p50\": %.1f, \"p90\": %.1f, "
+           "\"p99\": %.1f}\n"
+           "  },\n",
+           (unsigned long long)ping.GetCount(),
+           LatencyJSON(ping).c_str(),
+           target[0], target[1], target[2]);
+}
+
+#ifdef SCSITEST_TRACE
+static void ExportTrace(const std::string &path)
+{
+    TraceStop();
+    try
+    {
+        if (path.size() > 7 &&
+            path.compare(path.size() - 7, 7, ".folded") == 0)
+            TraceExportFolded(path);
+        else
+            TraceExportChrome(path);
+    }
+    catch (CException &e)
+    {
+        fprintf(stderr, "%s\n", e.getDesc().c_str());
+    }
+}
+#endif
+
+static void AddStats(Stats &to, const Stats &from)
+{
+    to.ios += from.ios;
+    to.bytes += from.bytes;
+    to.latency.Merge(from.latency);
+}
+
+/*
+ * Run the job once, from logging in to logging out
+ */
+static void RunJob(const Job &job, Results &results)
+{
+    std::vector<Session *> sessions;
+    boost::thread_group threads;
+    double userStart, userEnd, sysStart, sysEnd;
+    uint64_t rampEnd, stop;
+    bool json = job.metrics.size() > 5 &&
+                job.metrics.compare(job.metrics.size() - 5, 5, ".json") == 0;
+    iSCSIMetricsExporter exporter(job.metricsInterval,
+                                  json ? iSCSIMetricsExporter::JSON_LINES :
+                                         iSCSIMetricsExporter::CSV);
+    boost::barrier ready(job.sessions + 1);
+    boost::barrier go(job.sessions + 1);
+
+    for (unsigned int i = 0; i < job.sessions; i++)
+    {
+        sessions.push_back(new Session(job, i, ready, go));
+        threads.create_thread(boost::bind(&Session::Run, sessions[i]));
+    }
+
+    // Logins are not part of the measurement
+    ready.wait();
+    if (job.metrics.size())
+    {
+        for (unsigned int i = 0; i < sessions.size(); i++)
+        {
+            EString name;
+            name.Format("session%u", i);
+            exporter.AddSession(name, sessions[i]->GetMetrics());
+        }
+
+        try
+        {
+            exporter.Start(job.metrics);
+        }
+        catch (CException &e)
+        {
+            fprintf(stderr, "%s\n", e.getDesc().c_str());
+        }
+    }
+#ifdef SCSITEST_TRACE
+    // The ring only keeps the end of a long run
+    if (job.trace.size())
+        TraceStart(1 << 20);
+#endif
+    startNs = NowNs();
+    rampEnd = startNs + job.rampTime * 1000000000ULL;
+    stop = rampEnd + job.runtime * 1000000000ULL;
+    go.wait();
+
+    SleepUntil(rampEnd);
+    CPUSeconds(userStart, sysStart);
+    SleepUntil(stop);
+    CPUSeconds(userEnd, sysEnd);
+    results.secs = (NowNs() - rampEnd) / 1000000000.0;
+    results.userSecs = userEnd - userStart;
+    results.sysSecs = sysEnd - sysStart;
+
+    threads.join_all();
+    exporter.Stop();
+#ifdef SCSITEST_TRACE
+    if (job.trace.size())
+        ExportTrace(job.trace);
+#endif
+
+    for (unsigned int i = 0; i < sessions.size(); i++)
+    {
+        const SessionResult &result = sessions[i]->GetResult();
+
+        AddStats(results.read, result.read);
+        AddStats(results.write, result.write);
+        AddStats(results.unsent, result.unsent);
+        results.ping.Merge(result.ping);
+        results.timeouts.expired += result.timeouts.expired;
+        results.timeouts.late += result.timeouts.late;
+        results.timeouts.timedOut += result.timeouts.timedOut;
+        results.errors += result.errors;
+        if (result.maxBacklog > results.maxBacklog)
+            results.maxBacklog = result.maxBacklog;
+        if (result.error.size())
+            results.sessionErrors.push_back(std::make_pair(i, result.error));
+    }
+    AddStats(results.total, results.read);
+    AddStats(results.total, results.write);
+    // Unsent arrivals count against the latency, but are not I/O done
+    results.total.latency.Merge(results.unsent.latency);
+
+    for (unsigned int i = 0; i < sessions.size(); i++)
+        delete sessions[i];
+}
+
+static void PrintJob(const Job &job)
+{
+    EString bs;
+
+    if (job.autoBs)
+        bs.append("\"auto\"");
+    else
+        bs.Format("%u", job.bs);
+
+    printf("  \"job\": {\"target\": %s, \"address\": %s, \"sessions\": %u, "
+           "\"luns\": %u, \"iodepth\": %u, \"bs\": %s, \"rw\": %s, "
+           "\"rwmixread\": %u, \"runtime\": %u, \"ramp_time\": %u, "
+           "\"size\": %llu, \"batch\": %s, \"rate\": %u, \"arrival\": %s, "
+           "\"buffer\": %s, \"ping\": %u, \"timeout\": %u, "
+           "\"busy_poll\": %u},\n",
+           JSONString(job.target).c_str(),
+           JSONString(job.address).c_str(),
+           job.sessions,
+           (unsigned int)job.luns.size(),
+           job.iodepth,
+           bs.c_str(),
+           JSONString(job.rw).c_str(),
+           job.rwmixread,
+           job.runtime,
+           job.rampTime,
+           (unsigned long long)job.size,
+           job.batch ? "true" : "false",
+           job.rate,
+           job.poisson ? "\"poisson\"" : "\"fixed\"",
+           JSONString(job.buffer).c_str(),
+           job.ping,
+           job.timeout,
+           job.busyPoll);
+}
+
+static void PrintResults(const Job &job, const Results &results)
+{
+    printf("{\n");
+    PrintJob(job);
+    printf("  \"elapsed_secs\": %.3f,\n", results.secs);
+    PrintStats("read", results.read, results.secs, false);
+    PrintStats("write", results.write, results.secs, false);
+    PrintStats("total", results.total, results.secs, false);
+    if (job.rate)
+        printf("  \"open_loop\": {\"offered_iops\": %u, \"unsent\": %llu, "
+               "\"max_backlog\": %llu},\n",
+               job.rate * job.sessions,
+               (unsigned long long)results.unsent.ios,
+               (unsigned long long)results.maxBacklog);
+    if (job.ping)
+        PrintPing(results);
+    if (job.timeout)
+        printf("  \"timeouts\": {\"expired\": %llu, \"late\": %llu, "
+               "\"timed_out\": %llu},\n",
+               (unsigned long long)results.timeouts.expired,
+               (unsigned long long)results.timeouts.late,
+               (unsigned long long)results.timeouts.timedOut);
+    printf("  \"cpu\": {\"user_secs\": %.3f, \"sys_secs\": %.3f, "
+           "\"usec_per_io\": %.2f},\n",
+           results.userSecs,
+           results.sysSecs,
+           results.total.ios ? (results.userSecs + results.sysSecs) *
+                               1000000.0 / results.total.ios : 0.0);
+    printf("  \"errors\": %llu,\n", (unsigned long long)results.errors);
+    printf("  \"session_errors\": [");
+    for (unsigned int i = 0; i < results.sessionErrors.size(); i++)
+        printf("%s\n    {\"session\": %u, \"error\": %s}",
+               i ? "," : "", results.sessionErrors[i].first,
+               JSONString(results.sessionErrors[i].second).c_str());
+    printf("]\n}\n");
+}
+
+/*
+ * Find the highest rate whose p99 is within the bound: double the rate
+ * until it fails, then bisect between the last pass and the first fail.
+ * Each step is a complete run, logins and ramp included.
+ */
+static int RunSweep(Job job)
+{
+    unsigned int good = 0, bad = 0;
+    double bestIops = 0;
+    unsigned int steps = 0;
+
+    printf("{\n");
+    PrintJob(job);
+    printf("  \"sweep_p99_usec\": %u,\n  \"sweep\": [", job.sweepP99);
+
+    while (!bad || (bad - good > 1 && steps < job.sweepSteps))
+    {
+        Results results;
+        double p99;
+        bool pass;
+
+        if (bad)
+        {
+            job.rate = good + (bad - good) / 2;
+            steps++;
+        }
+
+        RunJob(job, results);
+        p99 = results.total.latency.GetPercentile(99) / 1000.0;
+        pass = !results.errors && !results.unsent.ios &&
+               results.total.ios && p99 <= job.sweepP99;
+
+        printf("%s\n    {\"rate\": %u, \"offered_iops\": %u, \"iops\": %.1f, "
+               "\"p99_usec\": %.1f, \"unsent\": %llu, \"errors\": %llu, "
+               "\"pass\": %s}",
+               good || bad ? "," : "",
+               job.rate,
+               job.rate * job.sessions,
+               results.total.ios / results.secs,
+               p99,
+               (unsigned long long)results.unsent.ios,
+               (unsigned long long)results.errors,
+               pass ? "true" : "false");
+        fflush(stdout);
+
+        if (pass)
+        {
+            good = job.rate;
+            bestIops = results.total.ios / results.secs;
+            if (!bad)
+            {
+                // Nothing is that fast
+                if (job.rate > 0x7FFFFFFF / job.sessions)
+                    break;
+                job.rate *= 2;
+            }
+        }
+        else
+        {
+            bad = job.rate;
+            // A target that errors will not get better at a lower rate
+            if (results.errors)
+                break;
+        }
+    }
+
+    printf("\n  ],\n  \"max_rate\": %u,\n  \"max_iops\": %.1f\n}\n",
+           good, bestIops);
+
+    return good ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    Job job;
+    Results results;
+
+    if (argc < 2)
+        Usage(argv[0]);
+
+    job.sessions = 1;
+    job.luns.push_back(0);
+    job.iodepth = 1;
+    job.bs = 4096;
+    job.autoBs = false;
+    job.rw = "read";
+    job.rwmixread = 50;
+    job.runtime = 10;
+    job.rampTime = 0;
+    job.size = 0;
+    job.batch = false;
+    job.metricsInterval = 1000;
+    job.rate = 0;
+    job.poisson = false;
+    job.sweepP99 = 0;
+    job.sweepSteps = 6;
+    job.buffer = "none";
+    job.bufferID = 0;
+    job.ping = 0;
+    job.timeout = 0;
+    job.timeoutAction = iSCSILibWrapper::TIMEOUT_ABORT_TASK;
+    job.busyPoll = 0;
+    job.random = job.reads = job.writes = false;
+
+    try
+    {
+        LoadJob(job, argv[1]);
+        for (int i = 2; i < argc; i++)
+            ParseLine(job, argv[i]);
+        CheckJob(job);
+    }
+    catch (CException &e)
+    {
+        fprintf(stderr, "%s\n", e.getDesc().c_str());
+        Usage(argv[0]);
+    }
+
+    if (job.sweepP99)
+        return RunSweep(job);
+
+    RunJob(job, results);
+    PrintResults(job, results);
+
+    return results.errors ? 1 : 0;
+}